@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Compare the ART backend's key transforms (see -k) on one input: how
+# many nodes the tree ends up with, how much memory it holds and how
+# fast it ingests. The input is a perf.data or record file, or else the
+# parameters of a synthetic workload (see -S). Without one it's gen.d.
+#
+# Usage: scripts/art_keys.sh [perf.data|records|synth params]
+#
+#   scripts/art_keys.sh samples=1e6,unique=1e5,kernel=0.3
+#
+# Prints CSV: keys,unique,nodes,live_bytes,seconds,records_per_sec
+#
+set -e
+
+MAIN=${MAIN:-./main}
+TRANSFORMS=${TRANSFORMS:-"ip,le map,le ip,be map,be map,be,strip=2"}
+
+if [ -z "$1" ] || [ -f "$1" ]; then
+	set -- art $1
+else
+	set -- -S "$1" art
+fi
+
+echo "keys,unique,nodes,live_bytes,seconds,records_per_sec"
+
+for keys in $TRANSFORMS; do
+	$MAIN -k "$keys" "$@" 2>/dev/null |
+		awk -v k="$keys" '
+			/^Ingestion took/ { gsub(/[()]/, ""); secs = $3; rate = $5 }
+			/^Unique stacks:/ { unique = $3 }
+			/^  art (node[0-9]+|leaf) +[0-9]/ { nodes += $(NF - 3) - $(NF - 2) }
+			/^Live bytes:/ { sub(/,/, "", $3); live = $3 }
+			END { print "\"" k "\"," unique "," nodes "," live "," secs "," rate }'
+done
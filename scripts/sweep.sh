@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Throughput curves for every backend over synthetic workloads of 1e3 to
+# 1e8 samples. The number of unique stacks grows with the sample count
+# (samples / 10, capped at 1e6) so large runs exercise big trees rather
+# than just replaying a small set of hot stacks.
+#
+# Usage: scripts/sweep.sh [min_exp] [max_exp] [extra synth params]
+#
+#   scripts/sweep.sh 3 6 zipf=1.2,depth=32:8
+#
+# Prints CSV: backend,samples,unique,seconds,records_per_sec
+#
+set -e
+
+MAIN=${MAIN:-./main}
+BACKENDS=${BACKENDS:-"linux art hash frameart"}
+MIN=${1:-3}
+MAX=${2:-8}
+EXTRA=${3:+,$3}
+
+echo "backend,samples,unique,seconds,records_per_sec"
+
+for backend in $BACKENDS; do
+	exp=$MIN
+	while [ "$exp" -le "$MAX" ]; do
+		samples=1e$exp
+		unique=$(awk "BEGIN { u = $samples / 10; print (u > 1e6 ? 1e6 : u) }")
+
+		$MAIN -S "samples=$samples,unique=$unique$EXTRA" "$backend" |
+			awk -v b="$backend" -v s="$samples" -v u="$unique" \
+			    '/^Ingestion took/ { gsub(/[()]/, ""); print b "," s "," u "," $3 "," $5 }'
+
+		exp=$((exp + 1))
+	done
+done
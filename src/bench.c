@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "callstack.h"
+#include "cs_stats.h"
+
+static const char *phase_names[BENCH_NR_PHASES] = {
+    [BENCH_LOOKUP]   = "lookup",
+    [BENCH_INSERT]   = "insert",
+    [BENCH_STATS]    = "stats",
+    [BENCH_TEARDOWN] = "teardown",
+    [BENCH_CALLCHAIN] = "callchain",
+    [BENCH_SORT + REPORT_GRAPH_ABS]   = "sort_graph_abs",
+    [BENCH_SORT + REPORT_GRAPH_REL]   = "sort_graph_rel",
+    [BENCH_SORT + REPORT_FLAT]        = "sort_flat",
+    [BENCH_SORT + REPORT_FOLDED]      = "sort_folded",
+    [BENCH_OUTPUT + REPORT_GRAPH_ABS] = "output_graph_abs",
+    [BENCH_OUTPUT + REPORT_GRAPH_REL] = "output_graph_rel",
+    [BENCH_OUTPUT + REPORT_FLAT]      = "output_flat",
+    [BENCH_OUTPUT + REPORT_FOLDED]    = "output_folded",
+};
+
+static const char *counted_names[BENCH_NR_COUNTED] = {
+    [BENCH_COUNT_INGEST]   = "ingest",
+    [BENCH_COUNT_STATS]    = "stats",
+    [BENCH_COUNT_TEARDOWN] = "teardown",
+    [BENCH_COUNT_REPORT]   = "report",
+};
+
+static uint64_t bucket_upper(unsigned int idx)
+{
+    unsigned int shift;
+    uint64_t mantissa;
+
+    if (idx < 2 * BENCH_HIST_SUB)
+        return idx;
+
+    shift = idx / BENCH_HIST_SUB - 1;
+    mantissa = idx % BENCH_HIST_SUB + BENCH_HIST_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t bench_hist_percentile(const struct bench_hist *hist, double p)
+{
+    uint64_t target, seen = 0;
+
+    if (!hist->count)
+        return 0;
+
+    target = p * hist->count;
+    if (target < 1)
+        target = 1;
+
+    for (unsigned int i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            uint64_t v = bucket_upper(i);
+            return v < hist->max ? v : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+/* Cheapest of many back-to-back clock reads */
+static uint64_t timer_overhead(void)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = bench_now();
+        uint64_t t1 = bench_now();
+
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+
+    return best;
+}
+
+void bench_init(struct bench *bench)
+{
+    bench->runs = calloc(bench->repeats, sizeof(*bench->runs));
+    if (!bench->runs)
+        die();
+
+    memset(&bench->insert_hist, 0, sizeof(bench->insert_hist));
+    bench->timer_overhead = timer_overhead();
+    counters__open(&bench->counters);
+}
+
+void bench_exit(struct bench *bench)
+{
+    counters__close(&bench->counters);
+    free(bench->runs);
+}
+
+int bench_pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void print_string(FILE *fp, const char *key, const char *str)
+{
+    fprintf(fp, "  \"%s\": \"", key);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', fp);
+        fputc(*str, fp);
+    }
+    fprintf(fp, "\",\n");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Median of the n sorted values, the mean of the middle two if n is even */
+static uint64_t median_sorted(const uint64_t *v, unsigned int n)
+{
+    return v[(n - 1) / 2] + (v[n / 2] - v[(n - 1) / 2]) / 2;
+}
+
+/* Median of phase across all measured runs */
+static uint64_t phase_median(const struct bench *bench, enum bench_phase phase,
+                             uint64_t *min, double *mean)
+{
+    uint64_t *ns = calloc(bench->repeats, sizeof(*ns));
+    uint64_t sum = 0, median;
+
+    if (!ns)
+        die();
+
+    for (unsigned int i = 0; i < bench->repeats; i++) {
+        ns[i] = bench->runs[i].ns[phase];
+        sum += ns[i];
+    }
+    qsort(ns, bench->repeats, sizeof(*ns), cmp_u64);
+
+    *min = ns[0];
+    *mean = (double)sum / bench->repeats;
+    median = median_sorted(ns, bench->repeats);
+    free(ns);
+    return median;
+}
+
+/*
+ * Median of each counter across all measured runs, also normalized per
+ * record. Counters that weren't valid in every run are left out.
+ */
+static void report_counters(const struct bench *bench, FILE *fp)
+{
+    unsigned long records = bench->runs[0].records;
+    int nr_counted = bench->report ? BENCH_NR_COUNTED : BENCH_COUNT_REPORT;
+    uint64_t *vals;
+
+    if (!bench->counters.available) {
+        fprintf(fp, "  \"counters\": null,\n");
+        return;
+    }
+
+    vals = calloc(bench->repeats, sizeof(*vals));
+    if (!vals)
+        die();
+
+    fprintf(fp, "  \"counters\": {\n");
+    for (int p = 0; p < nr_counted; p++) {
+        bool first = true;
+
+        fprintf(fp, "    \"%s\": {", counted_names[p]);
+        for (int c = 0; c < NR_COUNTERS; c++) {
+            uint64_t median;
+            unsigned int i;
+
+            for (i = 0; i < bench->repeats; i++) {
+                const struct counter_values *v = &bench->runs[i].counters[p];
+
+                if (!v->valid[c])
+                    break;
+                vals[i] = v->val[c];
+            }
+            if (i < bench->repeats)
+                continue;
+
+            qsort(vals, bench->repeats, sizeof(*vals), cmp_u64);
+            median = median_sorted(vals, bench->repeats);
+
+            fprintf(fp, "%s\"%s\": %lu, \"%s_per_record\": %.3f",
+                    first ? "" : ", ", counter_names[c], median,
+                    counter_names[c], records ? (double)median / records : 0.0);
+            first = false;
+        }
+        fprintf(fp, "}%s\n", p < nr_counted - 1 ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    free(vals);
+}
+
+void bench_report(const struct bench *bench, FILE *fp)
+{
+    const struct bench_hist *hist = &bench->insert_hist;
+    unsigned long records = bench->runs[0].records;
+    int nr_phases = bench->report ? BENCH_NR_PHASES : BENCH_NR_INGEST_PHASES;
+    uint64_t insert_ns = 0;
+
+    fprintf(fp, "{\n");
+    print_string(fp, "backend", bench->backend);
+    print_string(fp, "treedir", bench->treedir);
+    if (bench->keys)
+        print_string(fp, "keys", bench->keys);
+    if (bench->simd)
+        print_string(fp, "simd", bench->simd);
+    print_string(fp, "input", bench->input);
+    print_string(fp, "format", bench->format);
+    fprintf(fp, "  \"warmup\": %u,\n", bench->warmup);
+    fprintf(fp, "  \"repeats\": %u,\n", bench->repeats);
+    fprintf(fp, "  \"cpu\": %d,\n", bench->cpu);
+    fprintf(fp, "  \"timer_overhead_ns\": %lu,\n", bench->timer_overhead);
+    fprintf(fp, "  \"records\": %lu,\n", records);
+    fprintf(fp, "  \"trees\": %lu,\n", bench->runs[0].trees);
+    fprintf(fp, "  \"unique\": %lu,\n", bench->runs[0].unique);
+
+    fprintf(fp, "  \"phases\": {\n");
+    for (int p = 0; p < nr_phases; p++) {
+        uint64_t min, median;
+        double mean;
+
+        median = phase_median(bench, p, &min, &mean);
+        if (p == BENCH_INSERT)
+            insert_ns = median;
+
+        fprintf(fp, "    \"%s\": {\"min_ns\": %lu, \"median_ns\": %lu, "
+                "\"mean_ns\": %.0f}%s\n", phase_names[p], min, median, mean,
+                p < nr_phases - 1 ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    fprintf(fp, "  \"ns_per_insert\": %.2f,\n",
+            records ? (double)insert_ns / records : 0.0);
+    fprintf(fp, "  \"inserts_per_sec\": %.0f,\n",
+            insert_ns ? records * 1e9 / insert_ns : 0.0);
+    fprintf(fp, "  \"insert_latency_ns\": {\"p50\": %lu, \"p99\": %lu, "
+            "\"p999\": %lu, \"max\": %lu},\n",
+            bench_hist_percentile(hist, 0.5), bench_hist_percentile(hist, 0.99),
+            bench_hist_percentile(hist, 0.999), hist->max);
+
+    /* Peak, not live: by the time it's reported everything is freed */
+    fprintf(fp, "  \"peak_bytes\": %zu,\n", bench->runs[0].peak_bytes);
+    fprintf(fp, "  \"bytes_per_unique\": %.1f,\n", bench->runs[0].unique ?
+            (double)bench->runs[0].peak_bytes / bench->runs[0].unique : 0.0);
+
+    /* Every run prints the same, so the first one's is as good as any */
+    if (bench->report) {
+        fprintf(fp, "  \"report_peak_bytes\": %zu,\n",
+                bench->runs[0].report_peak_bytes);
+        fprintf(fp, "  \"output\": {\n");
+        for (int m = 0; m < NR_REPORT_MODES; m++) {
+            const struct report_output *out = &bench->runs[0].output[m];
+
+            fprintf(fp, "    \"%s\": {\"lines\": %lu, \"bytes\": %lu}%s\n",
+                    report_mode_names[m], out->lines, out->bytes,
+                    m < NR_REPORT_MODES - 1 ? "," : "");
+        }
+        fprintf(fp, "  },\n");
+    }
+
+    report_counters(bench, fp);
+    cs_stats_json(fp);
+
+    fprintf(fp, "  \"runs\": [\n");
+    for (unsigned int i = 0; i < bench->repeats; i++) {
+        const struct bench_run *run = &bench->runs[i];
+
+        fprintf(fp, "    {");
+        for (int p = 0; p < nr_phases; p++)
+            fprintf(fp, "\"%s_ns\": %lu, ", phase_names[p], run->ns[p]);
+        fprintf(fp, "\"allocs\": %lu, \"frees\": %lu, \"peak_bytes\": %zu}%s\n",
+                run->allocs, run->frees, run->peak_bytes,
+                i < bench->repeats - 1 ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+}
@@ -1,18 +1,183 @@
+#include <malloc.h>
+#include <stdio.h>
 #include "callstack.h"
 
-unsigned long num_allocs = 0;
-void *ccalloc(size_t nmemb, size_t size)
+static const char *mem_type_names[NR_MEM_TYPES] = {
+    [MEM_OTHER]                 = "other",
+    [MEM_TREE]                  = "tree",
+    [MEM_TREE_DIR]              = "tree directory entry",
+    [MEM_MAP]                   = "map",
+    [MEM_POOL_CHUNK]            = "pool chunk",
+    [MEM_CALLCHAIN_NODE]        = "callchain_node",
+    [MEM_CALLCHAIN_LIST]        = "callchain_list",
+    [MEM_CALLCHAIN_LIST_BRANCH] = "callchain_list branch",
+    [MEM_CALLCHAIN_BRANCH]      = "branch_type_stat",
+    [MEM_CALLCHAIN_CHILDREN]    = "callchain children",
+    [MEM_CALLCHAIN_SORTED]      = "callchain sorted",
+    [MEM_CURSOR_NODE]           = "cursor node",
+    [MEM_ART_NODE4]             = "art node4",
+    [MEM_ART_NODE16]            = "art node16",
+    [MEM_ART_NODE48]            = "art node48",
+    [MEM_ART_NODE256]           = "art node256",
+    [MEM_ART_LEAF]              = "art leaf",
+    [MEM_HASH_TABLE]            = "hash table",
+    [MEM_HASH_MAP]              = "hash map array",
+    [MEM_HASH_BUCKET]           = "hash bucket",
+    [MEM_HASH_KEY]              = "hash key",
+    [MEM_FRAMEART_LEAF]         = "frameart leaf",
+    [MEM_FRAMEART_SPAN]         = "frameart span node",
+    [MEM_FRAMEART_HASH]         = "frameart hash node",
+    [MEM_FRAMEART_KEY]          = "frameart key",
+};
+
+struct mem_account mem_global;
+__thread struct mem_account *mem_account = &mem_global;
+
+void *ccalloc(size_t nmemb, size_t size, enum mem_type type)
 {
+    struct mem_account *acct = mem_account;
+    struct mem_stats *ms = &acct->types[type];
     void *ptr = calloc(nmemb, size);
-    num_allocs++;
+    size_t sz;
+
+    acct->allocs++;
+    if (!ptr)
+        return NULL;
+
+    /* What the allocator really handed out, including its rounding */
+    sz = malloc_usable_size(ptr);
+
+    ms->allocs++;
+    ms->live += sz;
+    if (ms->live > ms->peak)
+        ms->peak = ms->live;
+
+    acct->live += sz;
+    if (acct->live > acct->peak)
+        acct->peak = acct->live;
+
     return ptr;
 }
 
-unsigned long num_frees = 0;
-unsigned long leaf_frees = 0;
-void cfree(void *ptr, bool leaf)
+void cfree(void *ptr, enum mem_type type)
 {
-    num_frees++;
-    if (leaf) leaf_frees++;
+    struct mem_account *acct = mem_account;
+    struct mem_stats *ms = &acct->types[type];
+    size_t sz;
+
+    if (!ptr)
+        return;
+
+    sz = malloc_usable_size(ptr);
+
+    acct->frees++;
+    ms->frees++;
+    ms->live -= sz;
+    acct->live -= sz;
+
     free(ptr);
-}
\ No newline at end of file
+}
+
+/*
+ * Workers only free what they replace while ingesting, so stacking the
+ * peak of each on top of what's already live is close to the combined
+ * peak without having to sample every thread as it runs.
+ */
+static void mem_stats_add(struct mem_stats *to, const struct mem_stats *from)
+{
+    if (to->live + from->peak > to->peak)
+        to->peak = to->live + from->peak;
+    to->live += from->live;
+    to->allocs += from->allocs;
+    to->frees += from->frees;
+}
+
+void mem_account_add(struct mem_account *to, const struct mem_account *from)
+{
+    for (int i = 0; i < NR_MEM_TYPES; i++)
+        mem_stats_add(&to->types[i], &from->types[i]);
+
+    if (to->live + from->peak > to->peak)
+        to->peak = to->live + from->peak;
+    to->live += from->live;
+    to->allocs += from->allocs;
+    to->frees += from->frees;
+    to->pooled += from->pooled;
+}
+
+/*
+ * The same for a worker that started from a copy of base and so may free
+ * what was allocated before it: only what it changed since is added, and
+ * its peaks are counted from base's live bytes.
+ */
+static void mem_stats_join(struct mem_stats *to, const struct mem_stats *from,
+                           const struct mem_stats *base)
+{
+    if (to->live + (from->peak - base->live) > to->peak)
+        to->peak = to->live + (from->peak - base->live);
+    to->live += from->live - base->live;
+    to->allocs += from->allocs - base->allocs;
+    to->frees += from->frees - base->frees;
+}
+
+void mem_account_fork(struct mem_account *to, const struct mem_account *from)
+{
+    *to = *from;
+    for (int i = 0; i < NR_MEM_TYPES; i++)
+        to->types[i].peak = to->types[i].live;
+    to->peak = to->live;
+}
+
+void mem_account_join(struct mem_account *to, const struct mem_account *from,
+                      const struct mem_account *base)
+{
+    for (int i = 0; i < NR_MEM_TYPES; i++)
+        mem_stats_join(&to->types[i], &from->types[i], &base->types[i]);
+
+    if (to->live + (from->peak - base->live) > to->peak)
+        to->peak = to->live + (from->peak - base->live);
+    to->live += from->live - base->live;
+    to->allocs += from->allocs - base->allocs;
+    to->frees += from->frees - base->frees;
+    to->pooled += from->pooled - base->pooled;
+}
+
+void mem_stats_reset_peak(void)
+{
+    struct mem_account *acct = mem_account;
+
+    for (int i = 0; i < NR_MEM_TYPES; i++)
+        acct->types[i].peak = acct->types[i].live;
+    acct->peak = acct->live;
+}
+
+void mem_stats_print(FILE *fp, unsigned long unique)
+{
+    struct mem_stats *chunks = &mem_global.types[MEM_POOL_CHUNK];
+
+    fprintf(fp, "%-22s %12s %12s %14s %14s\n", "Memory by type",
+            "allocs", "frees", "live bytes", "peak bytes");
+
+    for (int i = 0; i < NR_MEM_TYPES; i++) {
+        struct mem_stats *ms = &mem_global.types[i];
+
+        if (!ms->allocs)
+            continue;
+
+        fprintf(fp, "  %-20s %12lu %12lu %14zu %14zu\n", mem_type_names[i],
+                ms->allocs, ms->frees, ms->live, ms->peak);
+    }
+
+    if (chunks->live) {
+        fprintf(fp, "Pool chunks: %zu bytes, %zu (%.1f%%) of them in use\n",
+                chunks->live, mem_global.pooled,
+                100.0 * mem_global.pooled / chunks->live);
+    }
+
+    fprintf(fp, "Live bytes: %zu, peak bytes: %zu", mem_global.live,
+            mem_global.peak);
+    if (unique)
+        fprintf(fp, ", %.1f bytes per unique stack",
+                (double)mem_global.live / unique);
+    fprintf(fp, "\n");
+}
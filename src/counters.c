@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include "counters.h"
+
+const char *counter_names[NR_COUNTERS] = {
+    [COUNTER_CYCLES]        = "cycles",
+    [COUNTER_INSTRUCTIONS]  = "instructions",
+    [COUNTER_L1D_MISSES]    = "l1d_misses",
+    [COUNTER_LLC_MISSES]    = "llc_misses",
+    [COUNTER_DTLB_MISSES]   = "dtlb_misses",
+    [COUNTER_BRANCH_MISSES] = "branch_misses",
+};
+
+#define HW_CACHE(cache, op, result) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_##op << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[NR_COUNTERS] = {
+    [COUNTER_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [COUNTER_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [COUNTER_L1D_MISSES]    = { PERF_TYPE_HW_CACHE,
+                                HW_CACHE(PERF_COUNT_HW_CACHE_L1D, READ, MISS) },
+    [COUNTER_LLC_MISSES]    = { PERF_TYPE_HW_CACHE,
+                                HW_CACHE(PERF_COUNT_HW_CACHE_LL, READ, MISS) },
+    [COUNTER_DTLB_MISSES]   = { PERF_TYPE_HW_CACHE,
+                                HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, READ, MISS) },
+    [COUNTER_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+int counters__open(struct counters *c)
+{
+    int err = 0;
+
+    c->available = false;
+
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = events[i].type,
+            .config = events[i].config,
+            .disabled = 1,
+            /* Count the -j workers too; they fold in when they exit */
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+
+        c->fds[i] = perf_event_open(&attr);
+        if (c->fds[i] < 0)
+            err = errno;
+        else
+            c->available = true;
+    }
+
+    if (!c->available) {
+        fprintf(stderr, "Hardware counters unavailable (%s), timing only\n",
+                strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+void counters__close(struct counters *c)
+{
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        if (c->fds[i] >= 0)
+            close(c->fds[i]);
+        c->fds[i] = -1;
+    }
+    c->available = false;
+}
+
+void counters__start(struct counters *c)
+{
+    if (!c->available)
+        return;
+
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        if (c->fds[i] < 0)
+            continue;
+        ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void counters__stop(struct counters *c, struct counter_values *v)
+{
+    memset(v, 0, sizeof(*v));
+    if (!c->available)
+        return;
+
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        if (c->fds[i] >= 0)
+            ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        /* value, time_enabled, time_running */
+        uint64_t buf[3];
+
+        if (c->fds[i] < 0 || read(c->fds[i], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+
+        /* Never scheduled, e.g. the PMU is fully booked */
+        if (!buf[2])
+            continue;
+
+        if (buf[2] < buf[1]) {
+            buf[0] = (double)buf[0] * buf[1] / buf[2];
+            v->scaled = true;
+        }
+
+        v->val[i] = buf[0];
+        v->valid[i] = true;
+    }
+}
+
+void counters__print(const struct counter_values *v, unsigned long records,
+                     FILE *fp)
+{
+    for (int i = 0; i < NR_COUNTERS; i++) {
+        if (!v->valid[i])
+            continue;
+        fprintf(fp, "  %-14s %15lu (%.2f/record)\n", counter_names[i],
+                v->val[i], records ? (double)v->val[i] / records : 0.0);
+    }
+
+    if (v->valid[COUNTER_CYCLES] && v->valid[COUNTER_INSTRUCTIONS] &&
+        v->val[COUNTER_CYCLES]) {
+        fprintf(fp, "  %-14s %15.2f\n", "ipc",
+                (double)v->val[COUNTER_INSTRUCTIONS] / v->val[COUNTER_CYCLES]);
+    }
+
+    if (v->scaled)
+        fprintf(fp, "  (multiplexed, values are scaled)\n");
+}
@@ -0,0 +1,94 @@
+#include <stdbool.h>
+#include <string.h>
+#include "cs_stats.h"
+
+struct cs_stats cs_stats_global;
+__thread struct cs_stats *cs_stats = &cs_stats_global;
+
+#ifdef CS_STATS
+static const char *cs_stat_names[NR_CS_STATS] = {
+    [CS_STAT_NODES_VISITED]     = "nodes_visited",
+    [CS_STAT_KEY_CMPS]          = "key_cmps",
+    [CS_STAT_BYTES_CMPD]        = "bytes_cmpd",
+    [CS_STAT_DIR_PROBES]        = "dir_probes",
+    [CS_STAT_CHILD_PROBES]      = "child_probes",
+    [CS_STAT_CHILDREN_ARRAY]    = "children_array",
+    [CS_STAT_CHILDREN_HASH]     = "children_hash",
+    [CS_STAT_SPLITS]            = "splits",
+    [CS_STAT_ART_GROW_16]       = "art_grow_16",
+    [CS_STAT_ART_GROW_48]       = "art_grow_48",
+    [CS_STAT_ART_GROW_256]      = "art_grow_256",
+    [CS_STAT_ART_PREFIX_KEY]    = "art_prefix_key",
+    [CS_STAT_HASH_INSERTS]      = "hash_inserts",
+    [CS_STAT_HASH_PROBES]       = "hash_probes",
+    [CS_STAT_HASH_MAX_PROBE]    = "hash_max_probe",
+    [CS_STAT_FRAMEART_GROW_SPAN] = "frameart_grow_span",
+    [CS_STAT_FRAMEART_GROW_HASH] = "frameart_grow_hash",
+};
+
+/* A maximum, not a total, so dividing it by records means nothing */
+static inline bool is_max(int i)
+{
+    return i == CS_STAT_HASH_MAX_PROBE;
+}
+
+void cs_stats_reset(void)
+{
+    memset(cs_stats, 0, sizeof(*cs_stats));
+}
+
+void cs_stats_add(struct cs_stats *to, const struct cs_stats *from)
+{
+    for (int i = 0; i < NR_CS_STATS; i++) {
+        if (!is_max(i))
+            to->val[i] += from->val[i];
+        else if (from->val[i] > to->val[i])
+            to->val[i] = from->val[i];
+    }
+}
+
+void cs_stats_print(FILE *fp, unsigned long records)
+{
+    fprintf(fp, "Insert path events:\n");
+    for (int i = 0; i < NR_CS_STATS; i++) {
+        unsigned long val = cs_stats_global.val[i];
+
+        if (!val)
+            continue;
+
+        fprintf(fp, "  %-18s %15lu", cs_stat_names[i], val);
+        if (!is_max(i) && records)
+            fprintf(fp, " (%.2f/record)", (double)val / records);
+        fprintf(fp, "\n");
+    }
+}
+
+void cs_stats_json(FILE *fp)
+{
+    bool first = true;
+
+    fprintf(fp, "  \"events\": {");
+    for (int i = 0; i < NR_CS_STATS; i++) {
+        fprintf(fp, "%s\"%s\": %lu", first ? "" : ", ", cs_stat_names[i],
+                cs_stats_global.val[i]);
+        first = false;
+    }
+    fprintf(fp, "},\n");
+}
+#else
+void cs_stats_reset(void)
+{
+}
+
+void cs_stats_add(struct cs_stats *to, const struct cs_stats *from)
+{
+}
+
+void cs_stats_print(FILE *fp, unsigned long records)
+{
+}
+
+void cs_stats_json(FILE *fp)
+{
+}
+#endif
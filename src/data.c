@@ -1 +1,383 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "data/data.h"
+
+/*
+ * Backing store for stack_entries(). Grown to the deepest stack seen so
+ * far and reused. entries_key holds it too, only so that it's freed when
+ * the thread exits.
+ */
+static __thread struct callstack_entry *entries_buf;
+static __thread unsigned int entries_sz;
+static pthread_key_t entries_key;
+
+static void init_entries_key(void)
+{
+	if (pthread_key_create(&entries_key, free))
+		die();
+}
+
+const struct callstack_entry *stack_entries(const struct stack *stack,
+					    unsigned int *nr)
+{
+	struct stack_iter it;
+	unsigned int n = 0;
+
+	if (stack->format == STACK_FMT_ENTRIES) {
+		*nr = stack->nr;
+		return stack->data;
+	}
+
+	/* Both other formats have at most ->nr frames */
+	if (stack->nr > entries_sz) {
+		static pthread_once_t once_control = PTHREAD_ONCE_INIT;
+
+		pthread_once(&once_control, init_entries_key);
+		entries_sz = stack->nr;
+		entries_buf = realloc(entries_buf, entries_sz * sizeof(*entries_buf));
+		if (!entries_buf)
+			die();
+		pthread_setspecific(entries_key, entries_buf);
+	}
+
+	stack_iter_init(&it, stack);
+	while (stack_iter_next(&it, &entries_buf[n]))
+		n++;
+
+	*nr = n;
+	return entries_buf;
+}
+
+static inline unsigned int hash_map(unsigned long map)
+{
+	/* Fibonacci hashing; maps are pointers or small ids */
+	return (map * 0x9e3779b97f4a7c15UL) >> 32;
+}
+
+static void map_table__grow_index(struct map_table *table)
+{
+	unsigned int sz = table->index_sz ? table->index_sz * 2 : 64;
+
+	free(table->index);
+	table->index = calloc(sz, sizeof(*table->index));
+	if (!table->index)
+		die();
+	table->index_sz = sz;
+
+	for (unsigned int i = 0; i < table->nr; i++) {
+		unsigned int h = hash_map(table->maps[i]) & (sz - 1);
+
+		while (table->index[h])
+			h = (h + 1) & (sz - 1);
+		table->index[h] = i + 1;
+	}
+}
+
+/* Return the index of map, adding it to the table if needed */
+static unsigned int map_table__index(struct map_table *table, unsigned long map)
+{
+	unsigned int h;
+
+	/* Keep the index at most half full */
+	if ((table->nr + 1) * 2 > table->index_sz)
+		map_table__grow_index(table);
+
+	h = hash_map(map) & (table->index_sz - 1);
+	while (table->index[h]) {
+		unsigned int i = table->index[h] - 1;
+
+		if (table->maps[i] == map)
+			return i;
+		h = (h + 1) & (table->index_sz - 1);
+	}
+
+	if (table->nr == table->alloc) {
+		table->alloc = table->alloc ? table->alloc * 2 : 64;
+		table->maps = realloc(table->maps, table->alloc * sizeof(*table->maps));
+		if (!table->maps)
+			die();
+	}
+
+	table->maps[table->nr] = map;
+	table->index[h] = table->nr + 1;
+	return table->nr++;
+}
+
+void record_buf__init(struct record_buf *buf, enum stack_format format)
+{
+	memset(buf, 0, sizeof(*buf));
+	buf->format = format;
+}
+
+void record_buf__exit(struct record_buf *buf)
+{
+	if (buf->mapping) {
+		munmap(buf->mapping, buf->mapping_sz);
+	} else {
+		free(buf->data);
+		free(buf->maps.maps);
+	}
+	free(buf->maps.index);
+	memset(buf, 0, sizeof(*buf));
+}
+
+static unsigned char *record_buf__reserve(struct record_buf *buf, size_t sz)
+{
+	if (buf->len + sz > buf->alloc) {
+		size_t alloc = buf->alloc ? buf->alloc : 4096;
+
+		while (alloc < buf->len + sz)
+			alloc *= 2;
+
+		buf->data = realloc(buf->data, alloc);
+		if (!buf->data)
+			die();
+		buf->alloc = alloc;
+	}
+	return buf->data + buf->len;
+}
+
+static inline unsigned char *varint_encode(unsigned char *p, unsigned long v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline unsigned long zigzag_encode(long v)
+{
+	return ((unsigned long)v << 1) ^ (v >> 63);
+}
+
+/* Worst case size of one encoded frame */
+#define MAX_FRAME_SZ (2 * 10)
+
+void record_buf__append(struct record_buf *buf, const struct stack *stack)
+{
+	struct callstack_entry entry;
+	struct packed_record *rec;
+	struct stack_iter it;
+	unsigned char *p, *start;
+	unsigned long prev = 0;
+	size_t sz;
+
+	/* Upper bound. ->nr is a frame count for every format */
+	sz = sizeof(*rec) + (size_t)stack->nr * MAX_FRAME_SZ + PACKED_RECORD_ALIGN;
+	rec = (struct packed_record *)record_buf__reserve(buf, sz);
+	rec->id = stack->id;
+	rec->nr = 0;
+
+	start = p = rec->data;
+	stack_iter_init(&it, stack);
+	while (stack_iter_next(&it, &entry)) {
+		if (buf->format == STACK_FMT_ENTRIES) {
+			memcpy(p, &entry, sizeof(entry));
+			p += sizeof(entry);
+		} else {
+			p = varint_encode(p, zigzag_encode(entry.ip - prev));
+			p = varint_encode(p, map_table__index(&buf->maps, entry.map));
+			prev = entry.ip;
+		}
+		rec->nr++;
+	}
+
+	rec->len = p - start;
+
+	/* Zero the padding so record files are reproducible */
+	while ((p - (unsigned char *)rec) & (PACKED_RECORD_ALIGN - 1))
+		*p++ = 0;
+
+	buf->len += p - (unsigned char *)rec;
+	buf->nr_records++;
+	buf->nr_frames += rec->nr;
+}
+
+void record_buf__append_entries(struct record_buf *buf, unsigned long id,
+				const struct callstack_entry *entries)
+{
+	struct stack stack = {
+		.id = id,
+		.format = STACK_FMT_ENTRIES,
+		.data = entries,
+	};
+
+	while (entries[stack.nr].ip)
+		stack.nr++;
+	stack.len = stack.nr * sizeof(*entries);
+
+	record_buf__append(buf, &stack);
+}
+
+int record_buf__write(struct record_buf *buf, const char *path)
+{
+	struct record_file_header header = {
+		.magic = RECORD_FILE_MAGIC,
+		.format = buf->format,
+		.nr_maps = buf->maps.nr,
+		.nr_records = buf->nr_records,
+		.len = buf->len,
+	};
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(buf->maps.maps, sizeof(*buf->maps.maps), buf->maps.nr, fp) != buf->maps.nr ||
+	    fwrite(buf->data, 1, buf->len, fp) != buf->len) {
+		perror(path);
+		fclose(fp);
+		return -1;
+	}
+
+	return fclose(fp);
+}
+
+bool is_record_file(const char *path)
+{
+	uint64_t magic = 0;
+	FILE *fp;
+	bool ret;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	ret = fread(&magic, sizeof(magic), 1, fp) == 1 &&
+	      magic == RECORD_FILE_MAGIC;
+	fclose(fp);
+	return ret;
+}
+
+/* varint_decode(), but failing if the varint is too long or runs into end */
+static bool varint_check(const unsigned char **pos, const unsigned char *end,
+			 unsigned long *v)
+{
+	const unsigned char *p = *pos;
+
+	for (unsigned int i = 0; i < 10 && p + i < end; i++) {
+		if (!(p[i] & 0x80)) {
+			*v = varint_decode(pos);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether rec lies inside the data of buf and its frames decode to
+ * exactly its len bytes, with map indexes inside the map table. The
+ * readers in data.h trust all of that.
+ */
+static bool record_valid(const struct record_buf *buf,
+			 const struct packed_record *rec)
+{
+	const unsigned char *end = buf->data + buf->len;
+	const unsigned char *p;
+	unsigned long v;
+
+	if ((size_t)(end - (const unsigned char *)rec) < sizeof(*rec) ||
+	    rec->len > (size_t)(end - rec->data))
+		return false;
+
+	if (buf->format == STACK_FMT_ENTRIES)
+		return rec->len == (size_t)rec->nr * sizeof(struct callstack_entry);
+
+	p = rec->data;
+	end = p + rec->len;
+	for (uint32_t i = 0; i < rec->nr; i++) {
+		if (!varint_check(&p, end, &v) || !varint_check(&p, end, &v) ||
+		    v >= buf->maps.nr)
+			return false;
+	}
+	return p == end;
+}
+
+int record_buf__read(struct record_buf *buf, const char *path)
+{
+	const struct packed_record *rec;
+	unsigned long nr_records = 0;
+	struct record_file_header *header;
+	struct stat st;
+	size_t maps_sz;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s: truncated record file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	header = base;
+	maps_sz = (size_t)header->nr_maps * sizeof(unsigned long);
+	if (header->magic != RECORD_FILE_MAGIC ||
+	    (header->format != STACK_FMT_ENTRIES &&
+	     header->format != STACK_FMT_PACKED) ||
+	    maps_sz > st.st_size - sizeof(*header) ||
+	    header->len > st.st_size - sizeof(*header) - maps_sz) {
+		fprintf(stderr, "%s: bad record file\n", path);
+		munmap(base, st.st_size);
+		return -1;
+	}
+
+	record_buf__init(buf, header->format);
+	buf->mapping = base;
+	buf->mapping_sz = st.st_size;
+	buf->maps.maps = (unsigned long *)(header + 1);
+	buf->maps.nr = header->nr_maps;
+	buf->data = (unsigned char *)buf->maps.maps + maps_sz;
+	buf->len = header->len;
+	buf->nr_records = header->nr_records;
+
+	/* Everything after this trusts the records, so check them all now */
+	for (rec = record_buf__first(buf); rec; rec = record_buf__next(buf, rec)) {
+		if (!record_valid(buf, rec)) {
+			fprintf(stderr, "%s: bad record at offset %zu\n", path,
+				(const unsigned char *)rec - (unsigned char *)base);
+			record_buf__exit(buf);
+			return -1;
+		}
+		buf->nr_frames += rec->nr;
+		nr_records++;
+	}
+
+	if (nr_records != buf->nr_records) {
+		fprintf(stderr, "%s: %lu records, the header says %lu\n", path,
+			nr_records, buf->nr_records);
+		record_buf__exit(buf);
+		return -1;
+	}
+
+	return 0;
+}
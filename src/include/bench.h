@@ -0,0 +1,164 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "counters.h"
+#include "report.h"
+
+/*
+ * Benchmark mode.
+ *
+ * Every run builds the trees from scratch and times four phases
+ * separately: looking up the tree for each record, inserting the record
+ * into it, the stats walk and tearing everything down again. Warmup runs
+ * are thrown away. The results of the measured runs are written out as
+ * JSON so that runs can be diffed across commits.
+ *
+ * With report set, perf report's side is timed too, between the stats
+ * walk and the teardown: getting the callchain tree of every tree (see
+ * callstack_ops->callchain), then sorting them and formatting the output
+ * in each chain mode in turn.
+ */
+
+enum bench_phase {
+    BENCH_LOOKUP,
+    BENCH_INSERT,
+    BENCH_STATS,
+    BENCH_TEARDOWN,
+    BENCH_CALLCHAIN,
+    /* One of each per enum report_mode, in its order */
+    BENCH_SORT,
+    BENCH_OUTPUT = BENCH_SORT + NR_REPORT_MODES,
+    BENCH_NR_PHASES = BENCH_OUTPUT + NR_REPORT_MODES,
+};
+
+/* Phases that are only run with report set start here */
+#define BENCH_NR_INGEST_PHASES  BENCH_CALLCHAIN
+
+/*
+ * Hardware counters are only read between phases, not per record, so
+ * lookup and insert are counted together as ingest.
+ */
+enum bench_counted {
+    BENCH_COUNT_INGEST,
+    BENCH_COUNT_STATS,
+    BENCH_COUNT_TEARDOWN,
+    /* Every report phase together */
+    BENCH_COUNT_REPORT,
+    BENCH_NR_COUNTED,
+};
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Log-linear histogram of latencies in nanoseconds.
+ *
+ * Values below 2 * BENCH_HIST_SUB get a bucket each. Above that, each
+ * power of two is split into BENCH_HIST_SUB buckets, so percentiles are
+ * accurate to within 1 / BENCH_HIST_SUB (~3%) of the true value.
+ */
+#define BENCH_HIST_SUB_BITS 5
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS  ((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+struct bench_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+};
+
+static inline unsigned int bench_hist_bucket(uint64_t v)
+{
+    unsigned int msb, shift;
+
+    if (v < 2 * BENCH_HIST_SUB)
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - BENCH_HIST_SUB_BITS;
+    return (shift + 1) * BENCH_HIST_SUB + (v >> shift) - BENCH_HIST_SUB;
+}
+
+static inline void bench_hist_add(struct bench_hist *hist, uint64_t v)
+{
+    hist->buckets[bench_hist_bucket(v)]++;
+    hist->count++;
+    if (v > hist->max)
+        hist->max = v;
+}
+
+/* Upper bound of the bucket holding the p'th quantile, 0 <= p <= 1 */
+uint64_t bench_hist_percentile(const struct bench_hist *hist, double p);
+
+struct bench_run {
+    uint64_t ns[BENCH_NR_PHASES];
+    unsigned long records;
+    unsigned long trees;
+    unsigned long allocs;
+    unsigned long frees;
+    /* Distinct stacks, if the backend counts them */
+    unsigned long unique;
+    /* Most bytes live at once, tree directory and maps included */
+    size_t peak_bytes;
+    /* The same by the end of the report phases */
+    size_t report_peak_bytes;
+    /* What each chain mode printed */
+    struct report_output output[NR_REPORT_MODES];
+    struct counter_values counters[BENCH_NR_COUNTED];
+};
+
+struct bench {
+    /* Describes the run in the report */
+    const char *backend;
+    const char *treedir;
+    /* The ART key transform given with -k, or NULL */
+    const char *keys;
+    /* The ART's kernels, see -K, or NULL for the other backends */
+    const char *simd;
+    const char *input;
+    const char *format;
+
+    unsigned int warmup;
+    unsigned int repeats;
+
+    /* Run the report phases as well */
+    bool report;
+
+    /* CPU we're pinned to, -1 if not pinned */
+    int cpu;
+
+    /*
+     * Cost of reading the clock once. Every per-record phase time and
+     * latency includes it.
+     */
+    uint64_t timer_overhead;
+
+    /* Not available means timing only */
+    struct counters counters;
+
+    /* One per measured run */
+    struct bench_run *runs;
+
+    /* Per-insert latencies of every measured run */
+    struct bench_hist insert_hist;
+};
+
+void bench_init(struct bench *bench);
+void bench_exit(struct bench *bench);
+
+/* Pin the calling thread to cpu */
+int bench_pin_cpu(int cpu);
+
+/* Write bench as a JSON object to fp */
+void bench_report(const struct bench *bench, FILE *fp);
+
+#endif /* __BENCH_H__ */
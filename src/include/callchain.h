@@ -2,10 +2,12 @@
 #ifndef __PERF_CALLCHAIN_H
 #define __PERF_CALLCHAIN_H
 
+#include <string.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
 #include "map_symbol.h"
 #include "branch.h"
+#include "mem_pool.h"
 
 struct addr_location;
 struct evsel;
@@ -57,14 +59,84 @@ enum chain_order {
 	ORDER_CALLEE
 };
 
+struct callchain_node;
+
+/*
+ * Where a frame sorts among its siblings under callchain_param.key,
+ * worked out once when the frame is appended to a cursor: the dso and
+ * either the ip or the start of its symbol. Two frames are then matched
+ * by comparing the two words.
+ *
+ * Orders that depend on strings (srclines, inlined symbol names) can't
+ * be reduced to this; such frames have slow_key set and are matched
+ * field by field as before.
+ */
+struct callchain_key {
+	u64			dso;
+	u64			addr;
+};
+
+#define CALLCHAIN_CHILDREN_INLINE	3
+#define CALLCHAIN_CHILDREN_HASH		16
+
+/*
+ * The children of a node, looked up by the key of their first frame.
+ * How they're indexed follows the fan-out: up to
+ * CALLCHAIN_CHILDREN_INLINE pointers in the node itself, then an array of
+ * keys that is scanned linearly next to the array of nodes, which past
+ * CALLCHAIN_CHILDREN_HASH children also gets a hash index.
+ *
+ * Children are appended as they're created and only sorted, into the
+ * order the rbtree that used to hold them kept, when they're walked in
+ * order.
+ */
+struct callchain_children {
+	unsigned int		nr;
+	/* Size of keys and nodes, 0 while the children are inline */
+	unsigned int		alloc;
+	bool			sorted;
+	/* Some child starts with a slow_key frame */
+	bool			has_slow;
+	union {
+		struct callchain_node	*inline_nodes[CALLCHAIN_CHILDREN_INLINE];
+		struct {
+			struct callchain_key	*keys;
+			struct callchain_node	**nodes;
+			/* 1 + index into the arrays, 0 if the slot is free */
+			u32			*index;
+		};
+	};
+};
+
+#define CALLCHAIN_SORTED_INLINE		2
+
+/*
+ * What a sort chose to show, in order: the children of a node, or for
+ * flat output the nodes of the whole tree. The arrays are only valid
+ * until the tree is sorted again or changed. nodes may be the node's own
+ * array of children, or inline_nodes when there are only a couple of
+ * them in another order.
+ */
+struct callchain_sorted {
+	struct callchain_node	**nodes;
+	unsigned int		nr;
+	struct callchain_node	*inline_nodes[CALLCHAIN_SORTED_INLINE];
+};
+
 struct callchain_node {
 	struct callchain_node	*parent;
-	struct list_head	val;
-	struct list_head	parent_val;
-	struct rb_node		rb_node_in; /* to insert nodes in an rbtree */
-	struct rb_node		rb_node;    /* to sort nodes in an output tree */
-	struct rb_root		rb_root_in; /* input tree of children */
-	struct rb_root		rb_root;    /* sorted output tree of children */
+	/*
+	 * The val_nr frames of this node, in one array so that matching a
+	 * prefix scans contiguous memory instead of chasing list pointers
+	 */
+	struct callchain_list	*val;
+	/*
+	 * Branch state for each of val, NULL until a frame with branch
+	 * info is added
+	 */
+	struct callchain_list_branch *branch;
+	struct callchain_children children;
+	struct callchain_sorted	sorted;     /* children in output order */
 	unsigned int		val_nr;
 	unsigned int		count;
 	unsigned int		children_count;
@@ -75,12 +147,17 @@ struct callchain_node {
 struct callchain_root {
 	u64			max_depth;
 	struct callchain_node	node;
+	/* Where the nodes below node and their values are allocated */
+	struct mem_pool		pool;
+	/* Where the last sort put its arrays */
+	struct mem_pool		sort_pool;
 };
 
 struct callchain_param;
 
-typedef void (*sort_chain_func_t)(struct rb_root *, struct callchain_root *,
-				 u64, struct callchain_param *);
+typedef void (*sort_chain_func_t)(struct callchain_sorted *,
+				  struct callchain_root *, u64,
+				  struct callchain_param *);
 
 enum chain_key {
 	CCKEY_FUNCTION,
@@ -115,11 +192,20 @@ struct callchain_param {
 extern struct callchain_param callchain_param;
 extern struct callchain_param callchain_param_default;
 
+/*
+ * One frame of a node, just what's needed to match and resolve it: a
+ * cache line. Branch and TUI state is kept apart in a callchain_list_branch
+ * for the profiles that have it.
+ */
 struct callchain_list {
-	struct list_head	list;
+	struct callchain_key	key;
 	u64			ip;
 	struct map_symbol	ms;
 	const char		*srcline;
+	bool			slow_key;
+};
+
+struct callchain_list_branch {
 	u64			branch_count;
 	u64			from_count;
 	u64			cycles_count;
@@ -135,24 +221,25 @@ struct callchain_list {
 };
 
 /*
- * A callchain cursor is a single linked list that
+ * A callchain cursor is an array of frames that
  * let one feed a callchain progressively.
- * It keeps persistent allocated entries to minimize
- * allocations.
+ * It keeps the array for the next callchain to
+ * minimize allocations.
  */
 struct callchain_cursor_node {
+	struct callchain_key		key;
 	u64				ip;
 	struct map_symbol		ms;
 	const char			*srcline;
 	/* Indicate valid cursor node for LBR stitch */
 	bool				valid;
+	bool				slow_key;
 
 	bool				branch;
 	struct branch_flags		branch_flags;
 	u64				branch_from;
 	int				nr_loop_iter;
 	u64				iter_cycles;
-	struct callchain_cursor_node	*next;
 };
 
 struct stitch_list {
@@ -162,24 +249,50 @@ struct stitch_list {
 
 struct callchain_cursor {
 	u64				nr;
-	struct callchain_cursor_node	*first;
-	struct callchain_cursor_node	**last;
+	/* nr frames, with room for alloc; 0 if they belong to another cursor */
+	struct callchain_cursor_node	*nodes;
+	u64				alloc;
 	u64				pos;
-	struct callchain_cursor_node	*curr;
 };
 
 static inline void callchain_init(struct callchain_root *root)
 {
-	INIT_LIST_HEAD(&root->node.val);
-	INIT_LIST_HEAD(&root->node.parent_val);
-
+	root->node.val = NULL;
+	root->node.branch = NULL;
+	root->node.val_nr = 0;
 	root->node.parent = NULL;
 	root->node.hit = 0;
 	root->node.children_hit = 0;
-	root->node.rb_root_in = RB_ROOT;
+	root->node.count = 0;
+	root->node.children_count = 0;
+	memset(&root->node.children, 0, sizeof(root->node.children));
+	memset(&root->node.sorted, 0, sizeof(root->node.sorted));
 	root->max_depth = 0;
+	mem_pool__init(&root->pool);
+	mem_pool__init(&root->sort_pool);
+}
+
+static inline struct callchain_node **
+callchain_children__nodes(struct callchain_children *children)
+{
+	return children->alloc ? children->nodes : children->inline_nodes;
 }
 
+void callchain_children__sort(struct callchain_children *children);
+
+/* Walk the children of node in the order they were created */
+#define callchain_node__for_each_child_unordered(node, child, i)		\
+	for ((i) = 0; (i) < (node)->children.nr &&				\
+	     ((child) = callchain_children__nodes(&(node)->children)[i], 1);	\
+	     (i)++)
+
+/* Walk the children of node in order, sorting them first if need be */
+#define callchain_node__for_each_child(node, child, i)			\
+	for (callchain_children__sort(&(node)->children), (i) = 0;		\
+	     (i) < (node)->children.nr &&					\
+	     ((child) = callchain_children__nodes(&(node)->children)[i], 1);	\
+	     (i)++)
+
 static inline u64 callchain_cumul_hits(struct callchain_node *node)
 {
 	return node->hit + node->children_hit;
@@ -191,12 +304,24 @@ static inline unsigned callchain_cumul_counts(struct callchain_node *node)
 }
 
 int callchain_register_param(struct callchain_param *param);
+
+/*
+ * param->sort() every tree of roots into out, the same index, on up to
+ * nr_threads threads
+ */
+void callchain_sort_trees(struct callchain_root **roots,
+			  struct callchain_sorted *out, unsigned long nr,
+			  u64 min_hit, struct callchain_param *param,
+			  unsigned int nr_threads);
 int callchain_append(struct callchain_root *root,
 		     struct callchain_cursor *cursor,
 		     u64 period);
 
 int callchain_merge(struct callchain_cursor *cursor,
 		    struct callchain_root *dst, struct callchain_root *src);
+int callchain_merge_parallel(struct callchain_root *dst,
+			     struct callchain_root *src,
+			     unsigned int nr_threads);
 
 void callchain_cursor_reset(struct callchain_cursor *cursor);
 
@@ -211,7 +336,6 @@ static inline void callchain_cursor_commit(struct callchain_cursor *cursor)
 {
 	if (cursor == NULL)
 		return;
-	cursor->curr = cursor->first;
 	cursor->pos = 0;
 }
 
@@ -222,15 +346,38 @@ callchain_cursor_current(struct callchain_cursor *cursor)
 	if (cursor == NULL || cursor->pos == cursor->nr)
 		return NULL;
 
-	return cursor->curr;
+	return &cursor->nodes[cursor->pos];
 }
 
 static inline void callchain_cursor_advance(struct callchain_cursor *cursor)
 {
-	cursor->curr = cursor->curr->next;
 	cursor->pos++;
 }
 
+/* Cursor span helpers, to read frames as a slice rather than one by one */
+
+/* All the frames of the cursor, nr of them */
+static inline struct callchain_cursor_node *
+callchain_cursor_nodes(struct callchain_cursor *cursor, u64 *nr)
+{
+	*nr = cursor->nr;
+	return cursor->nodes;
+}
+
+/* The frames from the current one on */
+static inline struct callchain_cursor_node *
+callchain_cursor_remaining(struct callchain_cursor *cursor, u64 *nr)
+{
+	*nr = cursor->nr - cursor->pos;
+	return &cursor->nodes[cursor->pos];
+}
+
+static inline void callchain_cursor_advance_n(struct callchain_cursor *cursor,
+					      u64 n)
+{
+	cursor->pos += n;
+}
+
 struct callchain_cursor *get_tls_callchain_cursor(void);
 
 int callchain_cursor__copy(struct callchain_cursor *dst,
@@ -263,15 +410,6 @@ int parse_callchain_report_opt(const char *arg);
 int parse_callchain_top_opt(const char *arg);
 int perf_callchain_config(const char *var, const char *value);
 
-static inline void callchain_cursor_snapshot(struct callchain_cursor *dest,
-					     struct callchain_cursor *src)
-{
-	*dest = *src;
-
-	dest->first = src->curr;
-	dest->nr -= src->pos;
-}
-
 #ifdef HAVE_SKIP_CALLCHAIN_IDX
 int arch_skip_callchain_idx(struct thread *thread, struct ip_callchain *chain);
 #else
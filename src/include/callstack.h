@@ -1,22 +1,27 @@
 #ifndef __CALLSTACK_H__
 #define __CALLSTACK_H__
 
-#include <stdlib.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 struct callstack_entry {
 	unsigned long ip;
 	unsigned long map;
 };
 
+struct stack;
+struct callchain_root;
+
 struct callstack_tree {
     /*
      * Insert a new stack into the tree
      *
-     * An implementation is expected to iterate over the stack and
-     * insert each entry into the tree.
+     * An implementation is expected to iterate over the stack with
+     * stack_iter_next() and insert each entry into the tree. The stack
+     * is only valid for the duration of the call.
      */
-    void (*insert)(struct callstack_tree *tree, struct callstack_entry *stack);
+    void (*insert)(struct callstack_tree *tree, const struct stack *stack);
 
     /*
      * A backend-specific private data pointer to store any object needed
@@ -34,6 +39,13 @@ struct stats {
 
     /* Average number of 100% matches in a tree */
     double avg_full_matches;
+
+    /* Distinct stacks stored and inserts that found an existing one */
+    unsigned long num_unique;
+    unsigned long num_hits;
+
+    /* Most frames in a stack of any tree */
+    unsigned long max_depth;
 };
 
 /**
@@ -68,23 +80,146 @@ struct callstack_ops {
      * Return statistics about the trees.
      */
     void (*stats)(struct callstack_tree *tree, struct stats *stats);
+
+    /*
+     * Return the callchain tree perf report would sort and print for
+     * tree, with every stack counted as many times as it was inserted.
+     * The linux backend keeps one already; the others build it from the
+     * stacks they hold the first time they're asked. It goes away with
+     * the tree.
+     */
+    struct callchain_root *(*callchain)(struct callstack_tree *tree);
 };
 
 extern struct callstack_ops *cs_ops;
 extern struct callstack_ops linux_ops;
 extern struct callstack_ops art_ops;
 extern struct callstack_ops hash_ops;
+extern struct callstack_ops frameart_ops;
+
+/* Set how the ART backend feeds frames into its keys, see src/lib/art/ops.c */
+extern int art_keys_parse(const char *arg);
+/* Select the ART's kernels, NULL for the best. Returns their name */
+extern const char *art_simd_parse(const char *arg);
 
 extern void __die(const char *func_name, int lineno);
 #define die() __die(__func__, __LINE__)
 
-extern void *ccalloc(size_t nmemb, size_t size);
-extern void cfree(void *ptr, bool leaf);
-extern unsigned long num_allocs;
-extern unsigned long num_frees;
-extern unsigned long leaf_frees;
+/*
+ * Every allocation made on behalf of a tree is tagged with the type of
+ * object it holds so that memory use can be broken down by type. Sizes
+ * are the allocator's usable size, so rounding counts against a type.
+ */
+enum mem_type {
+    MEM_OTHER,
+    /* struct callstack_tree and the backend's private data */
+    MEM_TREE,
+    MEM_TREE_DIR,
+    MEM_MAP,
+    /* Chunks of a mem_pool, whatever is allocated from them */
+    MEM_POOL_CHUNK,
+    MEM_CALLCHAIN_NODE,
+    MEM_CALLCHAIN_LIST,
+    MEM_CALLCHAIN_LIST_BRANCH,
+    MEM_CALLCHAIN_BRANCH,
+    MEM_CALLCHAIN_CHILDREN,
+    MEM_CALLCHAIN_SORTED,
+    /* Including the cursor itself */
+    MEM_CURSOR_NODE,
+    MEM_ART_NODE4,
+    MEM_ART_NODE16,
+    MEM_ART_NODE48,
+    MEM_ART_NODE256,
+    MEM_ART_LEAF,
+    MEM_HASH_TABLE,
+    MEM_HASH_MAP,
+    MEM_HASH_BUCKET,
+    MEM_HASH_KEY,
+    /* frameart nodes by layout: no children, a span or a hash table */
+    MEM_FRAMEART_LEAF,
+    MEM_FRAMEART_SPAN,
+    MEM_FRAMEART_HASH,
+    MEM_FRAMEART_KEY,
+    NR_MEM_TYPES,
+};
+
+struct mem_stats {
+    unsigned long allocs;
+    unsigned long frees;
+    size_t live;
+    size_t peak;
+};
+
+/* Everything one thread allocated and freed */
+struct mem_account {
+    struct mem_stats types[NR_MEM_TYPES];
+    unsigned long allocs;
+    unsigned long frees;
+    size_t live;
+    size_t peak;
+    /* Bytes of objects handed out by pools, already in live as chunks */
+    size_t pooled;
+};
+
+/*
+ * The process-wide account. Worker threads point mem_account at their
+ * own so that ccalloc() needs no atomics, and get added in here with
+ * mem_account_add() once they've been joined.
+ */
+extern struct mem_account mem_global;
+extern __thread struct mem_account *mem_account;
+
+extern void *ccalloc(size_t nmemb, size_t size, enum mem_type type);
+extern void cfree(void *ptr, enum mem_type type);
+
+/* Add from to to, e.g. a joined worker to mem_global */
+extern void mem_account_add(struct mem_account *to,
+                            const struct mem_account *from);
+
+/*
+ * For a worker that frees memory of the thread that started it: fork
+ * from a copy of that thread's account, base, and join back only what
+ * changed since
+ */
+extern void mem_account_fork(struct mem_account *to,
+                             const struct mem_account *from);
+extern void mem_account_join(struct mem_account *to,
+                             const struct mem_account *from,
+                             const struct mem_account *base);
+
+/* Restart peak tracking from the current live bytes */
+extern void mem_stats_reset_peak(void);
+
+/* Print mem_global by type and the bytes per unique stack */
+extern void mem_stats_print(FILE *fp, unsigned long unique);
+
+/*
+ * How a node of the linux backend indexes its children, see struct
+ * callchain_children.
+ */
+enum child_layout {
+    CHILD_LAYOUT_INLINE,
+    CHILD_LAYOUT_ARRAY,
+    CHILD_LAYOUT_HASH,
+    NR_CHILD_LAYOUTS,
+};
+
+/* Most children looked at without a match in one lookup, by layout */
+extern __thread unsigned long __max_depth[NR_CHILD_LAYOUTS];
 
 // TODO - de-dup cursor building code
-extern struct map_symbol *get_map(unsigned long map);
+struct map_symbol;
+
+/* The map of ip in address space as, see map_registry.h */
+extern struct map_symbol *get_map(unsigned long as, unsigned long ip);
+
+/* The map of every frame of a stack, in an array reused by the next call */
+extern struct map_symbol **get_maps(const struct callstack_entry *entries,
+                                    unsigned int nr);
+
+/* Add the nr frames of entries to root as a callchain, period times */
+extern void append_callchain(struct callchain_root *root,
+                             const struct callstack_entry *entries,
+                             unsigned int nr, unsigned long period);
 
 #endif /* __CALLSTACK_H__ */
@@ -0,0 +1,63 @@
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hardware counters for the process itself, and any threads it starts
+ * while counting, opened with perf_event_open().
+ *
+ * Each event is opened on its own rather than as a group so that a PMU
+ * with fewer counters than events can multiplex them; values are scaled
+ * by time_enabled / time_running. Events the CPU (or VM) doesn't support
+ * are left out. If none can be opened, e.g. because perf_event_paranoid
+ * forbids it, everything here becomes a no-op and callers fall back to
+ * timing only.
+ */
+
+enum counter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_BRANCH_MISSES,
+    NR_COUNTERS,
+};
+
+struct counters {
+    int fds[NR_COUNTERS];
+
+    /* At least one event could be opened */
+    bool available;
+};
+
+struct counter_values {
+    uint64_t val[NR_COUNTERS];
+
+    /* The event was counted. Unsupported events are skipped */
+    bool valid[NR_COUNTERS];
+
+    /* Some event only ran for part of the time and was scaled */
+    bool scaled;
+};
+
+extern const char *counter_names[NR_COUNTERS];
+
+/* Returns -1 if no counters are available */
+int counters__open(struct counters *c);
+void counters__close(struct counters *c);
+
+/* Reset and start every counter */
+void counters__start(struct counters *c);
+
+/* Stop every counter and read the values since counters__start() */
+void counters__stop(struct counters *c, struct counter_values *v);
+
+/* Print v as "  name: total (per record)" lines */
+void counters__print(const struct counter_values *v, unsigned long records,
+                     FILE *fp);
+
+#endif /* __COUNTERS_H__ */
@@ -0,0 +1,86 @@
+#ifndef __CS_STATS_H__
+#define __CS_STATS_H__
+
+#include <stdio.h>
+
+/*
+ * Counts of structural events on the insert path of every backend.
+ *
+ * Cache misses say how long the work took; these say how much work there
+ * was. They're compiled in with 'make CS_STATS=1' and compile away to
+ * nothing otherwise, so the hooks can live in the hottest loops.
+ */
+enum cs_stat {
+    /* Tree nodes (or hash buckets) looked at */
+    CS_STAT_NODES_VISITED,
+    /* Key comparisons and the bytes they covered */
+    CS_STAT_KEY_CMPS,
+    CS_STAT_BYTES_CMPD,
+    /* Tree directory slots (or rbtree nodes) looked at */
+    CS_STAT_DIR_PROBES,
+
+    /* linux: children looked at in append_chain_children() */
+    CS_STAT_CHILD_PROBES,
+    /* linux: child indexes moved out of the node, and hashed */
+    CS_STAT_CHILDREN_ARRAY,
+    CS_STAT_CHILDREN_HASH,
+    /* linux: split_add_child() calls, frameart: split() calls */
+    CS_STAT_SPLITS,
+
+    /* art: grow() promotions, by the type grown to */
+    CS_STAT_ART_GROW_16,
+    CS_STAT_ART_GROW_48,
+    CS_STAT_ART_GROW_256,
+    /* art: prefixes compared past their inline bytes, against the key */
+    CS_STAT_ART_PREFIX_KEY,
+
+    /* hash: __hash_insert() calls and their probe lengths */
+    CS_STAT_HASH_INSERTS,
+    CS_STAT_HASH_PROBES,
+    CS_STAT_HASH_MAX_PROBE,
+
+    /* frameart: nodes grown into a span, or into a (bigger) hash table */
+    CS_STAT_FRAMEART_GROW_SPAN,
+    CS_STAT_FRAMEART_GROW_HASH,
+
+    NR_CS_STATS,
+};
+
+struct cs_stats {
+    unsigned long val[NR_CS_STATS];
+};
+
+/*
+ * The calling thread's counters. Like mem_account in callstack.h, worker
+ * threads count into their own and get added to cs_stats_global after
+ * they've been joined.
+ */
+extern struct cs_stats cs_stats_global;
+extern __thread struct cs_stats *cs_stats;
+
+#ifdef CS_STATS
+#define cs_stat_inc(stat)       (cs_stats->val[stat]++)
+#define cs_stat_add(stat, n)    (cs_stats->val[stat] += (n))
+#define cs_stat_max(stat, n)                    \
+    do {                                        \
+        if ((n) > cs_stats->val[stat])          \
+            cs_stats->val[stat] = (n);          \
+    } while (0)
+#else
+#define cs_stat_inc(stat)       do { } while (0)
+#define cs_stat_add(stat, n)    do { (void)(n); } while (0)
+#define cs_stat_max(stat, n)    do { (void)(n); } while (0)
+#endif
+
+void cs_stats_reset(void);
+
+/* Add from to to, e.g. a joined worker to cs_stats_global */
+void cs_stats_add(struct cs_stats *to, const struct cs_stats *from);
+
+/* Print every counter, normalized per record. No-op unless CS_STATS */
+void cs_stats_print(FILE *fp, unsigned long records);
+
+/* Write the counters as a JSON object member. No-op unless CS_STATS */
+void cs_stats_json(FILE *fp);
+
+#endif /* __CS_STATS_H__ */
@@ -1,14 +1,301 @@
 #ifndef __DATA_H__
 #define __DATA_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/perf_event.h>
 #include "callstack.h"
 
 #define MAX_STACK_ENTRIES 256
 
+/*
+ * Fixed-size record used for the stacks compiled in from gen.d. The
+ * stack is terminated by an entry with a zero ip.
+ *
+ * Nothing consumes these directly any more. They're converted into a
+ * struct record_buf at startup.
+ */
 struct record {
 	unsigned long id;
 	struct callstack_entry stack[MAX_STACK_ENTRIES];
 };
 
+/*
+ * Encodings a stack can be stored in.
+ */
+enum stack_format {
+	/* nr x struct callstack_entry, no terminator */
+	STACK_FMT_ENTRIES,
+
+	/*
+	 * nr x u64 words of a perf ip_callchain, context markers included.
+	 * The map of a frame is the address space it lives in: ->pid for
+	 * user frames and the context marker for everything else.
+	 */
+	STACK_FMT_PERF,
+
+	/*
+	 * nr frames, each encoded as a LEB128 varint of the zigzag'd
+	 * difference to the previous frame's ip followed by a varint index
+	 * into the ->maps side table.
+	 */
+	STACK_FMT_PACKED,
+};
+
+/*
+ * A view of a single callstack. This is what callstack_tree->insert()
+ * consumes; it never owns the memory it points to.
+ */
+struct stack {
+	/* Id of the tree this stack belongs to */
+	unsigned long id;
+
+	enum stack_format format;
+
+	/* Number of frames (words for STACK_FMT_PERF) */
+	unsigned int nr;
+
+	/* Size of the encoded stack in bytes */
+	unsigned int len;
+
+	const void *data;
+
+	/* Map-index side table for STACK_FMT_PACKED */
+	const unsigned long *maps;
+
+	/* User address space for STACK_FMT_PERF */
+	unsigned long pid;
+};
+
+/*
+ * Frame iterator. All backends read stacks through this so they don't
+ * care how the stack is encoded, and never have to scan for a
+ * terminator.
+ */
+struct stack_iter {
+	const unsigned char *pos;
+	unsigned int left;
+	enum stack_format format;
+
+	/* Previous ip, for delta decoding */
+	unsigned long ip;
+
+	/* Current context, for STACK_FMT_PERF */
+	unsigned long context;
+
+	const unsigned long *maps;
+	unsigned long pid;
+};
+
+static inline void stack_iter_init(struct stack_iter *it,
+				   const struct stack *stack)
+{
+	it->pos = stack->data;
+	it->left = stack->nr;
+	it->format = stack->format;
+	it->ip = 0;
+	it->context = PERF_CONTEXT_USER;
+	it->maps = stack->maps;
+	it->pid = stack->pid;
+}
+
+static inline unsigned long varint_decode(const unsigned char **pos)
+{
+	const unsigned char *p = *pos;
+	unsigned long v = 0;
+	unsigned int shift = 0;
+
+	while (*p & 0x80) {
+		v |= (unsigned long)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	v |= (unsigned long)*p++ << shift;
+
+	*pos = p;
+	return v;
+}
+
+static inline long zigzag_decode(unsigned long v)
+{
+	return (long)(v >> 1) ^ -(long)(v & 1);
+}
+
+/*
+ * Decode the next frame into entry. Returns false once the stack is
+ * exhausted.
+ */
+static inline bool stack_iter_next(struct stack_iter *it,
+				   struct callstack_entry *entry)
+{
+	const struct callstack_entry *e;
+	const uint64_t *w;
+
+	switch (it->format) {
+	case STACK_FMT_ENTRIES:
+		if (!it->left)
+			return false;
+		e = (const struct callstack_entry *)it->pos;
+		*entry = *e;
+		it->pos += sizeof(*e);
+		it->left--;
+		return true;
+	case STACK_FMT_PERF:
+		while (it->left) {
+			w = (const uint64_t *)it->pos;
+			it->pos += sizeof(*w);
+			it->left--;
+
+			if (*w >= PERF_CONTEXT_MAX) {
+				it->context = *w;
+				continue;
+			}
+
+			/* A zero ip would look like a terminator to backends */
+			if (!*w)
+				continue;
+
+			entry->ip = *w;
+			entry->map = it->context == PERF_CONTEXT_USER ?
+				     it->pid : it->context;
+			return true;
+		}
+		return false;
+	case STACK_FMT_PACKED:
+		if (!it->left)
+			return false;
+		it->ip += zigzag_decode(varint_decode(&it->pos));
+		entry->ip = it->ip;
+		entry->map = it->maps[varint_decode(&it->pos)];
+		it->left--;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return the frames of stack as a contiguous array of callstack_entry
+ * and store the number of frames in *nr. STACK_FMT_ENTRIES stacks are
+ * returned as-is, anything else is decoded into a thread-local buffer
+ * that is overwritten by the next call.
+ *
+ * This is for backends that key on the raw bytes of the stack.
+ */
+const struct callstack_entry *stack_entries(const struct stack *stack,
+					    unsigned int *nr);
+
+/*
+ * Compact, variable-length storage for many stacks.
+ *
+ * Records are laid out back to back, each padded to 8 bytes:
+ *
+ *   [ struct packed_record | encoded frames ] [ struct packed_record | ...
+ *
+ * A 15 frame stack costs 16 + 15 * 16 bytes as STACK_FMT_ENTRIES and
+ * typically well under 100 bytes as STACK_FMT_PACKED, compared with the
+ * 4 KB of a struct record.
+ */
+struct packed_record {
+	uint64_t id;
+	uint32_t nr;
+	uint32_t len;
+	unsigned char data[];
+};
+
+#define PACKED_RECORD_ALIGN 8
+
+struct map_table {
+	/* Index -> map */
+	unsigned long *maps;
+	unsigned int nr;
+	unsigned int alloc;
+
+	/* map -> index + 1, open addressing. 0 is an empty slot */
+	unsigned int *index;
+	unsigned int index_sz;
+};
+
+struct record_buf {
+	/* STACK_FMT_ENTRIES or STACK_FMT_PACKED */
+	enum stack_format format;
+
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+
+	unsigned long nr_records;
+	unsigned long nr_frames;
+
+	struct map_table maps;
+
+	/* Non-NULL if data and maps point into a mapped record file */
+	void *mapping;
+	size_t mapping_sz;
+};
+
+void record_buf__init(struct record_buf *buf, enum stack_format format);
+void record_buf__exit(struct record_buf *buf);
+
+/* Re-encode stack in buf->format and append it */
+void record_buf__append(struct record_buf *buf, const struct stack *stack);
+
+/* Append a zero-terminated stack such as struct record::stack */
+void record_buf__append_entries(struct record_buf *buf, unsigned long id,
+				const struct callstack_entry *entries);
+
+static inline const struct packed_record *
+record_buf__first(const struct record_buf *buf)
+{
+	return buf->len ? (const struct packed_record *)buf->data : NULL;
+}
+
+static inline const struct packed_record *
+record_buf__next(const struct record_buf *buf, const struct packed_record *rec)
+{
+	size_t sz = sizeof(*rec) + rec->len;
+	const unsigned char *next;
+
+	sz = (sz + PACKED_RECORD_ALIGN - 1) & ~(size_t)(PACKED_RECORD_ALIGN - 1);
+	next = (const unsigned char *)rec + sz;
+
+	if (next >= buf->data + buf->len)
+		return NULL;
+	return (const struct packed_record *)next;
+}
+
+static inline void record_buf__stack(const struct record_buf *buf,
+				     const struct packed_record *rec,
+				     struct stack *stack)
+{
+	stack->id = rec->id;
+	stack->format = buf->format;
+	stack->nr = rec->nr;
+	stack->len = rec->len;
+	stack->data = rec->data;
+	stack->maps = buf->maps.maps;
+	stack->pid = 0;
+}
+
+/*
+ * Record files are a struct record_file_header, the map table and then
+ * the record data, all native-endian.
+ */
+#define RECORD_FILE_MAGIC 0x3130304345525343ULL /* "CSREC001" */
+
+struct record_file_header {
+	uint64_t magic;
+	uint32_t format;
+	uint32_t nr_maps;
+	uint64_t nr_records;
+	uint64_t len;
+};
+
+int record_buf__write(struct record_buf *buf, const char *path);
+
+/* Map the record file at path. buf must not be appended to afterwards */
+int record_buf__read(struct record_buf *buf, const char *path);
+
+/* Does the file at path start with RECORD_FILE_MAGIC? */
+bool is_record_file(const char *path);
 
 #endif /* __DATA_H__ */
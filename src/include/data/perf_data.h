@@ -0,0 +1,141 @@
+#ifndef __PERF_DATA_H__
+#define __PERF_DATA_H__
+
+#include <stddef.h>
+#include <linux/types.h>
+#include "callstack.h"
+#include "data/data.h"
+
+/*
+ * Reader for perf.data files written by 'perf record -g'.
+ *
+ * The whole file is mmap'd read-only and PERF_RECORD_SAMPLE records are
+ * decoded in place. Only the fields we need to build trees (the sample
+ * id, ip, pid and the ip_callchain) are pulled out. Mmap records can be
+ * handed to a callback to resolve ips to maps; everything else is
+ * skipped over.
+ */
+
+/* Upper bound on the number of event attrs we track per file */
+#define PERF_DATA_MAX_ATTRS 64
+
+struct perf_data_attr {
+    u64 sample_type;
+    u64 read_format;
+};
+
+/*
+ * A sample id and the attr it belongs to. perf record gives an attr an id
+ * per cpu or thread it opened the event on, all in the attr's ids section.
+ */
+struct perf_data_id {
+    u64 id;
+    struct perf_data_attr *attr;
+};
+
+struct perf_data_sample {
+    /* Value of PERF_SAMPLE_IDENTIFIER or PERF_SAMPLE_ID, 0 if missing */
+    u64 id;
+
+    /* Value of PERF_SAMPLE_IP, 0 if missing */
+    u64 ip;
+
+    /* Value of PERF_SAMPLE_TID's pid, 0 if missing */
+    u32 pid;
+
+    /*
+     * The raw ip_callchain. Entries >= PERF_CONTEXT_MAX are context
+     * markers (PERF_CONTEXT_KERNEL, PERF_CONTEXT_USER, ...) rather
+     * than instruction pointers.
+     */
+    u64 nr;
+    const u64 *ips;
+};
+
+/* A PERF_RECORD_MMAP or MMAP2 */
+struct perf_data_mmap {
+    /*
+     * Address space it was mapped into, as stack entries of
+     * STACK_FMT_PERF name it: the pid for user space, the context
+     * (PERF_CONTEXT_KERNEL, ...) otherwise.
+     */
+    unsigned long as;
+    u64 start;
+    u64 len;
+    u64 pgoff;
+};
+
+struct perf_data_reader {
+    int fd;
+    void *base;
+    size_t size;
+
+    /* Cursor into the data section */
+    const char *pos;
+    const char *end;
+
+    struct perf_data_attr attrs[PERF_DATA_MAX_ATTRS];
+    unsigned int nr_attrs;
+
+    /*
+     * If every attr has the same sample_type we can decode samples
+     * without looking up the attr by id.
+     */
+    bool same_sample_type;
+
+    /* Otherwise the ids of every attr, sorted by id */
+    struct perf_data_id *ids;
+    unsigned long nr_ids;
+
+    /* Records we walked past without decoding */
+    unsigned long nr_skipped;
+    /* Samples among them whose id is in no attr's ids section */
+    unsigned long nr_unknown_id;
+
+    /* Called for every mmap record, if set after perf_data__open() */
+    void (*mmap_cb)(const struct perf_data_mmap *mmap);
+};
+
+int perf_data__open(struct perf_data_reader *reader, const char *path);
+void perf_data__close(struct perf_data_reader *reader);
+
+/*
+ * Decode the next PERF_RECORD_SAMPLE that carries a callchain with at
+ * least one ip in it. Samples with an empty callchain, or one of context
+ * markers only, are skipped so no backend sees a stack without frames.
+ *
+ * Returns 1 if a sample was decoded, 0 at the end of the data section
+ * and -1 if the file is malformed.
+ */
+int perf_data__next(struct perf_data_reader *reader,
+                    struct perf_data_sample *sample);
+
+/*
+ * Return the id of the tree that sample belongs to.
+ *
+ * perf report keeps one callchain tree per hist_entry, i.e. per sampled
+ * symbol. Without symbol resolution the sampled ip is the closest stand-in
+ * so we use that, falling back to the sample id.
+ */
+static inline unsigned long perf_data__tree_id(struct perf_data_sample *sample)
+{
+    return sample->ip ? sample->ip : sample->id;
+}
+
+/*
+ * Point stack at the callchain of sample. The callchain is consumed in
+ * place out of the mapping, see STACK_FMT_PERF.
+ */
+static inline void perf_data__sample_stack(struct perf_data_sample *sample,
+                                           struct stack *stack)
+{
+    stack->id = perf_data__tree_id(sample);
+    stack->format = STACK_FMT_PERF;
+    stack->nr = sample->nr;
+    stack->len = sample->nr * sizeof(u64);
+    stack->data = sample->ips;
+    stack->maps = NULL;
+    stack->pid = sample->pid;
+}
+
+#endif /* __PERF_DATA_H__ */
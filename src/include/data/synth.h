@@ -0,0 +1,107 @@
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include <stdint.h>
+#include "data/data.h"
+
+/*
+ * Seeded synthetic callstack workloads.
+ *
+ * A pool of ->unique stacks is generated up front by walking a synthetic
+ * call graph from the outermost caller down: every frame has ->fanout
+ * possible callees, so stacks share prefixes the way real profiles do.
+ * Samples are then drawn from the pool with Zipf-distributed popularity
+ * and streamed out one at a time, so runs of 1e8 samples don't need 1e8
+ * records in memory.
+ *
+ * The pool is built once and only read after that: any number of
+ * streams, on any threads, can draw from it, each with an RNG of its
+ * own. The same parameters always produce the same sample stream.
+ */
+struct synth_params {
+	uint64_t seed;
+
+	/* Total number of samples to stream */
+	unsigned long samples;
+
+	/*
+	 * Number of distinct stacks in the pool. Lowered by synth_init(),
+	 * with a warning, if fanout and depth allow fewer than that.
+	 */
+	unsigned long unique;
+
+	/* Stack depth is normally distributed, clamped to [1, max_depth] */
+	double depth_mean;
+	double depth_stddev;
+	unsigned int max_depth;
+
+	/* Number of callees per frame */
+	unsigned int fanout;
+
+	/* Zipf exponent of stack popularity. 0 is uniform */
+	double zipf;
+
+	/* Number of distinct tree ids and user maps */
+	unsigned long ids;
+	unsigned int maps;
+
+	/* Fraction of each stack's frames, at the leaf end, that are kernel */
+	double kernel;
+};
+
+#define SYNTH_PARAMS_DEFAULT {		\
+	.seed		= 1,		\
+	.samples	= 1000000,	\
+	.unique		= 10000,	\
+	.depth_mean	= 24,		\
+	.depth_stddev	= 8,		\
+	.max_depth	= 128,		\
+	.fanout		= 4,		\
+	.zipf		= 1.0,		\
+	.ids		= 1000,		\
+	.maps		= 16,		\
+	.kernel		= 0.25,		\
+}
+
+/* Map of every kernel frame. User maps are numbered from 2 */
+#define SYNTH_KERNEL_MAP 1
+
+struct synth {
+	struct synth_params params;
+
+	/* The pool of unique stacks */
+	struct record_buf pool;
+	const struct packed_record **index;
+
+	/* Zipf CDF over pool ranks */
+	double *cdf;
+};
+
+/* One pass over the samples of a synth */
+struct synth_stream {
+	const struct synth *synth;
+	uint64_t rng;
+	unsigned long emitted;
+};
+
+/*
+ * Parse a comma-separated list of key=value pairs, e.g.
+ * "samples=1e8,zipf=1.2,depth=32:4", into params. Returns -1 if a key
+ * is unknown or a value isn't all number, or a whole one for counts.
+ */
+int synth_parse(struct synth_params *params, const char *arg);
+
+void synth_init(struct synth *synth, const struct synth_params *params,
+		enum stack_format format);
+void synth_exit(struct synth *synth);
+
+/* Start stream at the first sample of synth */
+void synth_stream_init(struct synth_stream *stream, const struct synth *synth);
+
+/*
+ * Point stack at the next sample. Returns false once params.samples
+ * samples have been emitted. The stack stays valid until synth_exit().
+ */
+bool synth_next(struct synth_stream *stream, struct stack *stack);
+
+#endif /* __SYNTH_H__ */
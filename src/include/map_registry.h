@@ -0,0 +1,111 @@
+#ifndef __MAP_REGISTRY_H__
+#define __MAP_REGISTRY_H__
+
+#include "callstack.h"
+#include "map_symbol.h"
+
+/*
+ * Resolves the (address space, ip) of a frame to the map it was
+ * executing in, like maps__find() does in perf.
+ *
+ * The address space of a frame is callstack_entry->map: the pid for user
+ * frames and the context for kernel ones when reading perf.data, or
+ * whatever map id the input carries otherwise. Each address space keeps
+ * the [start, end) ranges registered for it (from PERF_RECORD_MMAP and
+ * MMAP2) in an array sorted by start. An ip that's in no range, or an
+ * address space nothing was registered for, resolves to a map covering
+ * the whole address space, so inputs without mmap events get one map per
+ * map id as before.
+ *
+ * A range's map is identified by its start address and the whole-space
+ * map by the address space id, so the same mapping resolves to the same
+ * map in every registry. That lets registries be merged and thrown away
+ * independently of the trees built with them.
+ *
+ * A registry is only ever used by one thread.
+ */
+
+struct map_range {
+    unsigned long start;
+    unsigned long end;
+    struct map_symbol ms;
+};
+
+struct addr_space {
+    unsigned long id;
+
+    /* Sorted by start, never overlapping */
+    struct map_range *ranges;
+    unsigned int nr;
+    unsigned int alloc;
+
+    /* Whatever no range covers */
+    struct map_symbol whole;
+};
+
+struct addr_space_ref {
+    unsigned long id;
+    struct addr_space *as;
+};
+
+/* Covers [start, end) of address space as */
+struct map_cache_entry {
+    unsigned long as;
+    unsigned long start;
+    unsigned long end;
+    struct map_symbol *ms;
+};
+
+#define MAP_CACHE_SIZE 4
+
+struct map_registry {
+    /*
+     * Sorted by id. Address spaces are allocated one by one so that
+     * their whole-space map_symbol never moves.
+     */
+    struct addr_space_ref *spaces;
+    unsigned int nr;
+    unsigned int alloc;
+
+    /* Most recent lookups, replaced round-robin */
+    struct map_cache_entry cache[MAP_CACHE_SIZE];
+    unsigned int cache_next;
+
+    /* Results of map_registry__find_batch() */
+    struct map_symbol **batch;
+    unsigned int batch_sz;
+};
+
+void map_registry__init(struct map_registry *reg);
+void map_registry__exit(struct map_registry *reg);
+
+/* Register [start, end) in as, replacing any ranges it overlaps */
+void map_registry__add(struct map_registry *reg, unsigned long as,
+                       unsigned long start, unsigned long end);
+
+/* The map of ip in as */
+struct map_symbol *map_registry__find(struct map_registry *reg,
+                                      unsigned long as, unsigned long ip);
+
+/*
+ * The maps of all nr frames of a stack. The array is reused by the next
+ * call.
+ */
+struct map_symbol **map_registry__find_batch(struct map_registry *reg,
+                                             const struct callstack_entry *entries,
+                                             unsigned int nr);
+
+/* Add every address space and range of from to to */
+void map_registry__merge(struct map_registry *to, struct map_registry *from);
+
+/* Ranges plus address spaces, i.e. the maps lookups can return */
+unsigned long map_registry__nr_maps(const struct map_registry *reg);
+
+/*
+ * The process-wide registry and the calling thread's, which get_map()
+ * and get_maps() use. Like mem_account, -j workers point it at their own.
+ */
+extern struct map_registry map_registry_global;
+extern __thread struct map_registry *map_registry;
+
+#endif /* __MAP_REGISTRY_H__ */
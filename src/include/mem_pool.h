@@ -0,0 +1,127 @@
+#ifndef __MEM_POOL_H__
+#define __MEM_POOL_H__
+
+#include <stdbool.h>
+#include "callstack.h"
+
+/*
+ * Bump allocator for objects that all go away together, like the nodes
+ * of one callchain tree.
+ *
+ * Objects are carved out of chunks in the order they're allocated, so
+ * whatever is built together (the nodes of a new path, say) also sits
+ * together in memory, and releasing the pool frees everything with one
+ * cfree() per chunk. Chunks start at MEM_POOL_CHUNK_MIN bytes and grow
+ * with the pool up to MEM_POOL_CHUNK_MAX so that small trees stay small.
+ *
+ * mem_pool__free() only does the accounting; the memory is reused once
+ * the whole pool is released, or reset to be filled again from the same
+ * chunks.
+ *
+ * Pooled objects are counted against their type like ccalloc()'d ones,
+ * at the size asked for, but the bytes that make up the totals are those
+ * of the chunks (MEM_POOL_CHUNK). The difference is how well the chunks
+ * are used, which mem_stats_print() reports.
+ */
+
+#define MEM_POOL_ALIGN          16
+#define MEM_POOL_CHUNK_MIN      4096
+#define MEM_POOL_CHUNK_MAX      (64 * 1024)
+
+struct mem_pool_chunk {
+    struct mem_pool_chunk *next;
+    size_t size;
+    char data[];
+};
+
+struct mem_pool {
+    struct mem_pool_chunk *chunks;
+    /* What's left of the newest chunk */
+    char *cur;
+    char *end;
+    /* Chunks kept by mem_pool__reset() to be used again */
+    struct mem_pool_chunk *spare;
+    /* Size of the next chunk */
+    size_t chunk_size;
+    /* Bytes in all chunks, spare ones included */
+    size_t total;
+    /*
+     * Objects allocated and not freed yet, and their size. An object may
+     * be freed through another pool that this one is merged into later.
+     */
+    unsigned long nr_objects;
+    size_t object_bytes;
+};
+
+void mem_pool__init(struct mem_pool *pool);
+
+/* Free every chunk; the pool can be used again afterwards */
+void mem_pool__release(struct mem_pool *pool);
+
+/*
+ * Free every object, which must all be of type, at once but keep the
+ * chunks to allocate from again
+ */
+void mem_pool__reset(struct mem_pool *pool, enum mem_type type);
+
+/* Hand the chunks of from over to to, leaving from empty */
+void mem_pool__merge(struct mem_pool *to, struct mem_pool *from);
+
+/* Start a new chunk big enough for size bytes and allocate them from it */
+void *mem_pool__alloc_slow(struct mem_pool *pool, size_t size);
+
+static inline void mem_pool__account(enum mem_type type, size_t size,
+                                     bool alloc)
+{
+    struct mem_account *acct = mem_account;
+    struct mem_stats *ms = &acct->types[type];
+
+    if (alloc) {
+        ms->allocs++;
+        ms->live += size;
+        if (ms->live > ms->peak)
+            ms->peak = ms->live;
+        acct->pooled += size;
+    } else {
+        ms->frees++;
+        ms->live -= size;
+        acct->pooled -= size;
+    }
+}
+
+/*
+ * Memory for size bytes, aligned to MEM_POOL_ALIGN. It's zeroed unless
+ * the pool has been reset.
+ */
+static inline void *mem_pool__alloc(struct mem_pool *pool, size_t size,
+                                    enum mem_type type)
+{
+    size_t sz = (size + MEM_POOL_ALIGN - 1) & ~(size_t)(MEM_POOL_ALIGN - 1);
+    void *ptr;
+
+    if (__builtin_expect((size_t)(pool->end - pool->cur) < sz, 0)) {
+        ptr = mem_pool__alloc_slow(pool, sz);
+        if (!ptr)
+            return NULL;
+    } else {
+        ptr = pool->cur;
+        pool->cur += sz;
+    }
+
+    mem_pool__account(type, size, true);
+    pool->nr_objects++;
+    pool->object_bytes += size;
+    return ptr;
+}
+
+static inline void mem_pool__free(struct mem_pool *pool, void *ptr,
+                                  size_t size, enum mem_type type)
+{
+    if (ptr) {
+        mem_pool__account(type, size, false);
+        pool->nr_objects--;
+        pool->object_bytes -= size;
+    }
+}
+
+#endif /* __MEM_POOL_H__ */
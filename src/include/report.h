@@ -0,0 +1,65 @@
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <stdint.h>
+
+struct callchain_root;
+struct callchain_sorted;
+
+/*
+ * perf report's side of a profile: once every stack is in, the
+ * callchains of each tree are sorted the way the chain mode shows them
+ * (callchain_param.sort) and then printed.
+ *
+ * Nothing is actually written out. Every line is formatted into a buffer
+ * the way the stdio output lays it out, which is most of what printing
+ * costs short of the terminal, and counted.
+ */
+enum report_mode {
+    REPORT_GRAPH_ABS,
+    REPORT_GRAPH_REL,
+    REPORT_FLAT,
+    REPORT_FOLDED,
+    NR_REPORT_MODES,
+};
+
+extern const char *report_mode_names[NR_REPORT_MODES];
+
+struct report_output {
+    unsigned long lines;
+    unsigned long bytes;
+};
+
+struct report {
+    /* The callchains of every tree and what the last sort shows of them */
+    struct callchain_root **roots;
+    struct callchain_sorted *sorted;
+    unsigned long nr;
+    unsigned long alloc;
+
+    /* Hits of all the trees, which min_percent is a percentage of */
+    uint64_t total_hits;
+    /* Like callchain_param.min_percent, 0.5 by default */
+    double min_percent;
+
+    /* Of the last sort */
+    enum report_mode mode;
+};
+
+void report__init(struct report *report);
+void report__exit(struct report *report);
+
+/* Add the callchains of a tree, see callstack_ops->callchain */
+void report__add(struct report *report, struct callchain_root *root);
+
+/*
+ * Sort every tree for mode, on up to nr_threads threads. Like perf, the
+ * threshold is min_percent of the hits of all trees, not of each tree's.
+ */
+void report__sort(struct report *report, enum report_mode mode,
+                  unsigned int nr_threads);
+
+/* Format every line the last sort shows and count them into out */
+void report__output(struct report *report, struct report_output *out);
+
+#endif /* __REPORT_H__ */
@@ -0,0 +1,52 @@
+#ifndef __TREEDIR_H__
+#define __TREEDIR_H__
+
+#include "callstack.h"
+
+/*
+ * Tree directory: maps the id of a record to its callstack_tree.
+ *
+ * Every record does one lookup before any stack work starts, so the
+ * directory is pluggable like the backends are and can be benchmarked
+ * on its own (the "lookup" phase of -b).
+ */
+struct treedir {
+    /* Number of trees in the directory */
+    unsigned long nr;
+};
+
+struct treedir_ops {
+    const char *name;
+
+    struct treedir *(*new)(void);
+
+    /*
+     * Return the slot holding the tree for id. If id isn't in the
+     * directory yet, a slot is reserved for it and NULL is stored in
+     * it; the caller must then store a tree in the slot before calling
+     * into the directory again.
+     */
+    struct callstack_tree **(*get)(struct treedir *dir, unsigned long id);
+
+    /* Call fn on every tree, in no particular order */
+    void (*for_each)(struct treedir *dir,
+                     void (*fn)(unsigned long id,
+                                struct callstack_tree *tree, void *arg),
+                     void *arg);
+
+    /* Free the directory, but not the trees in it */
+    void (*free)(struct treedir *dir);
+};
+
+/* Red-black tree keyed on the id, one allocation per tree */
+extern struct treedir_ops rbtree_treedir_ops;
+
+/*
+ * Open-addressing hash table with the tree pointers stored inline. It
+ * grows incrementally: once it's half full a table twice the size is
+ * allocated and every lookup moves a few entries over, so no single
+ * insert pays for rehashing everything.
+ */
+extern struct treedir_ops hash_treedir_ops;
+
+#endif /* __TREEDIR_H__ */
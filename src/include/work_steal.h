@@ -0,0 +1,29 @@
+#ifndef __WORK_STEAL_H__
+#define __WORK_STEAL_H__
+
+/*
+ * Run a batch of independent tasks, numbered 0 to nr - 1, on a few
+ * threads.
+ *
+ * Every thread starts out with an equal, contiguous share of the tasks
+ * and takes them from the front of it. One that runs out steals the back
+ * half of what another has left, so a few expensive tasks (big trees,
+ * with Zipf-skewed input) don't leave the other threads idle, and there's
+ * no shared queue for all of them to contend on. Neither taking nor
+ * stealing takes a lock.
+ *
+ * The workers allocate and count events into accounts of their own,
+ * forked from the caller's and joined back into it once they're done
+ * (see mem_account_fork()), so tasks may use ccalloc() and cfree() on
+ * anything, whoever allocated it.
+ */
+typedef void (*work_fn_t)(void *arg, unsigned long idx);
+
+/*
+ * Call fn(arg, idx) for every idx below nr, on up to nr_threads threads
+ * including the calling one, and return once they've all been done.
+ */
+void work_steal_run(unsigned long nr, unsigned int nr_threads, work_fn_t fn,
+                    void *arg);
+
+#endif /* __WORK_STEAL_H__ */
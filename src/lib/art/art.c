@@ -8,6 +8,7 @@
  * each node.
  */
 #include "art.h"
+#include "simd.c"
 
 typedef enum memory_order
 {
@@ -26,6 +27,7 @@ static inline void stream_init(struct stream *stream, art_key_t *data)
 {
     stream->pos = 0;
     stream->data = data;
+    stream->xform = NULL;
 }
 
 static inline bool stream_end(struct stream *stream)
@@ -34,11 +36,26 @@ static inline bool stream_end(struct stream *stream)
     return ptr >= stream->end;
 }
 
-static inline unsigned long stream_size(struct stream *stream)
+/* Bytes of data, which the key may read fewer of through the transform */
+static inline unsigned long stream_bytes(struct stream *stream)
 {
     return (unsigned long)(stream->end - stream->data);
 }
 
+/* Bytes of the key in len bytes of frames as they are in memory */
+static inline unsigned long key_size(const struct art_key_transform *xform,
+                                     unsigned long len)
+{
+    if (!xform)
+        return len;
+    return len / ART_FRAME_SIZE * xform->frame_len;
+}
+
+static inline unsigned long stream_size(struct stream *stream)
+{
+    return key_size(stream->xform, stream_bytes(stream));
+}
+
 static inline void stream_advance(struct stream *stream, unsigned int n)
 {
     stream->pos += n;
@@ -58,23 +75,86 @@ static inline art_key_t stream_next(struct stream *stream)
     return stream->data[stream->pos++];
 }
 
+/*
+ * Byte offset of the key whose frames are at data. The frame is found by
+ * multiplying with the reciprocal of its length in the key, which is exact
+ * for any offset below 2^28 and much cheaper than dividing.
+ */
+static inline art_key_t key_get(const struct art_key_transform *xform,
+                                const art_key_t *data, unsigned long offset)
+{
+    unsigned long frame, byte;
+
+    if (!xform)
+        return data[offset];
+
+    frame = (offset * xform->recip) >> 32;
+    byte = offset - frame * xform->frame_len;
+    return data[frame * ART_FRAME_SIZE + xform->offsets[byte]];
+}
+
 /*
  * Level of indirection for reading from the input stream. Note
- * that all accesses to a node's key go directly through ->key[].
+ * that all accesses to a node's key go directly through ->key[],
+ * while a leaf's key, being a copy of a stream, is read with key_get().
  */
 static inline art_key_t stream_get(struct stream *stream, unsigned int offset)
 {
-    #if 0
-    // Read backwards because Little Endian
-    int i = stream_size(stream) - offset - 1;
-    if (i < 0)
-        return stream->data[0]; // Empty
+    return key_get(stream->xform, stream->data, offset);
+}
+
+/* Copy len bytes of the key from offset on */
+static inline void stream_copy(struct stream *stream, art_key_t *dst,
+                               unsigned int offset, unsigned int len)
+{
+    if (!stream->xform) {
+        memcpy(dst, &stream->data[offset], len);
+        return;
+    }
+
+    for (unsigned int i = 0; i < len; i++)
+        dst[i] = stream_get(stream, offset + i);
+}
+
+int art_key_transform_init(struct art_key_transform *xform)
+{
+    unsigned int kept = ART_FIELD_SIZE - xform->strip, i = 0;
+
+    if (xform->strip >= ART_FIELD_SIZE)
+        return -1;
+
+    xform->frame_len = 2 * kept;
+    xform->recip = ((1UL << 32) + xform->frame_len - 1) / xform->frame_len;
+
+    for (unsigned int f = 0; f < 2; f++) {
+        /* The ip is the first field of a frame in memory, the map the second */
+        bool map = f == 0 ? xform->map_first : !xform->map_first;
+        unsigned int field = map ? ART_FIELD_SIZE : 0;
 
-    assert(offset < stream_size(stream));
-    return stream->data[i];
-    #else
-    return stream->data[offset];
-    #endif
+        for (unsigned int b = 0; b < kept; b++) {
+            unsigned int byte = xform->big_endian ? kept - 1 - b : b;
+
+            xform->offsets[i++] = field + byte;
+        }
+    }
+    return 0;
+}
+
+/* Sign extended from the highest bit that's kept */
+bool art_key_transform_lossless(const struct art_key_transform *xform,
+                                const art_key_t *data, unsigned long nr)
+{
+    const unsigned long *fields = (const unsigned long *)data;
+    unsigned int shift = xform->strip * 8;
+
+    if (!xform->strip)
+        return true;
+
+    for (unsigned long i = 0; i < nr * 2; i++) {
+        if ((unsigned long)((long)(fields[i] << shift) >> shift) != fields[i])
+            return false;
+    }
+    return true;
 }
 
 static inline unsigned int node_size(unsigned int flags)
@@ -96,74 +176,60 @@ static inline unsigned int node_size(unsigned int flags)
     return 0;
 }
 
+/*
+ * Allocate an inner node. Leaves are special, their size depends on the
+ * key they hold. See make_leaf().
+ */
 static struct radix_tree_node *alloc_node(unsigned int flags)
 {
     struct radix_tree_node *node = NULL;
-    unsigned int children_size;
-    unsigned int obj_size;
-    unsigned int key_size;
-
-    if (flags & NODE_FLAGS_LEAF) {
-        /*
-         * Leaves are special and ->key and ->arr are set to the callstack_entry.
-         * See art_tree_insert().
-         */
-        obj_size = sizeof(struct radix_tree_node);
-        node = ccalloc(1, obj_size);
-        goto out;
-    }
 
     switch (flags) {
     case NODE_FLAGS_INNER_4:
+        node = ccalloc(1, sizeof(struct art_node4), MEM_ART_NODE4);
+        break;
     case NODE_FLAGS_INNER_16:
-        key_size = node_size(flags) * sizeof(art_key_t);
-        children_size = node_size(flags) * sizeof(unsigned long);
-        obj_size = sizeof(struct radix_tree_node) + key_size + children_size;
-        node = ccalloc(1, obj_size);
-        node->key = (art_key_t *)((char *)node + sizeof(struct radix_tree_node));
-        node->arr = (unsigned long *)((char *)node->key + key_size);
+        node = ccalloc(1, sizeof(struct art_node16), MEM_ART_NODE16);
         break;
     case NODE_FLAGS_INNER_48:
-        key_size = 256 * sizeof(art_key_t);
-        children_size = node_size(flags) * sizeof(unsigned long);
-        obj_size = sizeof(struct radix_tree_node) + key_size + children_size;
-        node = calloc(1, obj_size);
-        node->key = (art_key_t *)((char *)node + sizeof(struct radix_tree_node));
-        node->arr = (unsigned long *)((char *)node->key + key_size);
-        // Required in grow().
-        memset(node->key, EMPTY, key_size);
+        node = ccalloc(1, sizeof(struct art_node48), MEM_ART_NODE48);
+        if (node)
+            memset(((struct art_node48 *)node)->index, EMPTY, 256);
         break;
     case NODE_FLAGS_INNER_256:
-        children_size = node_size(flags) * sizeof(unsigned long);
-        obj_size = sizeof(struct radix_tree_node) + children_size;
-        node = calloc(1, obj_size);
-        node->arr = (unsigned long *)((char *)node + sizeof(struct radix_tree_node));
+        node = ccalloc(1, sizeof(struct art_node256), MEM_ART_NODE256);
         break;
     default:
         die();
     }
 
-out:
+    if (!node)
+        die();
     node->flags = flags;
     return node;
 }
 
-static void free_node(struct radix_tree_node *node, bool leaf)
+static void free_node(struct radix_tree_node *node)
 {
     switch (node->flags) {
     case NODE_FLAGS_LEAF:
-        cfree(node->key, leaf);
+        cfree(node, MEM_ART_LEAF);
         break;
     case NODE_FLAGS_INNER_4:
+        cfree(node, MEM_ART_NODE4);
+        break;
     case NODE_FLAGS_INNER_16:
+        cfree(node, MEM_ART_NODE16);
+        break;
     case NODE_FLAGS_INNER_48:
+        cfree(node, MEM_ART_NODE48);
+        break;
     case NODE_FLAGS_INNER_256:
+        cfree(node, MEM_ART_NODE256);
         break;
     default:
         die();
     }
-
-    cfree(node, leaf);
 }
 
 static inline bool is_leaf(struct radix_tree_node *node)
@@ -186,32 +252,49 @@ static inline bool is_full(struct radix_tree_node *node)
     if (is_leaf(node))
         return true;
 
-    return node->key_len == node_size(node->flags);
+    return node->nr == node_size(node->flags);
 }
 
-static struct radix_tree_node **
-find_child_16(struct radix_tree_node *node, art_key_t key)
+/*
+ * The array of children of an inner node and how many slots of it to
+ * look at. Only INNER_256 has empty slots among those.
+ */
+static inline struct radix_tree_node **
+children(struct radix_tree_node *node, unsigned int *nr)
 {
-#if 1
-    for (int i = 0; i < node->key_len; i++) {
-        if (node->key[i] == key)
-            return (struct radix_tree_node **)&node->arr[i];
-    }
-#else
-    __m128i node_key = _mm_loadu_si128((const __m128i *)node->key);
-    __m128i __cmp = _mm_set1_epi8(key);
-    // __m128i __input = _mm_set_epi8(
-    __m128i __eq = _mm_cmpeq_epi8(node_key, __cmp);
-    unsigned int mask = (1 << node->key_len) - 1;
-    unsigned int bitfield = _mm_movemask_epi8(__eq) & mask;
-
-    // mask is 32-bits but we're only interested in the lower 16-bits
-    if (bitfield)
-        return (struct radix_tree_node **)&node->arr[__builtin_ctz(bitfield)];
-#endif
+    *nr = node->nr;
 
+    switch (node->flags) {
+    case NODE_FLAGS_INNER_4:
+        return ((struct art_node4 *)node)->children;
+    case NODE_FLAGS_INNER_16:
+        return ((struct art_node16 *)node)->children;
+    case NODE_FLAGS_INNER_48:
+        return ((struct art_node48 *)node)->children;
+    case NODE_FLAGS_INNER_256:
+        *nr = 256;
+        return ((struct art_node256 *)node)->children;
+    default:
+        die();
+    }
     return NULL;
 }
+
+/*
+ * The slot of key among the nr keys of a Node4 or Node16, NULL if it
+ * isn't there. KEY_CMPS counts the keys a linear scan would have looked
+ * at, whichever kernel does it.
+ */
+static inline struct radix_tree_node **
+find_key(const art_key_t *keys, struct radix_tree_node **children,
+         unsigned int nr, art_key_t key)
+{
+    int i = art_simd.find_key(keys, nr, key);
+
+    cs_stat_add(CS_STAT_KEY_CMPS, i < 0 ? nr : i + 1);
+    return i < 0 ? NULL : &children[i];
+}
+
 /*
  * Given a node, lookup the node for key. If missing is missing return
  * the slot to insert a new node at.
@@ -220,6 +303,9 @@ find_child_16(struct radix_tree_node *node, art_key_t key)
  */
 struct radix_tree_node **find_child(struct radix_tree_node *node, art_key_t key)
 {
+    struct art_node4 *node4;
+    struct art_node16 *node16;
+    struct art_node48 *node48;
     int index;
 
     if (!node)
@@ -227,24 +313,20 @@ struct radix_tree_node **find_child(struct radix_tree_node *node, art_key_t key)
 
     switch (node->flags) {
     case NODE_FLAGS_INNER_4:
-            for (int i = 0; i < node->key_len; i++) {
-                if (node->key[i] == key)
-                    return (struct radix_tree_node **)&node->arr[i];
-            }
-        break;
+        node4 = (struct art_node4 *)node;
+        return find_key(node4->keys, node4->children, node->nr, key);
     case NODE_FLAGS_INNER_16:
-        struct radix_tree_node **r = find_child_16(node, key);
-        if (r)
-            return r;
-        break;
+        node16 = (struct art_node16 *)node;
+        return find_key(node16->keys, node16->children, node->nr, key);
     case NODE_FLAGS_INNER_48:
-        index = node->key[key];
+        node48 = (struct art_node48 *)node;
+        index = node48->index[key];
         if (index == EMPTY)
             return NULL; // Unset
 
-        return (struct radix_tree_node **)&node->arr[index];
+        return &node48->children[index];
     case NODE_FLAGS_INNER_256:
-        return (struct radix_tree_node **)&node->arr[key];
+        return &((struct art_node256 *)node)->children[key];
     default:
         die();
     }
@@ -254,91 +336,134 @@ struct radix_tree_node **find_child(struct radix_tree_node *node, art_key_t key)
 
 static void replace(struct radix_tree_node **node, struct radix_tree_node *leaf)
 {
-    // TODO need to handle freeing memory?
-    // struct radix_tree_node *n = *node;
-    // if (n) {
-    //     cfree(n->key);
-    //     cfree(n);
-    // }
-
     *node = leaf;
 }
 
-static art_key_t *load_key(struct radix_tree_node *node)
-{
-    return node->key;
-}
-
 static void add_child(struct radix_tree_node *node, art_key_t key,
                       struct radix_tree_node *child)
 {
+    struct art_node4 *node4 = (struct art_node4 *)node;
+    struct art_node16 *node16 = (struct art_node16 *)node;
+    struct art_node48 *node48 = (struct art_node48 *)node;
+    struct art_node256 *node256 = (struct art_node256 *)node;
+
     assert(!is_full(node));
 #if 1
     // Check to make sure key isn't already in this node
     switch (node->flags) {
     case NODE_FLAGS_INNER_4:
+        for (int i = 0; i < node->nr; i++)
+            assert(node4->keys[i] != key);
+        break;
     case NODE_FLAGS_INNER_16:
-        for (int i = 0; i < node->key_len; i++) {
-            assert(node->key[i] != key);
-        }
+        for (int i = 0; i < node->nr; i++)
+            assert(node16->keys[i] != key);
         break;
     case NODE_FLAGS_INNER_48:
-        assert(node->key[key] == EMPTY);
+        assert(node48->index[key] == EMPTY);
         break;
     case NODE_FLAGS_INNER_256:
-        assert(node->arr[key] == 0x0);
+        assert(!node256->children[key]);
         break;
     }
  #endif
 
     switch (node->flags) {
     case NODE_FLAGS_INNER_4:
+        node4->keys[node->nr] = key;
+        node4->children[node->nr] = child;
+        break;
     case NODE_FLAGS_INNER_16:
-        node->key[node->key_len] = key;
-        node->arr[node->key_len] = (unsigned long)child;
-        node->key_len += 1;
+        node16->keys[node->nr] = key;
+        node16->children[node->nr] = child;
         break;
     case NODE_FLAGS_INNER_48:
-        node->key[key] = node->key_len;
-        node->arr[node->key_len] = (unsigned long)child;
-        node->key_len += 1;
+        node48->index[key] = node->nr;
+        node48->children[node->nr] = child;
         break;
     case NODE_FLAGS_INNER_256:
-        node->arr[key] = (unsigned long)child;
+        node256->children[key] = child;
         break;
     default:
         die();
     }
+    node->nr += 1;
+}
+
+/*
+ * Byte i of the prefix of node, whose prefix starts depth bytes into the
+ * key. Past the inline bytes it's read from the key node points to.
+ */
+static inline art_key_t prefix_get(struct radix_tree_node *node,
+                                   const struct art_key_transform *xform,
+                                   unsigned int depth, unsigned int i)
+{
+    if (i < ART_PREFIX_INLINE)
+        return node->prefix[i];
+    return key_get(xform, node->key, depth + i);
 }
 
 /*
  * Compare the path of node with key and return the number of equal bytes.
+ * The inline bytes of the prefix are compared first, the rest only if
+ * they match.
  */
 static unsigned int check_prefix(struct radix_tree_node *node,
                                  struct stream *stream, int depth)
 {
-
-    // Depth should represent how much of stream we've consumed so far
-    // printf("%lu %u %u\n", stream_size(stream), stream_remaining(stream), depth);
-    // assert((stream_size(stream) - stream_remaining(stream)) == depth);
-
-    // assert(node->prefix_len > 0);
-
     unsigned int min_len = min(node->prefix_len, (unsigned int)stream_size(stream) - depth);
-    int i;
-
-    // Optimise for the common case where the prefix is the same
-    if (!memcmp(&node->prefix, &stream->data[depth], min_len))
-        return min_len;
+    unsigned int inline_len = min(min_len, ART_PREFIX_INLINE);
+    unsigned int i = 0;
+
+    cs_stat_inc(CS_STAT_KEY_CMPS);
+    cs_stat_add(CS_STAT_BYTES_CMPD, min_len);
+
+    // Without a transform the key is the bytes of the stream as they are
+    if (!stream->xform) {
+        i = art_simd.mismatch(node->prefix, &stream->data[depth], inline_len);
+        if (i < inline_len || i == min_len)
+            return i;
+
+        // The rest of the prefix is only in the key
+        cs_stat_inc(CS_STAT_ART_PREFIX_KEY);
+        return i + art_simd.mismatch(&node->key[depth + i],
+                                     &stream->data[depth + i], min_len - i);
+    }
 
-    // OK, they're different. Count the number of matching bytes.
-    for (i = 0; i < min_len; i++) {
+    for (; i < inline_len; i++) {
         if (node->prefix[i] != stream_get(stream, depth + i))
+            return i;
+    }
+
+    if (i == min_len)
+        return i;
+
+    cs_stat_inc(CS_STAT_ART_PREFIX_KEY);
+    for (; i < min_len; i++) {
+        if (key_get(stream->xform, node->key, depth + i) !=
+            stream_get(stream, depth + i))
             break;
     }
     return i;
 }
 
+/*
+ * Take the first n bytes off the prefix of node, which starts depth bytes
+ * into the key.
+ */
+static void cut_prefix(struct radix_tree_node *node,
+                       const struct art_key_transform *xform,
+                       unsigned int depth, unsigned int n)
+{
+    art_key_t prefix[ART_PREFIX_INLINE];
+    unsigned int len = node->prefix_len - n, i;
+
+    for (i = 0; i < min(len, ART_PREFIX_INLINE); i++)
+        prefix[i] = prefix_get(node, xform, depth, n + i);
+    memcpy(node->prefix, prefix, i);
+    node->prefix_len = len;
+}
+
 /*
  * Return the new, larger node.
  */
@@ -347,7 +472,6 @@ grow(struct radix_tree_node **_node, struct radix_tree_node *node)
 {
     struct radix_tree_node *new_node = NULL;
     unsigned int type = 0;
-    unsigned int entries;
 
     assert(is_full(node));
 
@@ -355,185 +479,241 @@ grow(struct radix_tree_node **_node, struct radix_tree_node *node)
     case NODE_FLAGS_INNER_4:
         // Bump to NODE_FLAGS_INNER_16
         type = NODE_FLAGS_INNER_16;
+        cs_stat_inc(CS_STAT_ART_GROW_16);
         break;
     case NODE_FLAGS_INNER_16:
         // Bump to NODE_FLAGS_INNER_48
         type = NODE_FLAGS_INNER_48;
+        cs_stat_inc(CS_STAT_ART_GROW_48);
         break;
     case NODE_FLAGS_INNER_48:
         // Bump to NODE_FLAGS_INNER_256
         type = NODE_FLAGS_INNER_256;
+        cs_stat_inc(CS_STAT_ART_GROW_256);
         break;
     default:
         assert(false);
     }
 
     new_node = alloc_node(type);
-    // Lookup the number of entries for the *old* node type
-    entries = node_size(node->flags);
     switch(node->flags) {
-    case NODE_FLAGS_INNER_4:
-        memcpy(new_node->key, node->key, entries * sizeof(art_key_t));
-        memcpy(new_node->arr, node->arr, entries * sizeof(unsigned long));
+    case NODE_FLAGS_INNER_4: {
+        struct art_node4 *old = (struct art_node4 *)node;
+        struct art_node16 *new = (struct art_node16 *)new_node;
+
+        memcpy(new->keys, old->keys, sizeof(old->keys));
+        memcpy(new->children, old->children, sizeof(old->children));
         break;
-    case NODE_FLAGS_INNER_16:
-        for (int i = 0; i < entries; i++) {
-            int key = node->key[i];
-            new_node->key[key] = i;
-            new_node->arr[i] = node->arr[i];
+    }
+    case NODE_FLAGS_INNER_16: {
+        struct art_node16 *old = (struct art_node16 *)node;
+        struct art_node48 *new = (struct art_node48 *)new_node;
+
+        for (int i = 0; i < node->nr; i++) {
+            new->index[old->keys[i]] = i;
+            new->children[i] = old->children[i];
         }
         break;
-    case NODE_FLAGS_INNER_48:
-        for (int i = 0; i < 256; i++) {
-            int index = node->key[i];
+    }
+    case NODE_FLAGS_INNER_48: {
+        struct art_node48 *old = (struct art_node48 *)node;
+        struct art_node256 *new = (struct art_node256 *)new_node;
+
+        uint64_t used[4];
 
-            if (index == EMPTY)
-                continue; // Unset
+        art_simd.index_used(old->index, used);
+        for (int w = 0; w < 4; w++) {
+            for (uint64_t bits = used[w]; bits; bits &= bits - 1) {
+                int i = w * 64 + __builtin_ctzll(bits);
 
-            new_node->arr[i] = node->arr[index];
+                new->children[i] = old->children[old->index[i]];
+            }
         }
         break;
+    }
     default:
         die();
     }
 
-    new_node->key_len = entries;
+    new_node->nr = node->nr;
+    new_node->count = node->count;
+    new_node->key_end = node->key_end;
+    new_node->prefix_len = node->prefix_len;
+    new_node->key = node->key;
+    memcpy(new_node->prefix, node->prefix, sizeof(node->prefix));
     *_node = new_node;
-    free_node(node, false);
+    free_node(node);
     return new_node;
 }
 
+/*
+ * Leaves own a copy of the key because callers are free to reuse the
+ * stream's buffer once insert() returns. The copy is part of the leaf and
+ * NUL-terminated so that string keys can be inspected directly.
+ */
 static inline struct radix_tree_node *make_leaf(struct stream *stream)
 {
-    struct radix_tree_node *leaf = alloc_node(NODE_FLAGS_LEAF);
+    unsigned long bytes = stream_bytes(stream);
+    struct art_leaf *leaf;
+
+    leaf = ccalloc(1, sizeof(*leaf) + bytes + 1, MEM_ART_LEAF);
+    if (!leaf)
+        die();
+    leaf->n.flags = NODE_FLAGS_LEAF;
+    leaf->n.key = leaf->key;
     leaf->key_len = stream_size(stream);
-    leaf->key = stream->data;
-    return leaf;
+    memcpy(leaf->key, stream->data, bytes);
+    return &leaf->n;
 }
 
-static void do_leaf(struct radix_tree_node **_node, struct stream *stream,
-                   struct radix_tree_node *leaf, int depth)
+/*
+ * Nodes on the path of stream down from node to end bytes in that read
+ * their prefix from old read it from key instead. Both keys have the
+ * same bytes up to end.
+ */
+static void repoint_key(struct radix_tree_node *node, struct stream *stream,
+                        const art_key_t *old, const art_key_t *key,
+                        unsigned int end)
 {
-    struct radix_tree_node *node = *_node;
+    unsigned int depth = 0;
 
-    assert(is_leaf(node));
-    //assert(stream_size(stream) > 0);
-    if (stream_size <= 0)
-      return;
+    while (!is_leaf(node)) {
+        if (node->key == old)
+            node->key = key;
 
-    unsigned int stream_len = stream_size(stream) - depth;
-    unsigned int key_len = node->key_len - depth;
-    unsigned int prefix_sz = ARRAY_SIZE(node->prefix);
+        depth += node->prefix_len;
+        if (depth >= end)
+            break;
+        node = *find_child(node, stream_get(stream, depth));
+        depth++;
+    }
+}
 
-    art_key_t *key2 = load_key(node);
-    unsigned int prefix_len;
-    int match;
+/*
+ * Insert stream where the leaf at *_node is, depth bytes into the tree
+ * at *root. Returns true if stream is a new key.
+ */
+static bool do_leaf(struct radix_tree_node **root,
+                    struct radix_tree_node **_node, struct stream *stream,
+                    int depth)
+{
+    struct radix_tree_node *node = *_node, *new_node, *other_node = NULL;
+    struct art_leaf *old = art_leaf(node);
+    unsigned int match, len = min(old->key_len, (unsigned int)stream_size(stream));
 
-    for (match = depth;
-        match < node->key_len && match < stream_size(stream) && key2[match] == stream->data[match];
-        match++)
-        ;
+    assert(is_leaf(node));
 
-    if (match == stream_size(stream) && match == node->key_len) {
-        if (!memcmp(&node->key[depth], &stream->data[depth], match)) {
-            node->count++;
-            return; // 100% match. Nothing to do.
-        }
+    if (!stream->xform) {
+        match = depth + art_simd.mismatch(&old->key[depth],
+                                          &stream->data[depth], len - depth);
+    } else {
+        for (match = depth;
+            match < len &&
+            key_get(stream->xform, old->key, match) == stream_get(stream, match);
+            match++)
+            ;
     }
 
-    struct radix_tree_node *new_node = alloc_node(NODE_INITIAL_SIZE);
-
-    prefix_len = match - depth;
-
-    // Chain together multiple inner nodes for prefixes that don't
-    // fit in a single node->prefix[] array.
-    unsigned int prefix_remaining = prefix_len;
-    int j = 0;
-    while (prefix_remaining > prefix_sz) {
-        memcpy(new_node->prefix, &stream->data[depth + j*prefix_sz], prefix_sz);
-        new_node->prefix_len = prefix_sz;
-        prefix_remaining -= prefix_sz;
-
-        // If we will do another iteration, form a chain
-        if (prefix_remaining > prefix_sz) {
-            struct radix_tree_node *chain = alloc_node(NODE_INITIAL_SIZE);
-            new_node->key[0] = stream->data[depth + j * prefix_sz + 1];
-            new_node->key_len = 1;
-            new_node->arr[0] = (unsigned long)chain;
-            replace(_node, new_node);
-            _node = &new_node;
-            new_node = chain;
-            prefix_remaining -= 1;
-        }
-        j++;
-    }
+    cs_stat_inc(CS_STAT_KEY_CMPS);
+    cs_stat_add(CS_STAT_BYTES_CMPD, match - depth);
 
-    if (prefix_remaining) {
-        memcpy(new_node->prefix, &stream->data[depth + prefix_len - prefix_remaining], prefix_remaining);
-        new_node->prefix_len = prefix_remaining;
+    if (match == stream_size(stream) && match == old->key_len) {
+        node->count++;
+        return false; // 100% match. Nothing to do.
     }
 
-    // Does the leaf have remaining bytes in the key?
-    if (key_len - prefix_len > 0)
-        add_child(new_node, node->key[depth + prefix_len], node);
-
-    // Does the stream have remaining bytes in the key?
-    if (stream_len - prefix_len > 0) {
-        struct radix_tree_node *other_node = make_leaf(stream);
-        add_child(new_node, other_node->key[depth + prefix_len], other_node);
+    // However long the prefix the keys share, it's one node whose prefix
+    // is read from the key of either of them
+    new_node = alloc_node(NODE_INITIAL_SIZE);
+    new_node->prefix_len = match - depth;
+    new_node->key = old->key;
+    stream_copy(stream, new_node->prefix, depth,
+                min(new_node->prefix_len, ART_PREFIX_INLINE));
+
+    if (match < stream_size(stream))
+        other_node = make_leaf(stream);
+
+    // Does the leaf have remaining bytes in the key? If not, the key ends
+    // at new_node, which takes over the leaf's count. The stream's key
+    // continues it, so the nodes above that read from the leaf's key can
+    // read from that one instead.
+    if (match < old->key_len) {
+        add_child(new_node, key_get(stream->xform, old->key, match), node);
+    } else {
+        new_node->key_end = true;
+        new_node->count = node->count;
+        new_node->key = other_node->key;
+        if (*root != node)
+            repoint_key(*root, stream, old->key, other_node->key, depth);
+        free_node(node);
     }
 
+    // Does the stream have remaining bytes in the key? If not, it ends at
+    // new_node and, like a new leaf, the first insert isn't counted.
+    if (other_node)
+        add_child(new_node, stream_get(stream, match), other_node);
+    else
+        new_node->key_end = true;
+
     replace(_node, new_node);
+    return true;
 }
 /*
  * Insert a fully constructed leaf node into the tree rooted at _node.
+ *
+ * Returns true if stream wasn't in the tree yet. Counts follow leaves:
+ * the insert that adds a key isn't counted, every later one is.
  */
-void insert(struct radix_tree_node **_node, struct stream *stream,
-                   struct radix_tree_node *leaf, int depth)
+bool insert(struct radix_tree_node **_node, struct stream *stream,
+            struct radix_tree_node *leaf, int depth)
 {
-    struct radix_tree_node **next, *node = *_node;
+    struct radix_tree_node **next, **root = _node, *node = *_node;
     unsigned int match_len;
-    unsigned int __depth = 0;
-
-    // gdb -p (pid) ; step
-    // kill(getpid(), SIGSTOP);
 
     if (node == NULL) {
         leaf = make_leaf(stream);
         replace(_node, leaf);
-        return;
+        return true;
     }
 
     while (1) {
-        if (is_leaf(node)) {
-            do_leaf(_node, stream, leaf, depth);
-            return;
-        }
+        cs_stat_inc(CS_STAT_NODES_VISITED);
+        if (is_leaf(node))
+            return do_leaf(root, _node, stream, depth);
 
         match_len = check_prefix(node, stream, depth);
         if (match_len != node->prefix_len) {
             // Prefix mismatch
             struct radix_tree_node *new_node = alloc_node(NODE_INITIAL_SIZE);
 
-            leaf = make_leaf(stream);
-            add_child(new_node, stream_get(stream, depth + match_len), leaf);
-            add_child(new_node, node->prefix[match_len], node);
+            // The stream may run out inside the prefix, in which case
+            // the key ends at new_node
+            if (depth + match_len < stream_size(stream)) {
+                leaf = make_leaf(stream);
+                add_child(new_node, stream_get(stream, depth + match_len), leaf);
+            } else {
+                new_node->key_end = true;
+            }
+            add_child(new_node,
+                      prefix_get(node, stream->xform, depth, match_len),
+                      node);
             new_node->prefix_len = match_len;
-            assert(new_node->prefix_len <= sizeof(new_node->prefix));
-            memcpy(new_node->prefix, node->prefix, match_len);
-            node->prefix_len -= match_len + 1;
-            assert(node->prefix_len >= 0);
-            memmove(node->prefix, node->prefix + match_len + 1, node->prefix_len);
+            new_node->key = node->key;
+            memcpy(new_node->prefix, node->prefix, min(match_len, ART_PREFIX_INLINE));
+            cut_prefix(node, stream->xform, depth, match_len + 1);
             replace(_node, new_node);
-            return;
+            return true;
         }
 
-        // assert ((depth + node->prefix_len) < stream_size(stream));
         depth += node->prefix_len;
         if (depth >= stream_size(stream)) {
             // All stream input consumed. We're done.
+            if (!node->key_end) {
+                node->key_end = true;
+                return true;
+            }
             node->count++;
-            return;
+            return false;
         }
 
         next = find_child(node, stream_get(stream, depth));
@@ -542,8 +722,6 @@ void insert(struct radix_tree_node **_node, struct stream *stream,
             _node = next;
             node = *next;
             depth += 1;
-            __depth++;
-            // insert(next, stream, leaf, depth + 1);
         } else {
             // Add to inner node
             if (is_full(node)) {
@@ -551,20 +729,77 @@ void insert(struct radix_tree_node **_node, struct stream *stream,
             }
             leaf = make_leaf(stream);
             add_child(node, stream_get(stream, depth), leaf);
-            return;
+            return true;
         }
-    /* Now we're at the final node and we need to bump the count. */
-    // node->count += 1;
     }
 }
 
+/*
+ * Free node and everything below it.
+ */
+void free_tree(struct radix_tree_node *node)
+{
+    struct radix_tree_node **slots;
+    unsigned int nr;
+
+    if (!node)
+        return;
+
+    if (is_leaf(node)) {
+        free_node(node);
+        return;
+    }
+
+    slots = children(node, &nr);
+    for (unsigned int i = 0; i < nr; i++)
+        free_tree(slots[i]);
+
+    free_node(node);
+}
+
+/*
+ * Report every key below node. A key that ends at an inner node, depth
+ * bytes in, is the start of the key the node points to, so it's read from
+ * there rather than put back together from the prefixes on the way down.
+ */
+static void __for_each_key(struct radix_tree_node *node, unsigned long depth,
+                           for_each_key_fn fn, void *arg)
+{
+    struct radix_tree_node **slots;
+    unsigned int nr;
+
+    /* The insert that adds a key isn't counted, see insert() */
+    if (is_leaf(node)) {
+        fn(node->key, art_leaf(node)->key_len, node->count + 1, arg);
+        return;
+    }
+
+    depth += node->prefix_len;
+    slots = children(node, &nr);
+    for (unsigned int i = 0; i < nr; i++) {
+        if (slots[i])
+            __for_each_key(slots[i], depth + 1, fn, arg);
+    }
+
+    if (node->key_end)
+        fn(node->key, depth, node->count + 1, arg);
+}
+
+void for_each_key(struct radix_tree_node *node, for_each_key_fn fn, void *arg)
+{
+    if (node)
+        __for_each_key(node, 0, fn, arg);
+}
+
 static bool
 leaf_matches(struct radix_tree_node *node, struct stream *stream, int depth)
 {
-    if (node->key_len != stream_size(stream))
+    struct art_leaf *leaf = art_leaf(node);
+
+    if (leaf->key_len != stream_size(stream))
         return false;
 
-    return memcmp(node->key, stream->data, node->key_len) == 0;
+    return memcmp(leaf->key, stream->data, stream_bytes(stream)) == 0;
 }
 
 /*
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -11,12 +12,46 @@
 
 typedef unsigned char art_key_t;
 
+/* A key that is a sequence of frames is read in records of this size */
+#define ART_FRAME_SIZE  16
+#define ART_FIELD_SIZE  8
+
+/*
+ * How the bytes of a key made of frames, each an ip and a map of
+ * ART_FIELD_SIZE bytes in memory order, are fed into the tree.
+ *
+ * As they are in memory, the ip comes first, lowest byte first, so the
+ * byte that varies most decides the first branch of every frame. Reading
+ * the map first and each field from its highest byte down puts the bytes
+ * that many stacks share at the top instead. On x86-64 the high 2 bytes of
+ * an address are copies of bit 47 and carry no information. strip leaves
+ * that many high bytes of each field out of the key, which is only
+ * lossless for fields that are sign extended from the bytes kept.
+ *
+ * Nothing is copied: the stream and leaf keys keep the frames as they
+ * are and every byte is looked up through the transform when it's read.
+ */
+struct art_key_transform {
+    bool map_first;
+    bool big_endian;
+    unsigned int strip;
+
+    /* Set up by art_key_transform_init() */
+    unsigned int frame_len;
+    /* 2^32 / frame_len rounded up, to divide by multiplying */
+    unsigned long recip;
+    /* Byte of the frame in memory for each byte of the frame in the key */
+    unsigned char offsets[ART_FRAME_SIZE];
+};
+
 struct stream {
     art_key_t *data;
     /* Pointer to the end of the data. See stream_end() */
     art_key_t *end;
     /* The current position into data, in 1-byte increments */
     unsigned int pos;
+    /* NULL to read data as the bytes of the key as they are */
+    const struct art_key_transform *xform;
 };
 
 #define NODE_FLAGS_LEAF      (1 << 0)
@@ -30,51 +65,99 @@ struct stream {
 #define EMPTY 0xff
 
 /*
- * A radix tree node.
+ * Bytes of its prefix an inner node keeps itself. The prefix can be any
+ * length: the bytes after these are read from the key of a leaf below the
+ * node, which all share the prefix. Mismatches are mostly found in the
+ * inline bytes, without touching the leaf.
+ */
+#define ART_PREFIX_INLINE   8U
+
+/*
+ * What every node starts with. Which node it is, and so which of the
+ * structs below, is in flags.
+ *
+ * NODE_FLAGS_LEAF: a struct art_leaf, which ends a key and holds a copy
+ * of it.
+ *
+ * NODE_FLAGS_INNER_4 and NODE_FLAGS_INNER_16: up to 4 or 16 children,
+ * found by comparing the key byte with each of theirs.
+ *
+ * NODE_FLAGS_INNER_48: up to 48 children, whose index is looked up by the
+ * key byte in a 256 byte array.
+ *
+ * NODE_FLAGS_INNER_256: a child for every key byte.
  */
 struct radix_tree_node {
-    unsigned long key_len;
-    art_key_t *key;
+    /* See NODE_FLAGS_* */
+    uint8_t flags;
 
-    /*
-     * Array of keys and pointers.
-     *
-     * If the flags field is NODE_FLAGS_LEAF, then this is a leaf node
-     * and the children array is unused.
-     *
-     * If the flags field is NODE_FLAGS_INNER_4, then this is an inner
-     * node with 4 keys and 4 pointers to children. The keys are stored
-     * in the first 4 bytes of the data array and the pointers are stored
-     * in the next 4 bytes.
-     *
-     * If the flags field is NODE_FLAGS_INNER_16, then this is an inner
-     * node with 16 keys and 16 pointers to children. You can find the key
-     * efficiently with a binary search.
-     *
-     * If the flags field is NODE_FLAGS_INNER_48, then this is an inner
-     * node with 48 keys. The keys index a second array of pointers to
-     * children.
-     *
-     * If the flags field is NODE_FLAGS_INNER_256, then this is an inner
-     * node with 256 keys. The keys index directly into the children
-     * array.
-     */
-    unsigned long *arr;
+    /* A key ends at this inner node. Leaves always end a key */
+    bool key_end;
 
-    /* See NODE_FLAGS_* */
-    unsigned int flags;
+    /* Number of children of an inner node */
+    uint16_t nr;
+
+    /* Bytes in the prefix of an inner node, see ART_PREFIX_INLINE */
+    uint32_t prefix_len;
 
     /* How many IP-map pairs matched this path */
     unsigned long count;
 
-    unsigned int prefix_len;
-    art_key_t prefix[128];
+    /*
+     * The key of a leaf below an inner node. Its prefix is the prefix_len
+     * bytes of it from the depth of the node on, so a prefix is never
+     * copied past the inline bytes.
+     */
+    const art_key_t *key;
+
+    art_key_t prefix[ART_PREFIX_INLINE];
+};
+
+struct art_leaf {
+    struct radix_tree_node n;
+    uint32_t key_len;
+    /* Keys made of frames are read back as frames, see for_each_key() */
+    art_key_t key[] __attribute__((aligned(8)));
+};
+
+struct art_node4 {
+    struct radix_tree_node n;
+    art_key_t keys[4];
+    struct radix_tree_node *children[4];
+};
+
+struct art_node16 {
+    struct radix_tree_node n;
+    art_key_t keys[16];
+    struct radix_tree_node *children[16];
+};
+
+struct art_node48 {
+    struct radix_tree_node n;
+    /* Index into children by key byte, EMPTY if there's no child */
+    art_key_t index[256];
+    struct radix_tree_node *children[48];
 };
 
+struct art_node256 {
+    struct radix_tree_node n;
+    struct radix_tree_node *children[256];
+};
+
+static inline struct art_leaf *art_leaf(struct radix_tree_node *node)
+{
+    return (struct art_leaf *)node;
+}
+
 #ifndef die
 #define die() exit(1)
 #endif
 
+#ifndef cs_stat_inc
+#define cs_stat_inc(stat)       do { } while (0)
+#define cs_stat_add(stat, n)    do { (void)(n); } while (0)
+#endif
+
 #ifndef min
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #endif
@@ -83,12 +166,37 @@ struct radix_tree_node {
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 #endif
 
-#define cfree(ptr, flag) free(ptr)
-#define ccalloc(num, size) calloc(num, size)
+/*
+ * As a backend, allocations are accounted by type through ccalloc() and
+ * cfree() from callstack.h. The unit tests build art.c on its own.
+ */
+#ifndef __CALLSTACK_H__
+#define cfree(ptr, type) free(ptr)
+#define ccalloc(num, size, type) calloc(num, size)
+#endif
 
 /*
  * API
  */
-void insert(struct radix_tree_node **_node, struct stream *stream,
-                   struct radix_tree_node *leaf, int depth);
+bool insert(struct radix_tree_node **_node, struct stream *stream,
+            struct radix_tree_node *leaf, int depth);
+void free_tree(struct radix_tree_node *node);
+
+/* Fill in the layout of xform from its options, -1 if they're invalid */
+int art_key_transform_init(struct art_key_transform *xform);
+
+/* Whether no nr frames of entries lose information to xform->strip */
+bool art_key_transform_lossless(const struct art_key_transform *xform,
+                                const art_key_t *data, unsigned long nr);
+
+/*
+ * Called with a key, its length and the number of times it was inserted.
+ * The length is that of the key as it was read, through the transform of
+ * the stream it was inserted with.
+ */
+typedef void (*for_each_key_fn)(const art_key_t *key, unsigned long len,
+                                unsigned long count, void *arg);
+
+/* Call fn on every key in the tree rooted at node, in no particular order */
+void for_each_key(struct radix_tree_node *node, for_each_key_fn fn, void *arg);
 #endif /* __ART_H__ */
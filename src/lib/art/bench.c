@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <time.h>
+#include "art.c"
+
+/*
+ * Time each kernel of every set the CPU runs, in ns per call, on the
+ * inputs the tree gives them: Node4 and Node16 searches for a key that's
+ * there four times out of five, prefixes and keys that match up to their
+ * last byte, which is what comparing a stack that's already in the tree
+ * does, and Node48 indexes with 48 children.
+ */
+
+#define NR_INPUTS	4096
+#define MAX_LEN		1024
+
+static art_key_t keys[NR_INPUTS][16];
+static art_key_t queries[NR_INPUTS];
+static art_key_t a[MAX_LEN], b[MAX_LEN];
+static art_key_t index48[256];
+
+/* Keep the results alive */
+static volatile unsigned long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct kernel_bench {
+	const char *name;
+	unsigned int arg;
+	unsigned long iterations;
+	void (*run)(const struct art_simd *simd, unsigned int arg,
+		    unsigned long iterations);
+};
+
+static void run_find_key(const struct art_simd *simd, unsigned int nr,
+			 unsigned long iterations)
+{
+	unsigned long sum = 0;
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		unsigned int in = i % NR_INPUTS;
+
+		sum += simd->find_key(keys[in], nr, queries[in]);
+	}
+	sink = sum;
+}
+
+static void run_mismatch(const struct art_simd *simd, unsigned int len,
+			 unsigned long iterations)
+{
+	unsigned long sum = 0;
+
+	for (unsigned long i = 0; i < iterations; i++)
+		sum += simd->mismatch(a, b, len);
+	sink = sum;
+}
+
+static void run_index_used(const struct art_simd *simd, unsigned int unused,
+			   unsigned long iterations)
+{
+	uint64_t used[4];
+	unsigned long sum = 0;
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		simd->index_used(index48, used);
+		sum += used[i % 4];
+	}
+	sink = sum;
+}
+
+static struct kernel_bench benches[] = {
+	{ "find_key", 4, 50000000, run_find_key },
+	{ "find_key", 16, 50000000, run_find_key },
+	{ "mismatch", 8, 50000000, run_mismatch },
+	{ "mismatch", 16, 50000000, run_mismatch },
+	{ "mismatch", 64, 20000000, run_mismatch },
+	{ "mismatch", 256, 5000000, run_mismatch },
+	{ "mismatch", 1024, 2000000, run_mismatch },
+	{ "index_used", 48, 5000000, run_index_used },
+};
+
+static void init_inputs(void)
+{
+	srand(1);
+
+	/* Distinct keys in each node, one query in five not among the first 4 */
+	for (unsigned int in = 0; in < NR_INPUTS; in++) {
+		unsigned int base = rand();
+
+		for (unsigned int i = 0; i < 16; i++)
+			keys[in][i] = base + i * 13;
+		queries[in] = keys[in][rand() % 5 ? rand() % 4 : 4 + rand() % 12];
+	}
+
+	for (unsigned int i = 0; i < MAX_LEN; i++)
+		a[i] = b[i] = rand();
+
+	memset(index48, EMPTY, sizeof(index48));
+	for (unsigned int i = 0; i < 48; i++)
+		index48[(i * 163) % 256] = i;
+}
+
+int main(int argc, char **argv)
+{
+	init_inputs();
+
+	printf("%-16s", "ns/call");
+	for (const struct art_simd **simd = art_simd_all; *simd; simd++)
+		printf("%10s", (*simd)->name);
+	printf("\n");
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(benches); i++) {
+		struct kernel_bench *kb = &benches[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s/%u", kb->name, kb->arg);
+		printf("%-16s", name);
+
+		/* Differ in the last byte only */
+		if (kb->run == run_mismatch) {
+			memcpy(b, a, sizeof(a));
+			b[kb->arg - 1] ^= 1;
+		}
+
+		for (const struct art_simd **simd = art_simd_all; *simd; simd++) {
+			double t0, t1;
+
+			if (!art_simd_supported(*simd)) {
+				printf("%10s", "-");
+				continue;
+			}
+
+			kb->run(*simd, kb->arg, kb->iterations / 10);
+			t0 = now();
+			kb->run(*simd, kb->arg, kb->iterations);
+			t1 = now();
+			printf("%10.2f", (t1 - t0) / kb->iterations);
+		}
+		printf("\n");
+	}
+
+	art_simd_select(NULL);
+	printf("Selected: %s\n", art_simd.name);
+	return 0;
+}
+
+// vim: ts=8 sw=8 noexpandtab
@@ -22,6 +22,7 @@
 #include <string.h>
 #include "callchain.h"
 #include "callstack.h"
+#include "cs_stats.h"
 #include "data/data.h"
 
 #include "art.c"
@@ -55,62 +56,162 @@
  * feed the ip addresses big endian to take advance of the fact that there is
  * less variability in the higher bits, e.g. 0xffff0000 and 0xffff5555 differ
  * only in the lower 16 bits.
+ *
+ * Which of these is done is up to the key transform given with -k, see
+ * struct art_key_transform. By default the bytes are fed as they are.
  */
 
-static struct callstack_tree *art_tree_get(unsigned long id)
+static struct art_key_transform art_keys;
+
+/* NULL unless art_keys changes anything */
+static const struct art_key_transform *art_xform;
+
+/* Whether a stack has been kept whole, see art_tree_insert() */
+static bool art_whole_warned;
+
+/*
+ * Parse a comma separated list of: ip or map, for the field fed first, le or
+ * be, for the byte order, and strip=N, for the high bytes left out.
+ */
+int art_keys_parse(const char *arg)
 {
-    return NULL;
+    char *copy = strdup(arg), *tok, *save;
+    struct art_key_transform xform = {};
+    int ret = 0;
+
+    if (!copy)
+        die();
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(tok, "ip")) {
+            xform.map_first = false;
+        } else if (!strcmp(tok, "map")) {
+            xform.map_first = true;
+        } else if (!strcmp(tok, "le")) {
+            xform.big_endian = false;
+        } else if (!strcmp(tok, "be")) {
+            xform.big_endian = true;
+        } else if (!strncmp(tok, "strip=", 6)) {
+            char *end;
+
+            xform.strip = strtoul(tok + 6, &end, 0);
+            if (*end || end == tok + 6)
+                ret = -1;
+        } else {
+            ret = -1;
+        }
+    }
+    free(copy);
+
+    if (ret < 0 || art_key_transform_init(&xform) < 0) {
+        fprintf(stderr, "Invalid key transform: %s\n", arg);
+        return -1;
+    }
+
+    art_keys = xform;
+    art_xform = xform.map_first || xform.big_endian || xform.strip ?
+                &art_keys : NULL;
+    return 0;
 }
 
-static void art_tree_put(struct callstack_tree *tree)
+/*
+ * Select the kernels the tree searches nodes and compares keys with, by
+ * name, or NULL for the best the CPU runs. See src/lib/art/simd.h.
+ */
+const char *art_simd_parse(const char *arg)
 {
-    cfree(tree, false);
+    if (art_simd_select(arg) < 0) {
+        fprintf(stderr, "Unknown or unsupported ART kernels: %s\n", arg);
+        return NULL;
+    }
+    return art_simd.name;
 }
 
-static void
-art_tree_stats(struct callstack_tree *cs_tree, struct stats *stats)
+static struct callstack_tree *art_tree_get(unsigned long id)
 {
+    return NULL;
 }
 
 struct art_priv {
     /* Root of the ART */
     struct radix_tree_node *root;
+
+    /*
+     * Root of an ART of the stacks with frames the key transform would
+     * lose bytes of, keyed by their frames as they are. A stack always
+     * goes to the same one, so no key is in both.
+     */
+    struct radix_tree_node *whole_root;
+
+    /* Number of distinct keys inserted */
+    unsigned long unique;
+
+    /* Most frames in a key */
+    unsigned long max_depth;
+
+    /* Built from the keys by art_tree_callchain(), NULL until then */
+    struct callchain_root *callchain;
 };
 
-extern unsigned long __max_depth;
+static void
+art_tree_stats(struct callstack_tree *cs_tree, struct stats *stats)
+{
+    struct art_priv *priv = cs_tree->priv;
+
+    stats->num_unique += priv->unique;
+    if (priv->max_depth > stats->max_depth)
+        stats->max_depth = priv->max_depth;
+}
+
+static void art_tree_put(struct callstack_tree *tree)
+{
+    struct art_priv *priv = tree->priv;
+
+    free_tree(priv->root);
+    free_tree(priv->whole_root);
+    if (priv->callchain) {
+        free_callchain(priv->callchain);
+        cfree(priv->callchain, MEM_TREE);
+    }
+    cfree(priv, MEM_TREE);
+    cfree(tree, MEM_TREE);
+}
 
 static void art_tree_insert(struct callstack_tree *tree,
-                            struct callstack_entry *stack)
+                            const struct stack *stack)
 {
     struct art_priv *priv = tree->priv;
     struct stream _stream;
     struct stream *stream = &_stream;
+    struct radix_tree_node **root = &priv->root;
     struct radix_tree_node *leaf;
+    const struct callstack_entry *entries;
+    unsigned int nr;
 
     /*
      * We don't need to build a cursor (unlike the linux backend) because
      * we don't need to do any manipuation of the callchain nodes. We simply
      * feed the bytes into the ART.
      */
-    for (int n = 0; n < MAX_STACK_ENTRIES; n++) {
-        struct callstack_entry *entry = &stack[n];
-        if (!entry->ip) {
-            stream->end = (art_key_t *)entry;
-            break;
-        }
-    }
+    entries = stack_entries(stack, &nr);
+    if (nr > priv->max_depth)
+        priv->max_depth = nr;
+    stream_init(stream, (art_key_t *)entries);
+    stream->end = (art_key_t *)(entries + nr);
+    stream->xform = art_xform;
 
-    stream_init(stream, (art_key_t *)stack);
+    if (art_xform && !art_key_transform_lossless(art_xform, stream->data, nr)) {
+        if (!__atomic_exchange_n(&art_whole_warned, true, __ATOMIC_RELAXED))
+            fprintf(stderr, "Frames don't fit in keys with strip=%u, "
+                    "keeping their stacks whole\n", art_xform->strip);
+        stream->xform = NULL;
+        root = &priv->whole_root;
+    }
 
-    // Unroll the stream?!?!!?
+    /* insert() copies the key into any leaf it creates */
     leaf = NULL;
-    // leaf->key = ccalloc(1, key_len);
-    // if (!leaf->key)
-        // die();
-
-    //memcpy(leaf->key, stream->data, key_len);
-
-    insert(&priv->root, stream, leaf, 0);
+    if (insert(root, stream, leaf, 0))
+        priv->unique++;
 }
 
 static inline void init_root(struct radix_tree_node **root)
@@ -124,11 +225,11 @@ static struct callstack_tree *art_tree_new()
     struct callstack_tree *cs_tree;
     struct art_priv *priv;
 
-    cs_tree = ccalloc(1, sizeof(*cs_tree));
+    cs_tree = ccalloc(1, sizeof(*cs_tree), MEM_TREE);
     if (!cs_tree)
         die();
 
-    priv = ccalloc(1, sizeof(*priv));
+    priv = ccalloc(1, sizeof(*priv), MEM_TREE);
     if (!priv)
         die();
 
@@ -139,9 +240,46 @@ static struct callstack_tree *art_tree_new()
     return cs_tree;
 }
 
+/*
+ * A key is the frames of a stack, as they were inserted. Its length is
+ * that of the frames read through the transform.
+ */
+static void append_key(const art_key_t *key, unsigned long len,
+                       unsigned long count, void *arg)
+{
+    unsigned int frame_len = art_xform ? art_xform->frame_len : ART_FRAME_SIZE;
+
+    append_callchain(arg, (const struct callstack_entry *)key,
+                     len / frame_len, count);
+}
+
+static void append_whole_key(const art_key_t *key, unsigned long len,
+                             unsigned long count, void *arg)
+{
+    append_callchain(arg, (const struct callstack_entry *)key,
+                     len / ART_FRAME_SIZE, count);
+}
+
+static struct callchain_root *art_tree_callchain(struct callstack_tree *tree)
+{
+    struct art_priv *priv = tree->priv;
+
+    if (!priv->callchain) {
+        priv->callchain = ccalloc(1, sizeof(*priv->callchain), MEM_TREE);
+        if (!priv->callchain)
+            die();
+        callchain_init(priv->callchain);
+        for_each_key(priv->root, append_key, priv->callchain);
+        for_each_key(priv->whole_root, append_whole_key, priv->callchain);
+    }
+
+    return priv->callchain;
+}
+
 struct callstack_ops art_ops = {
     .get = art_tree_get,
     .put = art_tree_put,
     .stats = art_tree_stats,
     .new = art_tree_new,
+    .callchain = art_tree_callchain,
 };
@@ -0,0 +1,266 @@
+/*
+ * Kernels for the byte loops of the ART, see simd.h.
+ *
+ * The vector versions are compiled for their instruction set with the
+ * target attribute, so the rest of the build needs no -m flags and only
+ * runs them once art_simd_select() has checked the CPU has it.
+ */
+#include <string.h>
+#include <immintrin.h>
+#include "simd.h"
+
+/*
+ * Scalar: the loops as the tree had them
+ */
+
+static int find_key_scalar(const art_key_t *keys, unsigned int nr, art_key_t key)
+{
+    for (unsigned int i = 0; i < nr; i++) {
+        if (keys[i] == key)
+            return i;
+    }
+    return -1;
+}
+
+static unsigned int mismatch_scalar(const art_key_t *a, const art_key_t *b,
+                                    unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i < len && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+static void index_used_scalar(const art_key_t *index, uint64_t used[4])
+{
+    memset(used, 0, 4 * sizeof(used[0]));
+    for (unsigned int i = 0; i < 256; i++) {
+        if (index[i] != EMPTY)
+            used[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+/*
+ * What's left of a mismatch after the vectors, 8 bytes at a time. x86 is
+ * little endian, so the first byte that differs is the lowest set one.
+ */
+static inline unsigned int mismatch_tail(const art_key_t *a, const art_key_t *b,
+                                         unsigned int i, unsigned int len)
+{
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x, y;
+
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            return i + __builtin_ctzll(x ^ y) / 8;
+    }
+    for (; i < len && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+/*
+ * SSE2: 16 bytes at a time
+ */
+
+__attribute__((target("sse2")))
+static int find_key_sse2(const art_key_t *keys, unsigned int nr, art_key_t key)
+{
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)keys),
+                                _mm_set1_epi8(key));
+    unsigned int bits = _mm_movemask_epi8(eq) & ((1U << nr) - 1);
+
+    return bits ? __builtin_ctz(bits) : -1;
+}
+
+__attribute__((target("sse2")))
+static unsigned int mismatch_sse2(const art_key_t *a, const art_key_t *b,
+                                  unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                    _mm_loadu_si128((const __m128i *)(b + i)));
+        unsigned int ne = ~_mm_movemask_epi8(eq) & 0xffff;
+
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+    return mismatch_tail(a, b, i, len);
+}
+
+__attribute__((target("sse2")))
+static void index_used_sse2(const art_key_t *index, uint64_t used[4])
+{
+    __m128i empty = _mm_set1_epi8((char)EMPTY);
+
+    memset(used, 0, 4 * sizeof(used[0]));
+    for (unsigned int i = 0; i < 256; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(index + i)),
+                                    empty);
+        uint64_t ne = ~_mm_movemask_epi8(eq) & 0xffff;
+
+        used[i / 64] |= ne << (i % 64);
+    }
+}
+
+/*
+ * AVX2: 32 bytes at a time. The 16 keys of a node fit in one SSE2
+ * register already, so its find_key is the SSE2 one.
+ */
+
+__attribute__((target("avx2")))
+static unsigned int mismatch_avx2(const art_key_t *a, const art_key_t *b,
+                                  unsigned int len)
+{
+    unsigned int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                       _mm256_loadu_si256((const __m256i *)(b + i)));
+        unsigned int ne = ~(unsigned int)_mm256_movemask_epi8(eq);
+
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+    return mismatch_tail(a, b, i, len);
+}
+
+__attribute__((target("avx2")))
+static void index_used_avx2(const art_key_t *index, uint64_t used[4])
+{
+    __m256i empty = _mm256_set1_epi8((char)EMPTY);
+
+    memset(used, 0, 4 * sizeof(used[0]));
+    for (unsigned int i = 0; i < 256; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(index + i)),
+                                       empty);
+        uint64_t ne = ~(uint32_t)_mm256_movemask_epi8(eq);
+
+        used[i / 64] |= ne << (i % 64);
+    }
+}
+
+/*
+ * AVX-512 (BW and VL): 64 bytes at a time, and compares straight into a
+ * mask register. Masked loads don't fault on the bytes they leave out, so
+ * the end of a mismatch is one more compare rather than a tail loop.
+ */
+
+__attribute__((target("avx512bw,avx512vl")))
+static int find_key_avx512(const art_key_t *keys, unsigned int nr, art_key_t key)
+{
+    __mmask16 bits = _mm_mask_cmpeq_epi8_mask((1U << nr) - 1,
+                                              _mm_loadu_si128((const __m128i *)keys),
+                                              _mm_set1_epi8(key));
+
+    return bits ? __builtin_ctz(bits) : -1;
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static unsigned int mismatch_avx512(const art_key_t *a, const art_key_t *b,
+                                    unsigned int len)
+{
+    unsigned int i;
+    __mmask64 ne, mask;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        ne = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a + i),
+                                     _mm512_loadu_si512(b + i));
+        if (ne)
+            return i + __builtin_ctzll(ne);
+    }
+    if (i == len)
+        return i;
+
+    mask = (1ULL << (len - i)) - 1;
+    ne = _mm512_cmpneq_epi8_mask(_mm512_maskz_loadu_epi8(mask, a + i),
+                                 _mm512_maskz_loadu_epi8(mask, b + i));
+    return ne ? i + __builtin_ctzll(ne) : len;
+}
+
+__attribute__((target("avx512bw,avx512vl")))
+static void index_used_avx512(const art_key_t *index, uint64_t used[4])
+{
+    __m512i empty = _mm512_set1_epi8((char)EMPTY);
+
+    for (unsigned int i = 0; i < 4; i++)
+        used[i] = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(index + i * 64),
+                                          empty);
+}
+
+static const struct art_simd art_simd_scalar = {
+    .name = "scalar",
+    .find_key = find_key_scalar,
+    .mismatch = mismatch_scalar,
+    .index_used = index_used_scalar,
+};
+
+static const struct art_simd art_simd_sse2 = {
+    .name = "sse2",
+    .find_key = find_key_sse2,
+    .mismatch = mismatch_sse2,
+    .index_used = index_used_sse2,
+};
+
+static const struct art_simd art_simd_avx2 = {
+    .name = "avx2",
+    .find_key = find_key_sse2,
+    .mismatch = mismatch_avx2,
+    .index_used = index_used_avx2,
+};
+
+static const struct art_simd art_simd_avx512 = {
+    .name = "avx512",
+    .find_key = find_key_avx512,
+    .mismatch = mismatch_avx512,
+    .index_used = index_used_avx512,
+};
+
+const struct art_simd *art_simd_all[] = {
+    &art_simd_scalar,
+    &art_simd_sse2,
+    &art_simd_avx2,
+    &art_simd_avx512,
+    NULL,
+};
+
+struct art_simd art_simd = art_simd_scalar;
+
+/*
+ * __builtin_cpu_supports() reads cpuid, and for AVX2 and AVX-512 also
+ * checks that the OS saves their registers.
+ */
+bool art_simd_supported(const struct art_simd *simd)
+{
+    __builtin_cpu_init();
+
+    if (simd == &art_simd_sse2)
+        return __builtin_cpu_supports("sse2");
+    if (simd == &art_simd_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (simd == &art_simd_avx512)
+        return __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vl");
+    return true;
+}
+
+int art_simd_select(const char *name)
+{
+    const struct art_simd *best = NULL;
+
+    for (const struct art_simd **simd = art_simd_all; *simd; simd++) {
+        if (name && strcmp((*simd)->name, name))
+            continue;
+        if (art_simd_supported(*simd))
+            best = *simd;
+    }
+
+    if (!best)
+        return -1;
+    art_simd = *best;
+    return 0;
+}
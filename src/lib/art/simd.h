@@ -0,0 +1,45 @@
+#ifndef __ART_SIMD_H__
+#define __ART_SIMD_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "art.h"
+
+/*
+ * The loops over key bytes on the ART's insert path, as kernels with a
+ * scalar version and one per x86 instruction set. The tree calls them
+ * through art_simd, which starts out scalar. art_simd_select() switches
+ * it to the best set cpuid says the CPU and OS support, or to one by
+ * name, e.g. "scalar" to compare against.
+ */
+struct art_simd {
+    const char *name;
+
+    /*
+     * Index of key among the first nr, at most 16, of keys, or -1. 16
+     * bytes must be readable at keys, whatever nr is: the keys of a
+     * Node4 are followed by its children.
+     */
+    int (*find_key)(const art_key_t *keys, unsigned int nr, art_key_t key);
+
+    /* How many bytes a and b have in common from the start, up to len */
+    unsigned int (*mismatch)(const art_key_t *a, const art_key_t *b,
+                             unsigned int len);
+
+    /* Set bit i of used for every byte i of a Node48's index that isn't EMPTY */
+    void (*index_used)(const art_key_t *index, uint64_t used[4]);
+};
+
+/* The kernels in use */
+extern struct art_simd art_simd;
+
+/* Select the kernels by name, NULL for the best. -1 if the CPU can't run them */
+int art_simd_select(const char *name);
+
+/* Whether the CPU can run the kernels of simd */
+bool art_simd_supported(const struct art_simd *simd);
+
+/* Every set of kernels, the scalar ones first, NULL terminated */
+extern const struct art_simd *art_simd_all[];
+
+#endif /* __ART_SIMD_H__ */
@@ -1,17 +1,13 @@
 #include <stdio.h>
 #include "art.c"
 
-/*
- * TODO: Need to add
- * - SIMD comparsion for NODE_16
- */
-
 typedef void (*funcptr)(void);
 
 static inline unsigned int
 max_height(struct radix_tree_node *node, unsigned int max)
 {
-	unsigned int count = 0;
+	struct radix_tree_node **slots;
+	unsigned int count = 0, nr;
 
 	if (!node)
 		return max;
@@ -23,8 +19,9 @@ max_height(struct radix_tree_node *node, unsigned int max)
 		break;
 	case NODE_FLAGS_INNER_4:
 		int m = max;
-		for (int i = 0; i < node->key_len; i++) {
-			count = max_height((struct radix_tree_node *)node->arr[i], m);
+		slots = children(node, &nr);
+		for (int i = 0; i < nr; i++) {
+			count = max_height(slots[i], m);
 			if (count > max) {
 				max = count;
 			}
@@ -34,6 +31,12 @@ max_height(struct radix_tree_node *node, unsigned int max)
 	return max;
 }
 
+static inline art_key_t child_key(struct radix_tree_node *node, unsigned int i)
+{
+	assert(node->flags == NODE_FLAGS_INNER_4);
+	return ((struct art_node4 *)node)->keys[i];
+}
+
 #define STREAM_ENTRY(k) k, k + strlen(k)
 
 static void test1(void)
@@ -57,9 +60,9 @@ static void test1(void)
 	}
 
 	assert(root->flags == NODE_FLAGS_INNER_4);
-	assert(root->key_len == 2);
-	assert(root->key[0] == 'o');
-	assert(root->key[1] == 'u');
+	assert(root->nr == 2);
+	assert(child_key(root, 0) == 'o');
+	assert(child_key(root, 1) == 'u');
 	assert(root->prefix_len == 1);
 	assert(root->prefix[0] == 'f');
 	assert(max_height(root, 0) == 2);
@@ -97,8 +100,8 @@ static void test2a(void)
 
 	assert(root->flags == NODE_FLAGS_INNER_4);
 	assert(!strcmp(root->prefix, "ABCDE"));
-	assert(root->key[0] == 'F');
-	assert(root->key[1] == 'H');
+	assert(child_key(root, 0) == 'F');
+	assert(child_key(root, 1) == 'H');
 }
 
 static void test2b(void)
@@ -129,8 +132,8 @@ static void test2b(void)
 
 	assert(root->flags == NODE_FLAGS_INNER_4);
 	assert(!strcmp(root->prefix, "ABCDE"));
-	assert(root->key[0] == 'F');
-	assert(root->key[1] == 'H');
+	assert(child_key(root, 0) == 'F');
+	assert(child_key(root, 1) == 'H');
 }
 
 /*
@@ -157,7 +160,7 @@ static void test3(void)
 	}
 
 	assert(root->flags == NODE_FLAGS_LEAF);
-	assert(root->key_len == strlen(keys[0]));
+	assert(art_leaf(root)->key_len == strlen(keys[0]));
 	assert(max_height(root, 0) == 1);
 }
 
@@ -233,7 +236,7 @@ static void test4(void)
 	}
 
 	assert(root->flags == NODE_FLAGS_INNER_4);
-	assert(root->key_len == strlen(keys[0]));
+	assert(root->nr == 1);
 	int height = max_height(root, 0);
 	assert(height == 26);
 }
@@ -262,19 +265,18 @@ static void test5(void)
 	}
 
 	assert(root->flags == NODE_FLAGS_INNER_4);
-	assert(root->key_len == 2);
+	assert(root->nr == 2);
 	assert(max_height(root, 0) == 2);
 }
 
 /*
- * TEST: Prefixes larger than PREFIX_LEN should create a chain of
- * inner nodes. And everything should continue to work if a new key
- * splits that chain.
+ * TEST: A prefix of any length should be a single inner node. And
+ * everything should continue to work if a new key splits it.
  */
 static void test6a(void)
 {
 	struct radix_tree_node *r = NULL;
-	unsigned int prefix_sz = sizeof(r->prefix) / sizeof(r->prefix[0]);
+	unsigned int prefix_sz = 128;
 	unsigned int remaining = prefix_sz * 3;
 	art_key_t *keys[3];
 
@@ -300,23 +302,24 @@ static void test6a(void)
 	}
 
 	assert(r->flags == NODE_FLAGS_INNER_4);
+	assert(r->prefix_len == 2 * prefix_sz + 1);
 	int height = max_height(r, 0);
-	assert(height == 3);
+	assert(height == 2);
 
 	// Insert a new key that will split the root node 
 	keys[2] = "AAAAAAB";
 	struct stream s2 = { STREAM_ENTRY(keys[2]) };
 	insert(&r, &s2, NULL, 0);
 	height = max_height(r, 0);
-	assert(height == 4);
-	assert(r->key_len == 2);
+	assert(height == 3);
+	assert(r->nr == 2);
 	assert(r->prefix_len == strlen("AAAAAA"));
 }
 
 static void test6b(void)
 {
 	struct radix_tree_node *r = NULL;
-	unsigned int prefix_sz = sizeof(r->prefix) / sizeof(r->prefix[0]);
+	unsigned int prefix_sz = 128;
 	art_key_t *keys[2];
 
 	keys[0] = calloc(1, prefix_sz + 1);
@@ -371,7 +374,7 @@ static void test7(void)
 	}
 
 	assert(r->flags == NODE_FLAGS_INNER_16);
-	assert(r->key_len == ARRAY_SIZE(s) - 1);
+	assert(r->nr == ARRAY_SIZE(s) - 1);
 
 	art_key_t *keys2[] = {
 		"F","G","H","I","J","K","L","M","N","O","P","Q"
@@ -397,7 +400,7 @@ static void test7(void)
 	}
 
 	assert(r->flags == NODE_FLAGS_INNER_48);
-	assert(r->key_len == ARRAY_SIZE(s) + ARRAY_SIZE(s2) - 2);
+	assert(r->nr == ARRAY_SIZE(s) + ARRAY_SIZE(s2) - 2);
 }
 
 static unsigned long count(struct radix_tree_node *root, struct stream *stream)
@@ -453,7 +456,7 @@ static void test9(void)
 	insert(&r, &s, NULL, 0);
 	n = search(r, &s, 0);
 	assert(n != NULL);
-	assert(!strcmp(n->key, "foo"));
+	assert(!strcmp(art_leaf(n)->key, "foo"));
 }
 
 static void test10(void)
@@ -469,17 +472,318 @@ static void test10(void)
 	insert(&r, &s[0], NULL, 0);
 	n = search(r, &s[0], 0);
 	assert(n != NULL);
-	assert(!strcmp(n->key, "DEF"));
+	assert(!strcmp(art_leaf(n)->key, "DEF"));
 
 	insert(&r, &s[1], NULL, 0);
 	n = search(r, &s[1], 0);
 	assert(n != NULL);
-	assert(!strcmp(n->key, "DGH"));
+	assert(!strcmp(art_leaf(n)->key, "DGH"));
 
 	insert(&r, &s[2], NULL, 0);
 	n = search(r, &s[2], 0);
 	assert(n != NULL);
-	assert(!strcmp(n->key, "DEFGZ"));
+	assert(!strcmp(art_leaf(n)->key, "DEFGZ"));
+}
+
+struct seen_key {
+	char key[512];
+	unsigned long count;
+};
+
+struct seen_keys {
+	struct seen_key keys[16];
+	unsigned int nr;
+};
+
+static void see_key(const art_key_t *key, unsigned long len,
+		    unsigned long count, void *arg)
+{
+	struct seen_keys *seen = arg;
+	struct seen_key *k = &seen->keys[seen->nr++];
+
+	assert(len < sizeof(k->key));
+	memcpy(k->key, key, len);
+	k->key[len] = '\0';
+	k->count = count;
+}
+
+static unsigned long seen_count(struct seen_keys *seen, const char *key)
+{
+	for (unsigned int i = 0; i < seen->nr; i++) {
+		if (!strcmp(seen->keys[i].key, key))
+			return seen->keys[i].count;
+	}
+	return 0;
+}
+
+/*
+ * TEST: for_each_key() reports every key once with the number of times
+ * it was inserted, including keys that end at inner nodes.
+ */
+static void test11(void)
+{
+	struct radix_tree_node *r = NULL;
+	struct seen_keys seen = { .nr = 0 };
+	char long1[128], long2[128];
+	const char *keys[] = {
+		"D", "DEF", "DEFGZ", "DGH", "Z", long1, long2,
+	};
+	unsigned int nr = ARRAY_SIZE(keys);
+
+	memset(long1, 'x', 100);
+	long1[100] = '\0';
+	strcpy(long2, long1);
+	strcat(long2, "abc");
+
+	/* Key i is inserted i + 1 times */
+	for (unsigned int i = 0; i < nr; i++) {
+		for (unsigned int j = 0; j <= i; j++) {
+			struct stream s = { STREAM_ENTRY((art_key_t *)keys[j]) };
+
+			insert(&r, &s, NULL, 0);
+		}
+	}
+
+	for_each_key(r, see_key, &seen);
+	assert(seen.nr == nr);
+	for (unsigned int i = 0; i < nr; i++)
+		assert(seen_count(&seen, keys[i]) == nr - i);
+
+	free_tree(r);
+}
+
+struct seen_stacks {
+	unsigned long frame_len;
+	const unsigned long *stacks[4];
+	unsigned int nr_frames[4];
+	unsigned long counts[4];
+};
+
+static void see_stack(const art_key_t *key, unsigned long len,
+		      unsigned long count, void *arg)
+{
+	struct seen_stacks *seen = arg;
+
+	assert(len % seen->frame_len == 0);
+	for (unsigned int i = 0; i < ARRAY_SIZE(seen->stacks); i++) {
+		if (seen->nr_frames[i] == len / seen->frame_len &&
+		    !memcmp(seen->stacks[i], key, len / seen->frame_len * ART_FRAME_SIZE))
+			seen->counts[i] += count;
+	}
+}
+
+/*
+ * TEST: keys of frames read through a key transform. The frames are
+ * kept as they are, so for_each_key() hands them back unchanged.
+ */
+static void test12(void)
+{
+	struct art_key_transform xforms[] = {
+		{ .map_first = false, .big_endian = false, .strip = 0 },
+		{ .map_first = true, .big_endian = false, .strip = 0 },
+		{ .map_first = false, .big_endian = true, .strip = 2 },
+		{ .map_first = true, .big_endian = true, .strip = 2 },
+	};
+	/* Frames of (ip, map). b parts from a in its last ip, c is a's start */
+	unsigned long a[] = {
+		0x7f0000001010, 0x5500000010, 0x7f0000002020, 0x5500000010,
+		0xffffffff81000010, 0xffff888000000000, 0x7f0000003030, 0x5500000010,
+	};
+	unsigned long b[] = {
+		0x7f0000001010, 0x5500000010, 0x7f0000002020, 0x5500000010,
+		0xffffffff81000010, 0xffff888000000000, 0x7f0000003040, 0x5500000010,
+	};
+	unsigned long odd[] = { 0x1234000000001010, 0x5500000010 };
+	struct {
+		unsigned long *frames;
+		unsigned int nr;
+	} stacks[] = {
+		{ a, 4 }, { b, 4 }, { a, 2 }, { b, 3 },
+	};
+
+	/* Byte 0 of a big-endian map-first key is the map's highest kept */
+	assert(!art_key_transform_init(&xforms[3]));
+	assert(xforms[3].frame_len == 12);
+	assert(xforms[3].offsets[0] == 13 && xforms[3].offsets[5] == 8);
+	assert(xforms[3].offsets[6] == 5 && xforms[3].offsets[11] == 0);
+
+	assert(art_key_transform_lossless(&xforms[3], (art_key_t *)a, 4));
+	assert(!art_key_transform_lossless(&xforms[3], (art_key_t *)odd, 1));
+
+	for (unsigned int x = 0; x < ARRAY_SIZE(xforms); x++) {
+		struct art_key_transform *xform = &xforms[x];
+		struct radix_tree_node *r = NULL;
+		struct seen_stacks seen = { 0 };
+
+		assert(!art_key_transform_init(xform));
+		seen.frame_len = xform->frame_len;
+
+		/* Stack i is inserted i + 1 times */
+		for (unsigned int i = 0; i < ARRAY_SIZE(stacks); i++) {
+			seen.stacks[i] = stacks[i].frames;
+			seen.nr_frames[i] = stacks[i].nr;
+			for (unsigned int j = 0; j <= i; j++) {
+				struct stream s;
+
+				stream_init(&s, (art_key_t *)stacks[i].frames);
+				s.end = s.data + stacks[i].nr * ART_FRAME_SIZE;
+				s.xform = xform;
+				assert(insert(&r, &s, NULL, 0) == !j);
+			}
+		}
+
+		for (unsigned int i = 0; i < ARRAY_SIZE(stacks); i++) {
+			struct stream s;
+
+			stream_init(&s, (art_key_t *)stacks[i].frames);
+			s.end = s.data + stacks[i].nr * ART_FRAME_SIZE;
+			s.xform = xform;
+			assert(search(r, &s, 0));
+		}
+
+		for_each_key(r, see_stack, &seen);
+		for (unsigned int i = 0; i < ARRAY_SIZE(stacks); i++)
+			assert(seen.counts[i] == i + 1);
+
+		free_tree(r);
+	}
+}
+
+/*
+ * TEST: Prefixes longer than ART_PREFIX_INLINE keep only their first
+ * bytes in the node and are checked against a leaf for the rest, also
+ * when a new key parts from them past the inline bytes.
+ */
+static void test13(void)
+{
+	struct radix_tree_node *child, *r = NULL;
+	char keys[4][64];
+	unsigned int nr = ARRAY_SIZE(keys);
+
+	/* A Node4 takes the same malloc() chunk a 64 byte one would */
+	assert(sizeof(struct art_node4) <= 72);
+	/* Leaf keys can be read as frames */
+	assert(offsetof(struct art_leaf, key) % 8 == 0);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		for (unsigned int j = 0; j < 50; j++)
+			keys[i][j] = 'a' + j % 26;
+		keys[i][50] = '\0';
+	}
+	keys[0][40] = '0';
+	keys[1][40] = '1';
+	keys[2][20] = '2';
+	keys[3][30] = '3';
+
+	for (unsigned int i = 0; i < nr; i++) {
+		for (unsigned int j = 0; j <= i; j++) {
+			struct stream s = { STREAM_ENTRY((art_key_t *)keys[j]) };
+
+			insert(&r, &s, NULL, 0);
+		}
+	}
+
+	/* keys[2] parts at byte 20, the rest below at 40 and 30 */
+	assert(r->prefix_len == 20);
+	assert(!memcmp(r->prefix, keys[0], ART_PREFIX_INLINE));
+	assert(r->nr == 2);
+	child = *find_child(r, keys[0][20]);
+	assert(child->prefix_len == 30 - 21);
+	assert(!memcmp(child->prefix, &keys[0][21], ART_PREFIX_INLINE));
+
+	for (unsigned int i = 0; i < nr; i++) {
+		struct stream s = { STREAM_ENTRY((art_key_t *)keys[i]) };
+
+		assert(count(r, &s) == nr - i - 1);
+	}
+
+	free_tree(r);
+}
+
+/*
+ * TEST: A prefix hundreds of bytes long is one node, and stays readable
+ * when the leaf whose key it points into becomes an inner node.
+ */
+static void test14(void)
+{
+	struct radix_tree_node *r = NULL;
+	static char keys[4][320];
+	unsigned int nr = ARRAY_SIZE(keys);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		for (unsigned int j = 0; j < 300; j++)
+			keys[i][j] = 'a' + (j * 7) % 26;
+		keys[i][300] = '\0';
+	}
+	keys[1][250] = '1';
+	/* keys[2] is the start of keys[0], keys[3] goes on past its end */
+	keys[2][280] = '\0';
+	memset(&keys[3][300], 'z', 10);
+	keys[3][310] = '\0';
+
+	for (unsigned int i = 0; i < nr; i++) {
+		struct stream s = { STREAM_ENTRY((art_key_t *)keys[i]) };
+
+		assert(insert(&r, &s, NULL, 0));
+	}
+
+	assert(r->prefix_len == 250);
+	assert(r->nr == 2);
+	assert(max_height(r, 0) == 4);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		struct stream s = { STREAM_ENTRY((art_key_t *)keys[i]) };
+
+		assert(!insert(&r, &s, NULL, 0));
+		assert(count(r, &s) == 1);
+	}
+
+	free_tree(r);
+}
+
+/*
+ * TEST: Every set of kernels the CPU runs gives what the scalar ones do,
+ * for keys found at every position, differences at every offset of
+ * every length around the vector sizes and Node48 indexes of any fill.
+ */
+static void test15(void)
+{
+	const struct art_simd *scalar = art_simd_all[0];
+	art_key_t a[300], b[300], keys[16], index[256];
+
+	srand(15);
+	for (const struct art_simd **simd = art_simd_all; *simd; simd++) {
+		if (!art_simd_supported(*simd))
+			continue;
+
+		for (unsigned int nr = 0; nr <= 16; nr++) {
+			for (unsigned int i = 0; i < 16; i++)
+				keys[i] = i < nr ? 3 * i : 0xaa;
+			for (unsigned int key = 0; key < 256; key++)
+				assert((*simd)->find_key(keys, nr, key) ==
+				       scalar->find_key(keys, nr, key));
+		}
+
+		for (unsigned int len = 0; len <= 200; len++) {
+			for (unsigned int i = 0; i <= len; i++) {
+				for (unsigned int j = 0; j < len; j++)
+					a[j] = b[j] = rand();
+				if (i < len)
+					b[i] = ~a[i];
+				assert((*simd)->mismatch(a, b, len) == i);
+			}
+		}
+
+		for (unsigned int fill = 0; fill <= 256; fill += 16) {
+			uint64_t used[4], expect[4];
+
+			for (unsigned int i = 0; i < 256; i++)
+				index[i] = rand() % 256 < fill ? i % 48 : EMPTY;
+			(*simd)->index_used(index, used);
+			scalar->index_used(index, expect);
+			assert(!memcmp(used, expect, sizeof(used)));
+		}
+	}
 }
 
 int main(int argc, char **argv)
@@ -498,9 +802,17 @@ int main(int argc, char **argv)
 		test8,
 		test9,
 		test10,
+		test11,
+		test12,
+		test13,
+		test14,
+		test15,
 		NULL,
 	};
 
+	/* The tree is tested with the kernels it would use */
+	assert(!art_simd_select(NULL));
+
 	for (funcptr *f = tests; *f != NULL; f++, num_tests++) {
 		(*f)();
 	}
@@ -0,0 +1,95 @@
+#include "callchain.h"
+#include "callstack.h"
+#include "data/data.h"
+#include "frameart.c"
+
+struct frameart_priv {
+    struct frameart tree;
+
+    /* Most frames in a stack */
+    unsigned long max_depth;
+
+    /* Built from the stacks by frameart_callchain(), NULL until then */
+    struct callchain_root *callchain;
+};
+
+static void insert(struct callstack_tree *tree, const struct stack *stack)
+{
+    struct frameart_priv *priv = tree->priv;
+    const struct callstack_entry *entries;
+    unsigned int nr;
+
+    // The alphabet is whole frames, so the entries are the key as they are
+    entries = stack_entries(stack, &nr);
+    if (nr > priv->max_depth)
+        priv->max_depth = nr;
+    frameart_insert(&priv->tree, entries, nr);
+}
+
+static struct callstack_tree *frameart_new(void)
+{
+    struct callstack_tree *t = ccalloc(1, sizeof(struct callstack_tree), MEM_TREE);
+    if (!t) {
+        die();
+    }
+
+    t->priv = ccalloc(1, sizeof(struct frameart_priv), MEM_TREE);
+    if (!t->priv) {
+        die();
+    }
+
+    t->insert = insert;
+
+    return t;
+}
+
+static void frameart_put(struct callstack_tree *tree)
+{
+    struct frameart_priv *priv = tree->priv;
+
+    frameart_free(&priv->tree);
+    if (priv->callchain) {
+        free_callchain(priv->callchain);
+        cfree(priv->callchain, MEM_TREE);
+    }
+    cfree(priv, MEM_TREE);
+    cfree(tree, MEM_TREE);
+}
+
+static void frameart_stats(struct callstack_tree *cs_tree, struct stats *stats)
+{
+    struct frameart_priv *priv = cs_tree->priv;
+
+    stats->num_unique += priv->tree.unique;
+    stats->num_hits += priv->tree.hits;
+    if (priv->max_depth > stats->max_depth)
+        stats->max_depth = priv->max_depth;
+}
+
+static void append_stack(const struct callstack_entry *entries,
+                         unsigned int nr, unsigned long count, void *arg)
+{
+    append_callchain(arg, entries, nr, count);
+}
+
+static struct callchain_root *frameart_callchain(struct callstack_tree *tree)
+{
+    struct frameart_priv *priv = tree->priv;
+
+    if (!priv->callchain) {
+        priv->callchain = ccalloc(1, sizeof(*priv->callchain), MEM_TREE);
+        if (!priv->callchain)
+            die();
+        callchain_init(priv->callchain);
+        frameart_for_each(&priv->tree, append_stack, priv->callchain);
+    }
+
+    return priv->callchain;
+}
+
+struct callstack_ops frameart_ops = {
+    .put = frameart_put,
+    .stats = frameart_stats,
+    .new = frameart_new,
+    .callchain = frameart_callchain,
+};
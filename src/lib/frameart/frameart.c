@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frameart.h"
+#include "cs_stats.h"
+
+static inline enum mem_type node_type(unsigned int cap)
+{
+	if (!cap)
+		return MEM_FRAMEART_LEAF;
+	if (cap <= FRAMEART_SPAN)
+		return MEM_FRAMEART_SPAN;
+	return MEM_FRAMEART_HASH;
+}
+
+static struct frameart_node *node_alloc(unsigned int cap)
+{
+	struct frameart_node *node;
+
+	node = ccalloc(1, sizeof(*node) + cap * sizeof(node->edges[0]),
+		       node_type(cap));
+	if (!node) {
+		fprintf(stderr, "Failed allocation\n");
+		exit(EXIT_FAILURE);
+	}
+	node->cap = cap;
+	return node;
+}
+
+static void node_free(struct frameart_node *node)
+{
+	if (node->owns_key)
+		cfree((void *)node->key, MEM_FRAMEART_KEY);
+	cfree(node, node_type(node->cap));
+}
+
+static inline bool frame_eq(const struct callstack_entry *a,
+			    const struct callstack_entry *b)
+{
+	return a->ip == b->ip && a->map == b->map;
+}
+
+/* The ips of one map mostly differ in their low bits: mix them up */
+static inline unsigned long frame_hash(const struct callstack_entry *frame)
+{
+	unsigned long h = frame->ip ^ (frame->map * 0x9E3779B97F4A7C15ull);
+
+	return (h * 0x61C8864680B583EBull) >> 32;
+}
+
+/*
+ * A node of its own for a new stack, below where it parted from the
+ * others: the stack's frames from start on are its prefix
+ */
+static struct frameart_node *
+new_leaf(const struct callstack_entry *entries, unsigned int nr,
+	 unsigned int start)
+{
+	struct frameart_node *leaf = node_alloc(0);
+	struct callstack_entry *key;
+
+	key = ccalloc(nr, sizeof(*key), MEM_FRAMEART_KEY);
+	if (!key) {
+		fprintf(stderr, "Failed allocation\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(key, entries, nr * sizeof(*key));
+
+	leaf->key = key;
+	leaf->owns_key = true;
+	leaf->start = start;
+	leaf->prefix_len = nr - start;
+	leaf->count = 1;
+	return leaf;
+}
+
+/* How many frames of node's prefix the nr of entries have from depth on */
+static inline unsigned int match_prefix(struct frameart_node *node,
+					const struct callstack_entry *entries,
+					unsigned int nr, unsigned int depth)
+{
+	const struct callstack_entry *prefix = node->key + node->start;
+	unsigned int len = node->prefix_len, i;
+
+	cs_stat_inc(CS_STAT_KEY_CMPS);
+
+	/* Mostly it all matches, which one memcmp() tells */
+	if (len <= nr - depth &&
+	    !memcmp(prefix, &entries[depth], len * sizeof(*prefix))) {
+		cs_stat_add(CS_STAT_BYTES_CMPD, len * sizeof(*prefix));
+		return len;
+	}
+
+	for (i = 0; i < len && depth + i < nr; i++) {
+		if (!frame_eq(&prefix[i], &entries[depth + i]))
+			break;
+	}
+	cs_stat_add(CS_STAT_BYTES_CMPD, (i + 1) * sizeof(*prefix));
+	return i;
+}
+
+static struct frameart_edge *find_edge(struct frameart_node *node,
+				       const struct callstack_entry *frame)
+{
+	unsigned int mask, i;
+
+	if (node->cap <= FRAMEART_SPAN) {
+		for (i = 0; i < node->nr; i++) {
+			cs_stat_inc(CS_STAT_KEY_CMPS);
+			if (frame_eq(&node->edges[i].frame, frame))
+				return &node->edges[i];
+		}
+		return NULL;
+	}
+
+	mask = node->cap - 1;
+	for (i = frame_hash(frame) & mask; ; i = (i + 1) & mask) {
+		struct frameart_edge *edge = &node->edges[i];
+
+		if (!edge->child)
+			return NULL;
+		cs_stat_inc(CS_STAT_KEY_CMPS);
+		if (frame_eq(&edge->frame, frame))
+			return edge;
+	}
+}
+
+/* Put an edge in the first free slot of a hash table node */
+static void hash_place(struct frameart_node *node,
+		       const struct callstack_entry *frame,
+		       struct frameart_node *child)
+{
+	unsigned int mask = node->cap - 1, i;
+
+	for (i = frame_hash(frame) & mask; node->edges[i].child;
+	     i = (i + 1) & mask)
+		;
+	node->edges[i].frame = *frame;
+	node->edges[i].child = child;
+}
+
+/*
+ * Replace node at *slot with a copy that has room for more children: a
+ * leaf gets a short span, a short span a full one, and a full span
+ * becomes a hash table, which then doubles.
+ */
+static struct frameart_node *grow(struct frameart_node **slot,
+				  struct frameart_node *node)
+{
+	struct frameart_node *new;
+	unsigned int cap;
+
+	if (!node->cap)
+		cap = FRAMEART_SPAN_MIN;
+	else if (node->cap < FRAMEART_SPAN)
+		cap = FRAMEART_SPAN;
+	else if (node->cap == FRAMEART_SPAN)
+		cap = FRAMEART_HASH_MIN;
+	else
+		cap = node->cap * 2;
+
+	new = node_alloc(cap);
+	new->key = node->key;
+	new->start = node->start;
+	new->prefix_len = node->prefix_len;
+	new->count = node->count;
+	new->owns_key = node->owns_key;
+	new->nr = node->nr;
+
+	if (cap <= FRAMEART_SPAN) {
+		cs_stat_inc(CS_STAT_FRAMEART_GROW_SPAN);
+		memcpy(new->edges, node->edges, node->nr * sizeof(node->edges[0]));
+	} else {
+		cs_stat_inc(CS_STAT_FRAMEART_GROW_HASH);
+		for (unsigned int i = 0; i < node->cap; i++) {
+			struct frameart_edge *edge = &node->edges[i];
+
+			if (edge->child)
+				hash_place(new, &edge->frame, edge->child);
+		}
+	}
+
+	/* The key goes with the node, not the copy that's thrown away */
+	node->owns_key = false;
+	node_free(node);
+	*slot = new;
+	return new;
+}
+
+static void add_edge(struct frameart_node **slot, struct frameart_node *node,
+		     const struct callstack_entry *frame,
+		     struct frameart_node *child)
+{
+	if (node->nr == node->cap ||
+	    (node->cap > FRAMEART_SPAN && (node->nr + 1) * 4 > node->cap * 3))
+		node = grow(slot, node);
+
+	if (node->cap <= FRAMEART_SPAN) {
+		node->edges[node->nr].frame = *frame;
+		node->edges[node->nr].child = child;
+	} else {
+		hash_place(node, frame, child);
+	}
+	node->nr++;
+}
+
+/*
+ * The stack being inserted parts from node's prefix m frames in, at
+ * depth + m. A node for the m frames they share goes in its place, with
+ * node below it for the rest of its prefix and the new stack next to it,
+ * or ending at the new node if it has no frames left.
+ */
+static void split(struct frameart_node **slot, struct frameart_node *node,
+		  unsigned int m, const struct callstack_entry *entries,
+		  unsigned int nr, unsigned int depth)
+{
+	struct frameart_node *new = node_alloc(FRAMEART_SPAN_MIN);
+
+	cs_stat_inc(CS_STAT_SPLITS);
+
+	new->key = node->key;
+	new->start = node->start;
+	new->prefix_len = m;
+
+	new->edges[0].frame = node->key[node->start + m];
+	new->edges[0].child = node;
+	new->nr = 1;
+	node->start += m + 1;
+	node->prefix_len -= m + 1;
+
+	if (depth + m < nr) {
+		new->edges[1].frame = entries[depth + m];
+		new->edges[1].child = new_leaf(entries, nr, depth + m + 1);
+		new->nr = 2;
+	} else {
+		new->count = 1;
+	}
+
+	*slot = new;
+}
+
+bool frameart_insert(struct frameart *tree,
+		     const struct callstack_entry *entries, unsigned int nr)
+{
+	struct frameart_node **slot = &tree->root, *node;
+	struct frameart_edge *edge;
+	unsigned int depth = 0, m;
+
+	if (!nr)
+		return false;
+
+	if (!tree->root) {
+		tree->root = new_leaf(entries, nr, 0);
+		tree->unique++;
+		return true;
+	}
+
+	for (;;) {
+		node = *slot;
+		cs_stat_inc(CS_STAT_NODES_VISITED);
+
+		m = match_prefix(node, entries, nr, depth);
+		if (m < node->prefix_len) {
+			split(slot, node, m, entries, nr, depth);
+			tree->unique++;
+			return true;
+		}
+
+		depth += m;
+		if (depth == nr) {
+			if (node->count++) {
+				tree->hits++;
+				return false;
+			}
+			tree->unique++;
+			return true;
+		}
+
+		edge = find_edge(node, &entries[depth]);
+		if (!edge) {
+			add_edge(slot, node, &entries[depth],
+				 new_leaf(entries, nr, depth + 1));
+			tree->unique++;
+			return true;
+		}
+
+		slot = &edge->child;
+		depth++;
+	}
+}
+
+unsigned long frameart_lookup(struct frameart *tree,
+			      const struct callstack_entry *entries,
+			      unsigned int nr)
+{
+	struct frameart_node *node = tree->root;
+	struct frameart_edge *edge;
+	unsigned int depth = 0;
+
+	while (node && nr) {
+		if (match_prefix(node, entries, nr, depth) < node->prefix_len)
+			return 0;
+
+		depth += node->prefix_len;
+		if (depth == nr)
+			return node->count;
+
+		edge = find_edge(node, &entries[depth]);
+		if (!edge)
+			return 0;
+		node = edge->child;
+		depth++;
+	}
+
+	return 0;
+}
+
+/*
+ * Every key through node starts at the same depth, so the one that ends
+ * after its prefix is the first start + prefix_len frames of node->key
+ */
+static void for_each_node(struct frameart_node *node, frameart_fn fn,
+			  void *arg)
+{
+	if (node->count)
+		fn(node->key, node->start + node->prefix_len, node->count, arg);
+
+	for (unsigned int i = 0; i < node->cap; i++) {
+		if (node->edges[i].child)
+			for_each_node(node->edges[i].child, fn, arg);
+	}
+}
+
+void frameart_for_each(struct frameart *tree, frameart_fn fn, void *arg)
+{
+	if (tree->root)
+		for_each_node(tree->root, fn, arg);
+}
+
+static void free_node(struct frameart_node *node)
+{
+	for (unsigned int i = 0; i < node->cap; i++) {
+		if (node->edges[i].child)
+			free_node(node->edges[i].child);
+	}
+	node_free(node);
+}
+
+void frameart_free(struct frameart *tree)
+{
+	if (tree->root)
+		free_node(tree->root);
+	tree->root = NULL;
+}
@@ -0,0 +1,86 @@
+#ifndef __FRAMEART_H__
+#define __FRAMEART_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "callstack.h"
+
+/*
+ * An adaptive radix tree over whole frames.
+ *
+ * The byte-wise ART in lib/art spells a frame out as 16 one-byte keys, so
+ * a 30-frame stack is 480 levels of find_child(). Here the alphabet is
+ * the (ip, map) frame itself: a node branches on one frame, and a stack
+ * is at most as many levels deep as it has frames, fewer where nodes are
+ * path compressed.
+ *
+ * Every node compresses the frames that all keys below it share after
+ * the edge leading to it. Those frames aren't copied into the node: each
+ * new stack gets one copy of its frames, which stays put until the tree is
+ * freed, and a node's prefix points into the copy of any stack below it.
+ * That makes a prefix of any length cost the same, and lets a node's key
+ * be read back from the copy too.
+ *
+ * Children are kept by the frame of their edge. Up to FRAMEART_SPAN
+ * of them are in an array that is scanned linearly; past that the array
+ * becomes an open-addressing hash table, which doubles when it's 3/4 full.
+ * Nodes without children (leaves) have no array at all.
+ */
+
+#define FRAMEART_SPAN_MIN	4
+#define FRAMEART_SPAN		16
+#define FRAMEART_HASH_MIN	32
+
+struct frameart_node;
+
+struct frameart_edge {
+	struct callstack_entry	frame;
+	/* NULL if the slot of a hash table is free */
+	struct frameart_node	*child;
+};
+
+struct frameart_node {
+	/*
+	 * The frames of a stack through this node. The node's prefix is
+	 * prefix_len frames of it from start, so every key below the node
+	 * starts with the first start + prefix_len.
+	 */
+	const struct callstack_entry *key;
+	unsigned int		start;
+	unsigned int		prefix_len;
+	/* Inserts of the stack that ends after the prefix, 0 if none does */
+	unsigned long		count;
+	/* Children, and the room in edges for them */
+	unsigned int		nr;
+	unsigned int		cap;
+	/* key was copied for this node and is freed with it */
+	bool			owns_key;
+	struct frameart_edge	edges[];
+};
+
+struct frameart {
+	struct frameart_node	*root;
+	/* Distinct stacks, and inserts of a stack that was already there */
+	unsigned long		unique;
+	unsigned long		hits;
+};
+
+/* Count an insert of the nr frames of entries. True if they're new */
+bool frameart_insert(struct frameart *tree,
+		     const struct callstack_entry *entries, unsigned int nr);
+
+/* How many times the nr frames of entries were inserted */
+unsigned long frameart_lookup(struct frameart *tree,
+			      const struct callstack_entry *entries,
+			      unsigned int nr);
+
+/* Called with a stack's frames and the number of times it was inserted */
+typedef void (*frameart_fn)(const struct callstack_entry *entries,
+			    unsigned int nr, unsigned long count, void *arg);
+
+/* Call fn on every stack in tree, in no particular order */
+void frameart_for_each(struct frameart *tree, frameart_fn fn, void *arg);
+
+void frameart_free(struct frameart *tree);
+
+#endif /* __FRAMEART_H__ */
@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "frameart.c"
+
+typedef void (*funcptr)(void);
+
+#define MAX_FRAMES 128
+
+/* A stack of nr frames: frame i of stack id is (base + i, map) */
+static unsigned int make_stack(struct callstack_entry *entries,
+			       unsigned int nr, unsigned long base,
+			       unsigned long map)
+{
+	for (unsigned int i = 0; i < nr; i++) {
+		entries[i].ip = base + i;
+		entries[i].map = map;
+	}
+	return nr;
+}
+
+// Inserting the same stack counts it, and it's only new the first time
+static void test1(void)
+{
+	struct frameart t = {};
+	struct callstack_entry s[8];
+	unsigned int nr = make_stack(s, 8, 0x1000, 1);
+
+	assert(frameart_insert(&t, s, nr));
+	assert(!frameart_insert(&t, s, nr));
+	assert(!frameart_insert(&t, s, nr));
+	assert(frameart_lookup(&t, s, nr) == 3);
+	assert(frameart_lookup(&t, s, nr - 1) == 0);
+	assert(t.unique == 1 && t.hits == 2);
+
+	/* One stack is one node, however deep */
+	assert(t.root->nr == 0 && t.root->prefix_len == nr);
+
+	frameart_free(&t);
+}
+
+// Stacks that are prefixes of each other, or part in the middle
+static void test2(void)
+{
+	struct frameart t = {};
+	struct callstack_entry a[8], b[8];
+
+	make_stack(a, 8, 0x1000, 1);
+	make_stack(b, 8, 0x1000, 1);
+	b[5].ip = 0x9999;
+
+	assert(frameart_insert(&t, a, 8));
+	assert(frameart_insert(&t, a, 3));
+	assert(frameart_insert(&t, b, 8));
+	assert(frameart_insert(&t, a, 5));
+	assert(!frameart_insert(&t, a, 3));
+
+	assert(frameart_lookup(&t, a, 8) == 1);
+	assert(frameart_lookup(&t, b, 8) == 1);
+	assert(frameart_lookup(&t, a, 5) == 1);
+	assert(frameart_lookup(&t, a, 3) == 2);
+	assert(frameart_lookup(&t, a, 4) == 0);
+	assert(frameart_lookup(&t, b, 6) == 0);
+	assert(t.unique == 4);
+
+	/* a[0..3) is the root, the first frame after it an edge */
+	assert(t.root->prefix_len == 3 && t.root->nr == 1);
+
+	frameart_free(&t);
+}
+
+// A long shared prefix is one node, and isn't copied
+static void test3(void)
+{
+	struct frameart t = {};
+	struct callstack_entry a[MAX_FRAMES], b[MAX_FRAMES];
+
+	make_stack(a, 120, 0x1000, 1);
+	make_stack(b, 120, 0x1000, 1);
+	b[110].map = 2;
+
+	frameart_insert(&t, a, 120);
+	frameart_insert(&t, b, 120);
+	assert(t.root->prefix_len == 110 && t.root->nr == 2);
+	assert(!t.root->owns_key);
+	assert(frameart_lookup(&t, a, 120) == 1);
+	assert(frameart_lookup(&t, b, 120) == 1);
+
+	frameart_free(&t);
+}
+
+// Children move from a span to a hash table that keeps growing
+static void test4(void)
+{
+	struct frameart t = {};
+	struct callstack_entry s[4];
+	unsigned int nr_children = 1000;
+
+	for (unsigned int round = 0; round < 2; round++) {
+		for (unsigned int i = 0; i < nr_children; i++) {
+			make_stack(s, 4, 0x1000, 1);
+			s[2].ip = 0x100000 + i * 0x10;
+			assert(frameart_insert(&t, s, 4) == !round);
+		}
+	}
+
+	assert(t.root->prefix_len == 2);
+	assert(t.root->nr == nr_children);
+	assert(t.root->cap > FRAMEART_SPAN);
+	assert(t.root->nr * 4 <= t.root->cap * 3);
+	for (unsigned int i = 0; i < nr_children; i++) {
+		make_stack(s, 4, 0x1000, 1);
+		s[2].ip = 0x100000 + i * 0x10;
+		assert(frameart_lookup(&t, s, 4) == 2);
+	}
+
+	frameart_free(&t);
+}
+
+struct seen {
+	unsigned long stacks;
+	unsigned long count;
+};
+
+static void see_stack(const struct callstack_entry *entries, unsigned int nr,
+		      unsigned long count, void *arg)
+{
+	struct seen *seen = arg;
+
+	seen->stacks++;
+	seen->count += count;
+}
+
+// frameart_for_each() hands back every stack with its count
+static void test5(void)
+{
+	struct frameart t = {};
+	struct seen seen = {};
+	struct callstack_entry e[MAX_FRAMES];
+	unsigned long inserts = 0;
+
+	/* Stacks of every depth below a few roots, many of them twice */
+	for (unsigned int i = 0; i < 500; i++) {
+		unsigned int nr = 1 + (i * 7) % 40;
+
+		make_stack(e, nr, 0x1000 * (i % 3), 1);
+		e[nr - 1].ip += i % 50;
+		frameart_insert(&t, e, nr);
+		inserts++;
+		if (i % 2) {
+			frameart_insert(&t, e, nr);
+			inserts++;
+		}
+	}
+
+	frameart_for_each(&t, see_stack, &seen);
+	assert(seen.stacks == t.unique);
+	assert(seen.count == inserts);
+	assert(t.unique + t.hits == inserts);
+
+	frameart_free(&t);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int num_tests = 0;
+	funcptr tests[] = {
+		test1,
+		test2,
+		test3,
+		test4,
+		test5,
+		NULL,
+	};
+
+	for (funcptr *f = tests; *f != NULL; f++, num_tests++) {
+		(*f)();
+	}
+
+	printf("Ran %u tests\n", num_tests);
+	return 0;
+}
+
+// vim: ts=8 sw=8 noexpandtab
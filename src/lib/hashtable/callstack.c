@@ -1,39 +1,43 @@
+#include "callchain.h"
 #include "callstack.h"
 #include "data/data.h"
 #include "hashtable.c"
 
 struct hash_priv {
     struct hashtable *table;
+
+    /* Most frames in a key */
+    unsigned long max_depth;
+
+    /* Built from the keys by hash_callchain(), NULL until then */
+    struct callchain_root *callchain;
 };
 
-static void insert(struct callstack_tree *tree, struct callstack_entry *stack)
+static void insert(struct callstack_tree *tree, const struct stack *stack)
 {
     struct hash_priv *priv = tree->priv;
+    const struct callstack_entry *entries;
+    unsigned int nr;
     struct stream s;
 
-    // Build a callchain cursor
-    for (int i = 0; i < MAX_STACK_ENTRIES; i++) {
-        struct callstack_entry *entry = &stack[i];
-        if (!entry->ip) {
-            s.end = (hash_key_t *)entry;
-            break;
-        }
-
-    }
-
-    s.begin = (hash_key_t *)stack;
+    // The key is the raw bytes of the frames
+    entries = stack_entries(stack, &nr);
+    if (nr > priv->max_depth)
+        priv->max_depth = nr;
+    s.begin = (hash_key_t *)entries;
+    s.end = (hash_key_t *)(entries + nr);
 
     hash_insert(priv->table, &s);
 }
 
 static struct callstack_tree *hash_new()
 {
-    struct callstack_tree *t = ccalloc(1, sizeof(struct callstack_tree));
+    struct callstack_tree *t = ccalloc(1, sizeof(struct callstack_tree), MEM_TREE);
     if (!t) {
         die();
     }
 
-    t->priv = ccalloc(1, sizeof(struct hash_priv));
+    t->priv = ccalloc(1, sizeof(struct hash_priv), MEM_TREE);
     if (!t->priv) {
         die();
     }
@@ -50,21 +54,55 @@ static struct callstack_tree *hash_new()
 
 static void hash_put(struct callstack_tree *tree)
 {
-    // TODO remove from tree_list.
-    cfree(tree, false);
+    struct hash_priv *priv = tree->priv;
+
+    free_table(priv->table);
+    if (priv->callchain) {
+        free_callchain(priv->callchain);
+        cfree(priv->callchain, MEM_TREE);
+    }
+    cfree(priv, MEM_TREE);
+    cfree(tree, MEM_TREE);
 }
 
-unsigned long num_unique_entries = 0;
+__thread unsigned long num_unique_entries = 0;
 static void hash_stats(struct callstack_tree *cs_tree, struct stats *stats)
 {
     struct hash_priv *priv = cs_tree->priv;
-    printf("Unique entries in hashtable: %lu\n", priv->table->unique);
-    printf("Table hits: %lu\n", priv->table->hits);
+
+    stats->num_unique += priv->table->unique;
+    stats->num_hits += priv->table->hits;
+    if (priv->max_depth > stats->max_depth)
+        stats->max_depth = priv->max_depth;
     // printf("Max unique entries: %lu\n", num_unique_entries);
 }
 
+/* A key is the frames of a stack, as they were inserted */
+static void append_key(const hash_key_t *key, size_t len, unsigned long count,
+                       void *arg)
+{
+    append_callchain(arg, (const struct callstack_entry *)key,
+                     len / sizeof(struct callstack_entry), count);
+}
+
+static struct callchain_root *hash_callchain(struct callstack_tree *tree)
+{
+    struct hash_priv *priv = tree->priv;
+
+    if (!priv->callchain) {
+        priv->callchain = ccalloc(1, sizeof(*priv->callchain), MEM_TREE);
+        if (!priv->callchain)
+            die();
+        callchain_init(priv->callchain);
+        hash_for_each(priv->table, append_key, priv->callchain);
+    }
+
+    return priv->callchain;
+}
+
 struct callstack_ops hash_ops = {
     .put = hash_put,
     .stats = hash_stats,
     .new = hash_new,
+    .callchain = hash_callchain,
 };
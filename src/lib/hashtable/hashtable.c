@@ -4,6 +4,7 @@
 #include <string.h>
 #include "hashtable.h"
 #include "callstack.h"
+#include "cs_stats.h"
 
 #include "jenkins.c"
 
@@ -30,12 +31,12 @@ static inline unsigned long basic_hash(struct stream *stream)
 static inline unsigned long jenkins_hash(struct stream *stream)
 {
 	unsigned long length = stream->end - stream->begin;
-	return jhash((ub1 *)stream->begin, length, 0) & ((1<<16)-1);
+	return jhash((ub1 *)stream->begin, length, 0) & (MAP_SIZE - 1);
 }
 
-static void *alloc(size_t size)
+static void *alloc(size_t size, enum mem_type type)
 {
-	void *ptr = ccalloc(1, size);
+	void *ptr = ccalloc(1, size, type);
 	if (!ptr) {
 		fprintf(stderr, "Failed allocation");
 		exit(EXIT_FAILURE);
@@ -43,14 +44,29 @@ static void *alloc(size_t size)
 	return ptr;
 }
 
+/*
+ * Buckets must own their keys because callers are free to reuse the
+ * stream and the bytes it points to once hash_insert() returns.
+ */
+static struct stream *dup_stream(struct stream *stream)
+{
+	size_t len = stream->end - stream->begin;
+	struct stream *s = alloc(sizeof(*s) + len, MEM_HASH_KEY);
+
+	s->begin = (hash_key_t *)(s + 1);
+	s->end = s->begin + len;
+	memcpy(s->begin, stream->begin, len);
+	return s;
+}
+
 struct hashtable *alloc_table(void)
 {
-	struct hashtable *h = alloc(sizeof(*h));
-	h->map = alloc(sizeof(struct bucket *) * 1<<16);
+	struct hashtable *h = alloc(sizeof(*h), MEM_HASH_TABLE);
+	h->map = alloc(sizeof(struct bucket *) * MAP_SIZE, MEM_HASH_MAP);
 	return h;
 }
 
-extern unsigned long num_unique_entries;
+extern __thread unsigned long num_unique_entries;
 
 static inline void update_unique(unsigned long entries)
 {
@@ -58,24 +74,60 @@ static inline void update_unique(unsigned long entries)
 		num_unique_entries = entries;
 }
 
-void __hash_insert(struct hashtable *table, struct stream *stream)
+static inline bool stream_equal(struct stream *a, struct stream *b)
+{
+	size_t len = a->end - a->begin;
+
+	cs_stat_inc(CS_STAT_KEY_CMPS);
+	if (len != (size_t)(b->end - b->begin))
+		return false;
+
+	cs_stat_add(CS_STAT_BYTES_CMPD, len);
+	return !memcmp(a->begin, b->begin, len);
+}
+
+/*
+ * Return the slot holding stream, or the empty slot it should be
+ * inserted into. Collisions are resolved with linear probing.
+ */
+static struct bucket **find_slot(struct hashtable *table, struct stream *stream)
 {
 	unsigned long h = jenkins_hash(stream);
-	struct bucket *b = table->map[h];
+
+	for (unsigned long i = 0; i < MAP_SIZE; i++) {
+		struct bucket **slot = &table->map[(h + i) & (MAP_SIZE - 1)];
+
+		cs_stat_inc(CS_STAT_NODES_VISITED);
+		if (!*slot || stream_equal((*slot)->key, stream)) {
+			cs_stat_add(CS_STAT_HASH_PROBES, i + 1);
+			cs_stat_max(CS_STAT_HASH_MAX_PROBE, i + 1);
+			return slot;
+		}
+	}
+
+	fprintf(stderr, "Hashtable full\n");
+	exit(EXIT_FAILURE);
+}
+
+static struct bucket *__hash_insert(struct hashtable *table,
+				    struct stream *stream)
+{
+	struct bucket **slot = find_slot(table, stream);
+	struct bucket *b = *slot;
+
+	cs_stat_inc(CS_STAT_HASH_INSERTS);
 
 	if (!b) {
-		b = alloc(sizeof(*b));
-		b->key = stream;
-		table->map[h] = b;
+		b = alloc(sizeof(*b), MEM_HASH_BUCKET);
+		b->key = dup_stream(stream);
+		*slot = b;
 		table->unique++;
-		// assert (!(num_unique_entries > (1<<16)));
 		update_unique(table->unique);
 	} else {
 		table->hits++;
-		size_t len = stream->end - stream->begin;
-		assert(!memcmp(b->key->begin, stream->begin, len));
 	}
 	b->count++;
+	return b;
 }
 
 void hash_insert(struct hashtable *table, struct stream *stream)
@@ -92,16 +144,19 @@ void hash_insert(struct hashtable *table, struct stream *stream)
 
 			if (!b->key) {
 				// No match so far and we found an empty slot. Insert
-				b->key = stream;
+				b->key = dup_stream(stream);
 				table->num_internal++;
 				table->unique++;
 				update_unique(table->unique);
 				return;
 			}
 
+			cs_stat_inc(CS_STAT_NODES_VISITED);
+			cs_stat_inc(CS_STAT_KEY_CMPS);
 			if (len != b_len)
 				continue;
 
+			cs_stat_add(CS_STAT_BYTES_CMPD, len);
 			if (!memcmp(b->key->begin, stream->begin, len)) {
 				// Match
 				b->count++;
@@ -112,7 +167,7 @@ void hash_insert(struct hashtable *table, struct stream *stream)
 
 		if (table->num_internal < NUM_INTERNAL) {
 			struct bucket *b = &table->_bucket[i];
-			b->key = stream;
+			b->key = dup_stream(stream);
 			table->num_internal++;
 			b->count++;
 			table->unique++;
@@ -127,7 +182,12 @@ void hash_insert(struct hashtable *table, struct stream *stream)
 
 		for (int i = 0; i < NUM_INTERNAL; i++) {
 			struct bucket *b = &table->_bucket[i];
-			__hash_insert(table, b->key);
+			struct bucket *new = __hash_insert(table, b->key);
+
+			/* Moving a bucket is neither a new entry nor a hit */
+			new->count += b->count - 1;
+			table->unique--;
+			cfree(b->key, MEM_HASH_KEY);
 		}
 
 		/* FALLTHROUGH */
@@ -136,6 +196,47 @@ void hash_insert(struct hashtable *table, struct stream *stream)
 	__hash_insert(table, stream);
 }
 
+void free_table(struct hashtable *table)
+{
+	if (table->num_internal <= NUM_INTERNAL) {
+		for (int i = 0; i < table->num_internal; i++)
+			cfree(table->_bucket[i].key, MEM_HASH_KEY);
+	} else {
+		for (int i = 0; i < MAP_SIZE; i++) {
+			struct bucket *b = table->map[i];
+
+			if (!b)
+				continue;
+			cfree(b->key, MEM_HASH_KEY);
+			cfree(b, MEM_HASH_BUCKET);
+		}
+	}
+
+	cfree(table->map, MEM_HASH_MAP);
+	cfree(table, MEM_HASH_TABLE);
+}
+
+void hash_for_each(struct hashtable *table, hash_for_each_fn fn, void *arg)
+{
+	if (table->num_internal <= NUM_INTERNAL) {
+		for (int i = 0; i < table->num_internal; i++) {
+			struct bucket *b = &table->_bucket[i];
+
+			fn(b->key->begin, b->key->end - b->key->begin, b->count,
+			   arg);
+		}
+		return;
+	}
+
+	for (int i = 0; i < MAP_SIZE; i++) {
+		struct bucket *b = table->map[i];
+
+		if (b)
+			fn(b->key->begin, b->key->end - b->key->begin, b->count,
+			   arg);
+	}
+}
+
 /*
  * Search for the given key in the hash table and return the associated
  * value. In our case, that's a count.
@@ -147,8 +248,8 @@ int hash_lookup(struct hashtable *table, struct stream *stream)
 
 	if (table->num_internal > NUM_INTERNAL) {
 		// Slow path
-		b = table->map[jenkins_hash(stream)];
-		return b->count;
+		b = *find_slot(table, stream);
+		return b ? b->count : -1;
 	}
 
 	for (int i = 0; i < table->num_internal; i++) {
@@ -1,6 +1,8 @@
 #ifndef __HASHTABLE_H__
 #define __HASHTABLE_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t hash_key_t;
@@ -17,6 +19,9 @@ struct bucket {
 
 #define NUM_INTERNAL 3
 
+/* Number of slots in the indirect bucket map */
+#define MAP_SIZE (1 << 16)
+
 struct hashtable {
 	struct bucket _bucket[NUM_INTERNAL];
 	struct bucket **map;
@@ -25,4 +30,11 @@ struct hashtable {
 	unsigned long hits;
 };
 
+/* Called with a key, its length and the number of times it was inserted */
+typedef void (*hash_for_each_fn)(const hash_key_t *key, size_t len,
+				 unsigned long count, void *arg);
+
+/* Call fn on every key in table, in no particular order */
+void hash_for_each(struct hashtable *table, hash_for_each_fn fn, void *arg);
+
 #endif /* __HASHTABLE_H__ */
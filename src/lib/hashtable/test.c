@@ -5,7 +5,7 @@
 
 typedef void (*funcptr)(void);
 
-unsigned long num_unique_entries = 0;
+__thread unsigned long num_unique_entries = 0;
 
 #define STREAM_ENTRY(k) k, k + strlen(k)
 
@@ -66,6 +66,65 @@ static void test3(void)
 	assert(hash_lookup(h, &s[3]) == 1);
 }
 
+struct seen {
+	const char *keys[8];
+	unsigned long counts[8];
+	unsigned int nr;
+};
+
+static void see_key(const hash_key_t *key, size_t len, unsigned long count,
+		    void *arg)
+{
+	struct seen *seen = arg;
+
+	for (unsigned int i = 0; i < seen->nr; i++) {
+		if (strlen(seen->keys[i]) == len &&
+		    !memcmp(seen->keys[i], key, len)) {
+			assert(!seen->counts[i]);
+			seen->counts[i] = count;
+			return;
+		}
+	}
+	assert(0);
+}
+
+// hash_for_each() reports every key with its count, before and after
+// the internal buckets spill over
+static void test4(void)
+{
+	struct hashtable *h = alloc_table();
+	struct seen seen = {
+		.keys = { "fubar", "foobar", "fibar", "fabar", "febar" },
+	};
+	struct stream s[5];
+
+	for (int i = 0; i < 5; i++) {
+		s[i].begin = (hash_key_t *)seen.keys[i];
+		s[i].end = s[i].begin + strlen(seen.keys[i]);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j <= i; j++)
+			hash_insert(h, &s[i]);
+	}
+	seen.nr = 3;
+	hash_for_each(h, see_key, &seen);
+	for (int i = 0; i < 3; i++)
+		assert(seen.counts[i] == i + 1);
+
+	for (int i = 3; i < 5; i++) {
+		for (int j = 0; j <= i; j++)
+			hash_insert(h, &s[i]);
+	}
+	memset(seen.counts, 0, sizeof(seen.counts));
+	seen.nr = 5;
+	hash_for_each(h, see_key, &seen);
+	for (int i = 0; i < 5; i++)
+		assert(seen.counts[i] == i + 1);
+
+	free_table(h);
+}
+
 int main(int argc, char **argv)
 {
 	unsigned int num_tests = 0;
@@ -74,6 +133,7 @@ int main(int argc, char **argv)
 		test1,
 		test2,
 		test3,
+		test4,
 		NULL,
 	};
 
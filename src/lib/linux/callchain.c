@@ -65,6 +65,8 @@
 // #include "util.h"
 // #include "../perf.h"
 #include "callstack.h"
+#include "cs_stats.h"
+#include "work_steal.h"
 
 #define CALLCHAIN_PARAM_DEFAULT			\
 	.mode		= CHAIN_GRAPH_ABS,	\
@@ -350,64 +352,201 @@ static pthread_key_t callchain_cursor;
 // 	return 0;
 // }
 
-static void
-rb_insert_callchain(struct rb_root *root, struct callchain_node *chain,
-		    enum chain_mode mode)
+/*
+ * Sorting for output.
+ *
+ * Every node's children that make the threshold are put in an array, in
+ * descending order of cumulated hits (or of their own hits for flat
+ * output), allocated from the tree's sort_pool. A child's cumulated hits
+ * bound those of everything below it, so the subtree of a child that's
+ * left out is never looked at.
+ */
+
+/* A node to sort, with the hits it's sorted by so they're read once */
+struct sort_entry {
+	u64			hits;
+	struct callchain_node	*node;
+};
+
+#define SORT_SCRATCH_INLINE	64
+
+/*
+ * Nodes collected before they're sorted, and the scratch space of the
+ * merge sort. One per sort, on the stack until it needs more room. It's
+ * used as a stack: each level of the walk collects its nodes above the
+ * nr of the level above.
+ */
+struct sort_scratch {
+	struct sort_entry	*entries;
+	unsigned int		nr;
+	unsigned int		alloc;
+	struct sort_entry	inline_entries[SORT_SCRATCH_INLINE];
+};
+
+static void sort_scratch__init(struct sort_scratch *s)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct callchain_node *rnode;
-	u64 chain_cumul = callchain_cumul_hits(chain);
+	s->entries = s->inline_entries;
+	s->nr = 0;
+	s->alloc = SORT_SCRATCH_INLINE;
+}
 
-	while (*p) {
-		u64 rnode_cumul;
+static void sort_scratch__exit(struct sort_scratch *s)
+{
+	if (s->entries != s->inline_entries)
+		cfree(s->entries, MEM_CALLCHAIN_SORTED);
+}
 
-		parent = *p;
-		rnode = rb_entry(parent, struct callchain_node, rb_node);
-		rnode_cumul = callchain_cumul_hits(rnode);
+static bool sort_scratch__reserve(struct sort_scratch *s, unsigned int nr)
+{
+	struct sort_entry *entries;
+	unsigned int alloc;
 
-		switch (mode) {
-		case CHAIN_FLAT:
-		case CHAIN_FOLDED:
-			if (rnode->hit < chain->hit)
-				p = &(*p)->rb_left;
-			else
-				p = &(*p)->rb_right;
-			break;
-		case CHAIN_GRAPH_ABS: /* Falldown */
-		case CHAIN_GRAPH_REL:
-			if (rnode_cumul < chain_cumul)
-				p = &(*p)->rb_left;
-			else
-				p = &(*p)->rb_right;
-			break;
-		case CHAIN_NONE:
-		default:
-			break;
+	if (nr <= s->alloc)
+		return true;
+
+	alloc = s->alloc;
+	while (alloc < nr)
+		alloc *= 2;
+
+	entries = ccalloc(alloc, sizeof(*entries), MEM_CALLCHAIN_SORTED);
+	if (!entries) {
+		perror("not enough memory to sort the code path tree");
+		return false;
+	}
+	memcpy(entries, s->entries, s->nr * sizeof(*entries));
+	sort_scratch__exit(s);
+	s->entries = entries;
+	s->alloc = alloc;
+	return true;
+}
+
+static inline bool sort_scratch__push(struct sort_scratch *s,
+				      struct callchain_node *node, u64 hits)
+{
+	if (s->nr == s->alloc && !sort_scratch__reserve(s, s->nr + 1))
+		return false;
+	s->entries[s->nr].hits = hits;
+	s->entries[s->nr].node = node;
+	s->nr++;
+	return true;
+}
+
+#define SORT_RUN	16
+
+/*
+ * Sort entries by descending hits, keeping those with equal hits in the
+ * order they're in, which is the order an in-order walk of the rbtree
+ * they used to be inserted into one by one gave. tmp has room for nr.
+ * Returns where the result ended up, entries or tmp.
+ */
+static struct sort_entry *sort_entries(struct sort_entry *entries,
+				       unsigned int nr, struct sort_entry *tmp)
+{
+	struct sort_entry *from = entries, *to = tmp, *swap;
+
+	/* Most nodes have a handful of children: insertion sort runs */
+	for (unsigned int lo = 0; lo < nr; lo += SORT_RUN) {
+		unsigned int hi = min(lo + SORT_RUN, nr);
+
+		for (unsigned int i = lo + 1; i < hi; i++) {
+			struct sort_entry e = entries[i];
+			unsigned int j = i;
+
+			for (; j > lo && entries[j - 1].hits < e.hits; j--)
+				entries[j] = entries[j - 1];
+			entries[j] = e;
 		}
 	}
 
-	rb_link_node(&chain->rb_node, parent, p);
-	rb_insert_color(&chain->rb_node, root);
+	/* and merge them bottom up, back and forth between entries and tmp */
+	for (unsigned int width = SORT_RUN; width < nr; width *= 2) {
+		for (unsigned int lo = 0; lo < nr; lo += 2 * width) {
+			unsigned int mid = min(lo + width, nr);
+			unsigned int hi = min(lo + 2 * width, nr);
+			unsigned int l = lo, r = mid, o = lo;
+
+			while (l < mid && r < hi) {
+				if (from[l].hits >= from[r].hits)
+					to[o++] = from[l++];
+				else
+					to[o++] = from[r++];
+			}
+			while (l < mid)
+				to[o++] = from[l++];
+			while (r < hi)
+				to[o++] = from[r++];
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	return from;
 }
 
-static void
-__sort_chain_flat(struct rb_root *rb_root, struct callchain_node *node,
+/*
+ * Sort the nodes collected in s since base into out and pop them. They
+ * go in an array from pool unless they fit in out itself and it may
+ * point to itself, which the sorted children of a node can.
+ */
+static void sort_collected(struct mem_pool *pool, struct sort_scratch *s,
+			   unsigned int base, struct callchain_sorted *out,
+			   bool can_inline)
+{
+	struct sort_entry *sorted;
+	struct callchain_node **nodes;
+	unsigned int nr = s->nr - base;
+
+	out->nodes = NULL;
+	out->nr = 0;
+	if (!nr)
+		return;
+
+	if (can_inline && nr <= CALLCHAIN_SORTED_INLINE)
+		nodes = out->inline_nodes;
+	else
+		nodes = mem_pool__alloc(pool, nr * sizeof(*nodes),
+					MEM_CALLCHAIN_SORTED);
+	if (!nodes || !sort_scratch__reserve(s, s->nr + nr)) {
+		perror("not enough memory to sort the code path tree");
+		s->nr = base;
+		return;
+	}
+
+	sorted = sort_entries(&s->entries[base], nr, &s->entries[s->nr]);
+	for (unsigned int i = 0; i < nr; i++)
+		nodes[i] = sorted[i].node;
+	s->nr = base;
+
+	out->nodes = nodes;
+	out->nr = nr;
+}
+
+/* Start a sort of root: the arrays of the last one go, their memory stays */
+static void sort_begin(struct callchain_root *root)
+{
+	mem_pool__reset(&root->sort_pool, MEM_CALLCHAIN_SORTED);
+	root->node.sorted = (struct callchain_sorted){};
+}
+
+static bool
+__sort_chain_flat(struct sort_scratch *s, struct callchain_node *node,
 		  u64 min_hit)
 {
-	struct rb_node *n;
 	struct callchain_node *child;
+	unsigned int i;
 
-	n = rb_first(&node->rb_root_in);
-	while (n) {
-		child = rb_entry(n, struct callchain_node, rb_node_in);
-		n = rb_next(n);
-
-		__sort_chain_flat(rb_root, child, min_hit);
+	callchain_node__for_each_child(node, child, i) {
+		/* Nothing below has more hits than the whole of it */
+		if (callchain_cumul_hits(child) < min_hit)
+			continue;
+		if (!__sort_chain_flat(s, child, min_hit))
+			return false;
 	}
 
 	if (node->hit && node->hit >= min_hit)
-		rb_insert_callchain(rb_root, node, CHAIN_FLAT);
+		return sort_scratch__push(s, node, node->hit);
+	return true;
 }
 
 /*
@@ -415,69 +554,139 @@ __sort_chain_flat(struct rb_root *rb_root, struct callchain_node *node,
  * sort them by hit
  */
 static void
-sort_chain_flat(struct rb_root *rb_root, struct callchain_root *root,
+sort_chain_flat(struct callchain_sorted *out, struct callchain_root *root,
 		u64 min_hit, struct callchain_param *param __maybe_unused)
 {
-	*rb_root = RB_ROOT;
-	__sort_chain_flat(rb_root, &root->node, min_hit);
+	struct sort_scratch s;
+
+	sort_begin(root);
+	sort_scratch__init(&s);
+
+	/* Nodes without hits aren't shown at all */
+	if (__sort_chain_flat(&s, &root->node, max_t(u64, min_hit, 1)))
+		sort_collected(&root->sort_pool, &s, 0, out, false);
+	else
+		*out = (struct callchain_sorted){};
+
+	sort_scratch__exit(&s);
 }
 
-static void __sort_chain_graph_abs(struct callchain_node *node,
-				   u64 min_hit)
+/*
+ * Sort the children of node that have at least min_hit cumulated hits,
+ * min_percent of node's children_hit if it's relative, and then theirs.
+ *
+ * Each child is sorted right as it's found to make the cut, like the
+ * rbtree insertion did, so that its counts and its children are read
+ * while it's still in cache.
+ */
+static void __sort_chain_graph(struct mem_pool *pool, struct sort_scratch *s,
+			       struct callchain_node *node, u64 min_hit,
+			       double min_percent, bool rel)
 {
-	struct rb_node *n;
 	struct callchain_node *child;
+	unsigned int i, base = s->nr;
+	bool in_order = true;
+	u64 last = ULLONG_MAX;
+
+	if (rel)
+		min_hit = ceil(node->children_hit * min_percent);
 
-	node->rb_root = RB_ROOT;
-	n = rb_first(&node->rb_root_in);
+	callchain_node__for_each_child(node, child, i) {
+		u64 hits = callchain_cumul_hits(child);
 
-	while (n) {
-		child = rb_entry(n, struct callchain_node, rb_node_in);
-		n = rb_next(n);
+		if (hits < min_hit) {
+			/* Left out, and everything below it with it */
+			child->sorted = (struct callchain_sorted){};
+			in_order = false;
+			continue;
+		}
 
-		__sort_chain_graph_abs(child, min_hit);
-		if (callchain_cumul_hits(child) >= min_hit)
-			rb_insert_callchain(&node->rb_root, child,
-					    CHAIN_GRAPH_ABS);
+		__sort_chain_graph(pool, s, child, min_hit, min_percent, rel);
+		if (!sort_scratch__push(s, child, hits)) {
+			in_order = false;
+			continue;
+		}
+		in_order &= hits <= last;
+		last = hits;
+	}
+
+	/*
+	 * Most nodes have a single child, or children that already are in
+	 * output order: those are shown straight out of the children array
+	 * rather than a copy of it. Most others have two.
+	 */
+	if (in_order) {
+		node->sorted.nodes = callchain_children__nodes(&node->children);
+		node->sorted.nr = s->nr - base;
+		s->nr = base;
+	} else {
+		sort_collected(pool, s, base, &node->sorted, true);
 	}
 }
 
+static void sort_chain_graph(struct callchain_sorted *out,
+			     struct callchain_root *root, u64 min_hit,
+			     double min_percent, bool rel)
+{
+	struct sort_scratch s;
+
+	sort_begin(root);
+	sort_scratch__init(&s);
+	__sort_chain_graph(&root->sort_pool, &s, &root->node, min_hit,
+			   min_percent, rel);
+	*out = root->node.sorted;
+
+	sort_scratch__exit(&s);
+}
+
 static void
-sort_chain_graph_abs(struct rb_root *rb_root, struct callchain_root *chain_root,
-		     u64 min_hit, struct callchain_param *param __maybe_unused)
+sort_chain_graph_abs(struct callchain_sorted *out,
+		     struct callchain_root *chain_root, u64 min_hit,
+		     struct callchain_param *param __maybe_unused)
 {
-	__sort_chain_graph_abs(&chain_root->node, min_hit);
-	rb_root->rb_node = chain_root->node.rb_root.rb_node;
+	sort_chain_graph(out, chain_root, min_hit, 0, false);
 }
 
-static void __sort_chain_graph_rel(struct callchain_node *node,
-				   double min_percent)
+static void
+sort_chain_graph_rel(struct callchain_sorted *out,
+		     struct callchain_root *chain_root,
+		     u64 min_hit __maybe_unused, struct callchain_param *param)
 {
-	struct rb_node *n;
-	struct callchain_node *child;
-	u64 min_hit;
+	sort_chain_graph(out, chain_root, 0, param->min_percent / 100.0, true);
+}
 
-	node->rb_root = RB_ROOT;
-	min_hit = ceil(node->children_hit * min_percent);
+struct sort_trees {
+	struct callchain_root **roots;
+	struct callchain_sorted *out;
+	u64 min_hit;
+	struct callchain_param *param;
+};
 
-	n = rb_first(&node->rb_root_in);
-	while (n) {
-		child = rb_entry(n, struct callchain_node, rb_node_in);
-		n = rb_next(n);
+static void sort_trees__one(void *arg, unsigned long idx)
+{
+	struct sort_trees *st = arg;
 
-		__sort_chain_graph_rel(child, min_percent);
-		if (callchain_cumul_hits(child) >= min_hit)
-			rb_insert_callchain(&node->rb_root, child,
-					    CHAIN_GRAPH_REL);
-	}
+	st->param->sort(&st->out[idx], st->roots[idx], st->min_hit, st->param);
 }
 
-static void
-sort_chain_graph_rel(struct rb_root *rb_root, struct callchain_root *chain_root,
-		     u64 min_hit __maybe_unused, struct callchain_param *param)
+/*
+ * Each tree is sorted as a whole by one thread: trees share nothing, and
+ * there are usually far more of them than threads. Their sizes vary a
+ * lot, which is what the stealing is for.
+ */
+void callchain_sort_trees(struct callchain_root **roots,
+			  struct callchain_sorted *out, unsigned long nr,
+			  u64 min_hit, struct callchain_param *param,
+			  unsigned int nr_threads)
 {
-	__sort_chain_graph_rel(&chain_root->node, param->min_percent / 100.0);
-	rb_root->rb_node = chain_root->node.rb_root.rb_node;
+	struct sort_trees st = {
+		.roots = roots,
+		.out = out,
+		.min_hit = min_hit,
+		.param = param,
+	};
+
+	work_steal_run(nr, nr_threads, sort_trees__one, &st);
 }
 
 int callchain_register_param(struct callchain_param *param)
@@ -502,69 +711,117 @@ int callchain_register_param(struct callchain_param *param)
 
 /*
  * Create a child for a parent. If inherit_children, then the new child
- * will become the new parent of it's parent children
+ * will become the new parent of it's parent children. Either way the
+ * caller adds it to the parent's children once it has values.
  */
 static struct callchain_node *
-create_child(struct callchain_node *parent, bool inherit_children)
+create_child(struct mem_pool *pool, struct callchain_node *parent,
+	     bool inherit_children)
 {
 	struct callchain_node *new;
 
-	new = ccalloc(1, sizeof(*new));
+	new = mem_pool__alloc(pool, sizeof(*new), MEM_CALLCHAIN_NODE);
 	if (!new) {
 		perror("not enough memory to create child for code path tree");
 		return NULL;
 	}
 	new->parent = parent;
-	INIT_LIST_HEAD(&new->val);
-	INIT_LIST_HEAD(&new->parent_val);
 
 	if (inherit_children) {
-		struct rb_node *n;
 		struct callchain_node *child;
+		unsigned int i;
 
-		new->rb_root_in = parent->rb_root_in;
-		parent->rb_root_in = RB_ROOT;
+		new->children = parent->children;
+		memset(&parent->children, 0, sizeof(parent->children));
 
-		n = rb_first(&new->rb_root_in);
-		while (n) {
-			child = rb_entry(n, struct callchain_node, rb_node_in);
+		callchain_node__for_each_child_unordered(new, child, i)
 			child->parent = new;
-			n = rb_next(n);
-		}
-
-		/* make it the first child */
-		rb_link_node(&new->rb_node_in, NULL, &parent->rb_root_in.rb_node);
-		rb_insert_color(&new->rb_node_in, &parent->rb_root_in);
 	}
 
 	return new;
 }
 
 
+/*
+ * Release nr values and their branch state, if any
+ */
+static void release_vals(struct mem_pool *pool, struct callchain_list *val,
+			 struct callchain_list_branch *branch, unsigned int nr)
+{
+	for (unsigned int i = 0; i < nr; i++)
+		map_symbol__exit(&val[i].ms);
+	mem_pool__free(pool, val, nr * sizeof(*val), MEM_CALLCHAIN_LIST);
+
+	if (branch) {
+		for (unsigned int i = 0; i < nr; i++)
+			cfree(branch[i].brtype_stat, MEM_CALLCHAIN_BRANCH);
+		mem_pool__free(pool, branch, nr * sizeof(*branch),
+			       MEM_CALLCHAIN_LIST_BRANCH);
+	}
+}
+
+/*
+ * Release the values of a node
+ */
+static void free_node_vals(struct mem_pool *pool, struct callchain_node *node)
+{
+	release_vals(pool, node->val, node->branch, node->val_nr);
+
+	node->val = NULL;
+	node->branch = NULL;
+	node->val_nr = 0;
+}
+
+/*
+ * The branch state of the values of a node, allocated when the first of
+ * them gets some
+ */
+static struct callchain_list_branch *
+node_branch(struct mem_pool *pool, struct callchain_node *node)
+{
+	if (!node->branch) {
+		node->branch = mem_pool__alloc(pool,
+					       node->val_nr * sizeof(*node->branch),
+					       MEM_CALLCHAIN_LIST_BRANCH);
+		if (!node->branch)
+			perror("not enough memory for the code path branch state");
+	}
+	return node->branch;
+}
+
 /*
  * Fill the node with callchain values
  */
 static int
-fill_node(struct callchain_node *node, struct callchain_cursor *cursor)
+fill_node(struct mem_pool *pool, struct callchain_node *node,
+	  struct callchain_cursor *cursor)
 {
-	struct callchain_cursor_node *cursor_node;
+	struct callchain_cursor_node *cursor_node, *frames;
+	struct callchain_list_branch *br;
+	struct callchain_list *call;
+	u64 nr;
 
-	node->val_nr = cursor->nr - cursor->pos;
+	frames = callchain_cursor_remaining(cursor, &nr);
+	node->val_nr = nr;
 	if (!node->val_nr) {
 		pr_warning("Warning: empty node in callchain tree\n");
 		fprintf(stderr, "Empty node at fill");
 	}
 
-	cursor_node = callchain_cursor_current(cursor);
+	node->val = mem_pool__alloc(pool, node->val_nr * sizeof(*node->val),
+				    MEM_CALLCHAIN_LIST);
+	if (!node->val) {
+		perror("not enough memory for the code path tree");
+		node->val_nr = 0;
+		return -ENOMEM;
+	}
 
-	while (cursor_node) {
-		struct callchain_list *call;
+	for (unsigned int i = 0; i < nr; i++) {
+		cursor_node = &frames[i];
+		call = &node->val[i];
 
-		call = ccalloc(1, sizeof(*call));
-		if (!call) {
-			perror("not enough memory for the code path tree");
-			return -ENOMEM;
-		}
+		call->key = cursor_node->key;
+		call->slow_key = cursor_node->slow_key;
 		call->ip = cursor_node->ip;
 		call->ms = cursor_node->ms;
 		call->ms.map = map__get(call->ms.map);
@@ -572,30 +829,35 @@ fill_node(struct callchain_node *node, struct callchain_cursor *cursor)
 		call->srcline = cursor_node->srcline;
 
 		if (cursor_node->branch) {
-			call->branch_count = 1;
+			br = node_branch(pool, node);
+			if (!br)
+				return -ENOMEM;
+			br += call - node->val;
+			br->branch_count = 1;
 
 			if (cursor_node->branch_from) {
 				/*
 				 * branch_from is set with value somewhere else
 				 * to imply it's "to" of a branch.
 				 */
-				if (!call->brtype_stat) {
-					call->brtype_stat = ccalloc(1, sizeof(*call->brtype_stat));
-					if (!call->brtype_stat) {
+				if (!br->brtype_stat) {
+					br->brtype_stat = ccalloc(1, sizeof(*br->brtype_stat),
+								  MEM_CALLCHAIN_BRANCH);
+					if (!br->brtype_stat) {
 						perror("not enough memory for the code path branch statistics");
-						zfree(&call->brtype_stat);
+						zfree(&br->brtype_stat);
 						return -ENOMEM;
 					}
 				}
-				call->brtype_stat->branch_to = true;
+				br->brtype_stat->branch_to = true;
 
 				if (cursor_node->branch_flags.predicted)
-					call->predicted_count = 1;
+					br->predicted_count = 1;
 
 				if (cursor_node->branch_flags.abort)
-					call->abort_count = 1;
+					br->abort_count = 1;
 
-			// 	branch_type_count(call->brtype_stat,
+			// 	branch_type_count(br->brtype_stat,
 			// 			  &cursor_node->branch_flags,
 			// 			  cursor_node->branch_from,
 			// 			  cursor_node->ip);
@@ -603,44 +865,34 @@ fill_node(struct callchain_node *node, struct callchain_cursor *cursor)
 				/*
 				 * It's "from" of a branch
 				 */
-				if (call->brtype_stat && call->brtype_stat->branch_to)
-					call->brtype_stat->branch_to = false;
-				call->cycles_count =
+				if (br->brtype_stat && br->brtype_stat->branch_to)
+					br->brtype_stat->branch_to = false;
+				br->cycles_count =
 					cursor_node->branch_flags.cycles;
-				call->iter_count = cursor_node->nr_loop_iter;
-				call->iter_cycles = cursor_node->iter_cycles;
+				br->iter_count = cursor_node->nr_loop_iter;
+				br->iter_cycles = cursor_node->iter_cycles;
 			}
 		}
-
-		list_add_tail(&call->list, &node->val);
-
-		callchain_cursor_advance(cursor);
-		cursor_node = callchain_cursor_current(cursor);
 	}
+
+	callchain_cursor_advance_n(cursor, nr);
 	return 0;
 }
 
 static struct callchain_node *
-add_child(struct callchain_node *parent,
+add_child(struct mem_pool *pool, struct callchain_node *parent,
 	  struct callchain_cursor *cursor,
 	  u64 period)
 {
 	struct callchain_node *new;
 
-	new = create_child(parent, false);
+	new = create_child(pool, parent, false);
 	if (new == NULL)
 		return NULL;
 
-	if (fill_node(new, cursor) < 0) {
-		struct callchain_list *call, *tmp;
-
-		list_for_each_entry_safe(call, tmp, &new->val, list) {
-			list_del_init(&call->list);
-			map_symbol__exit(&call->ms);
-			zfree(&call->brtype_stat);
-			free(call);
-		}
-		free(new);
+	if (fill_node(pool, new, cursor) < 0) {
+		free_node_vals(pool, new);
+		mem_pool__free(pool, new, sizeof(*new), MEM_CALLCHAIN_NODE);
 		return NULL;
 	}
 
@@ -706,8 +958,54 @@ static enum match_result match_chain_dso_addresses(struct map *left_map, u64 lef
 	return MATCH_EQ;
 }
 
-static enum match_result match_chain(struct callchain_cursor_node *node,
-				     struct callchain_list *cnode)
+/*
+ * Fill in the key of a frame for callchain_param.key, see struct
+ * callchain_key. It has to agree with match_chain_slow() on every pair of
+ * frames that doesn't need strings.
+ */
+static void callchain_key__init(struct callchain_key *key, bool *slow_key,
+				u64 ip, struct map_symbol *ms,
+				const char *srcline)
+{
+	key->dso = (u64)(ms->map ? map__dso(ms->map) : NULL);
+	key->addr = ip;
+	*slow_key = false;
+
+	switch (callchain_param.key) {
+	case CCKEY_SRCLINE:
+		if (srcline) {
+			*slow_key = true;
+			break;
+		}
+		fallthrough;
+	case CCKEY_FUNCTION:
+		if (ms->sym) {
+			if (ms->sym->inlined)
+				*slow_key = true;
+			else
+				key->addr = ms->sym->start;
+		}
+		break;
+	case CCKEY_ADDRESS:
+	default:
+		break;
+	}
+}
+
+static inline enum match_result match_chain_key(const struct callchain_key *left,
+						const struct callchain_key *right)
+{
+	if (left->dso != right->dso)
+		return left->dso < right->dso ? MATCH_LT : MATCH_GT;
+
+	if (left->addr != right->addr)
+		return left->addr < right->addr ? MATCH_LT : MATCH_GT;
+
+	return MATCH_EQ;
+}
+
+static enum match_result match_chain_slow(struct callchain_cursor_node *node,
+					  struct callchain_list *cnode)
 {
 	enum match_result match = MATCH_ERROR;
 
@@ -745,46 +1043,381 @@ static enum match_result match_chain(struct callchain_cursor_node *node,
 		break;
 	}
 
+	return match;
+}
+
+/*
+ * Account the branch of a cursor node to the entry it matched
+ */
+static enum match_result match_chain_branch(struct callchain_cursor_node *node,
+					    struct callchain_list_branch *cnode)
+{
+	cnode->branch_count++;
+
+	if (node->branch_from) {
+		/*
+		 * It's "to" of a branch
+		 */
+		if (!cnode->brtype_stat) {
+			cnode->brtype_stat = ccalloc(1, sizeof(*cnode->brtype_stat),
+						     MEM_CALLCHAIN_BRANCH);
+			if (!cnode->brtype_stat) {
+				perror("not enough memory for the code path branch statistics");
+				return MATCH_ERROR;
+			}
+		}
+		cnode->brtype_stat->branch_to = true;
+
+		if (node->branch_flags.predicted)
+			cnode->predicted_count++;
+
+		if (node->branch_flags.abort)
+			cnode->abort_count++;
+
+		// branch_type_count(cnode->brtype_stat,
+		// 		  &node->branch_flags,
+		// 		  node->branch_from,
+		// 		  node->ip);
+	} else {
+		/*
+		 * It's "from" of a branch
+		 */
+		if (cnode->brtype_stat && cnode->brtype_stat->branch_to)
+			cnode->brtype_stat->branch_to = false;
+		cnode->cycles_count += node->branch_flags.cycles;
+		cnode->iter_count += node->nr_loop_iter;
+		cnode->iter_cycles += node->iter_cycles;
+		cnode->from_count++;
+	}
+
+	return MATCH_EQ;
+}
+
+/* Compare two frames, without the side effects of match_chain() */
+static inline enum match_result match_frame(struct callchain_cursor_node *node,
+					    struct callchain_list *cnode)
+{
+	if (likely(!node->slow_key && !cnode->slow_key))
+		return match_chain_key(&cnode->key, &node->key);
+
+	return match_chain_slow(node, cnode);
+}
+
+/* Match node against value i of root, accounting its branch if it has one */
+static enum match_result match_chain(struct mem_pool *pool,
+				     struct callchain_cursor_node *node,
+				     struct callchain_node *root, unsigned int i)
+{
+	struct callchain_list_branch *branch;
+	enum match_result match;
+
+	cs_stat_inc(CS_STAT_KEY_CMPS);
+	cs_stat_add(CS_STAT_BYTES_CMPD, sizeof(node->key));
+
+	match = match_frame(node, &root->val[i]);
+
 	if (match == MATCH_EQ && node->branch) {
-		cnode->branch_count++;
+		branch = node_branch(pool, root);
+		if (!branch)
+			return MATCH_ERROR;
+		return match_chain_branch(node, &branch[i]);
+	}
+
+	return match;
+}
+
+/*
+ * Slots in the hash index of children with room for alloc of them. The
+ * index is only 4 bytes a slot, so it's kept at most a quarter full to
+ * keep linear probing runs short.
+ */
+#define CHILDREN_INDEX_SLOTS(alloc)	(4 * (alloc))
+
+static inline bool callchain_key__eq(const struct callchain_key *left,
+				     const struct callchain_key *right)
+{
+	return left->dso == right->dso && left->addr == right->addr;
+}
+
+static inline u32 callchain_key__hash(const struct callchain_key *key)
+{
+	/* The hash_64() multiplier, over both words */
+	return ((key->dso * 0x9e3779b97f4a7c15ULL ^ key->addr) *
+		0x61C8864680B583EBULL) >> 32;
+}
+
+static inline const struct callchain_key *
+child_key(const struct callchain_node *child)
+{
+	return &child->val[0].key;
+}
+
+static inline enum child_layout
+callchain_children__layout(const struct callchain_children *children)
+{
+	if (!children->alloc)
+		return CHILD_LAYOUT_INLINE;
+
+	return children->index ? CHILD_LAYOUT_HASH : CHILD_LAYOUT_ARRAY;
+}
+
+/* (Re)build the hash index from the key array */
+static void callchain_children__index(struct callchain_children *children)
+{
+	u32 mask = CHILDREN_INDEX_SLOTS(children->alloc) - 1;
+
+	memset(children->index, 0,
+	       CHILDREN_INDEX_SLOTS(children->alloc) * sizeof(*children->index));
+
+	for (u32 i = 0; i < children->nr; i++) {
+		u32 h = callchain_key__hash(&children->keys[i]) & mask;
+
+		while (children->index[h])
+			h = (h + 1) & mask;
+		children->index[h] = i + 1;
+	}
+}
+
+/*
+ * Make room for another child, moving the children out of the node the
+ * first time around
+ */
+static int callchain_children__grow(struct callchain_children *children)
+{
+	struct callchain_node **old = callchain_children__nodes(children);
+	unsigned int alloc = children->alloc ? children->alloc * 2 : 8;
+	bool hashed = callchain_children__layout(children) == CHILD_LAYOUT_HASH;
+	struct callchain_key *keys;
+	struct callchain_node **nodes;
+	u32 *index = NULL;
+
+	keys = ccalloc(alloc, sizeof(*keys), MEM_CALLCHAIN_CHILDREN);
+	nodes = ccalloc(alloc, sizeof(*nodes), MEM_CALLCHAIN_CHILDREN);
+	if (hashed)
+		index = ccalloc(CHILDREN_INDEX_SLOTS(alloc), sizeof(*index),
+				MEM_CALLCHAIN_CHILDREN);
+	if (!keys || !nodes || (hashed && !index)) {
+		cfree(keys, MEM_CALLCHAIN_CHILDREN);
+		cfree(nodes, MEM_CALLCHAIN_CHILDREN);
+		cfree(index, MEM_CALLCHAIN_CHILDREN);
+		return -ENOMEM;
+	}
+
+	memcpy(nodes, old, children->nr * sizeof(*nodes));
+	if (children->alloc) {
+		memcpy(keys, children->keys, children->nr * sizeof(*keys));
+		cfree(children->keys, MEM_CALLCHAIN_CHILDREN);
+		cfree(children->nodes, MEM_CALLCHAIN_CHILDREN);
+		cfree(children->index, MEM_CALLCHAIN_CHILDREN);
+	} else {
+		for (unsigned int i = 0; i < children->nr; i++)
+			keys[i] = *child_key(nodes[i]);
+		cs_stat_inc(CS_STAT_CHILDREN_ARRAY);
+	}
+
+	children->keys = keys;
+	children->nodes = nodes;
+	children->index = index;
+	children->alloc = alloc;
+	if (index)
+		callchain_children__index(children);
+	return 0;
+}
+
+static int callchain_children__add(struct callchain_children *children,
+				   struct callchain_node *child)
+{
+	const struct callchain_key *key = child_key(child);
+	unsigned int size = children->alloc ?: CALLCHAIN_CHILDREN_INLINE;
+	struct callchain_node **nodes;
+
+	if (children->nr == size && callchain_children__grow(children) < 0)
+		return -ENOMEM;
+
+	nodes = callchain_children__nodes(children);
+	if (!children->nr)
+		children->sorted = true;
+	else if (children->sorted)
+		children->sorted = match_chain_key(child_key(nodes[children->nr - 1]),
+						   key) != MATCH_LT;
+
+	nodes[children->nr] = child;
+	if (children->alloc)
+		children->keys[children->nr] = *key;
+	children->nr++;
+	children->has_slow |= child->val[0].slow_key;
+
+	if (!children->alloc)
+		return 0;
+
+	if (children->index) {
+		u32 mask = CHILDREN_INDEX_SLOTS(children->alloc) - 1;
+		u32 h = callchain_key__hash(key) & mask;
+
+		while (children->index[h])
+			h = (h + 1) & mask;
+		children->index[h] = children->nr;
+	} else if (children->nr > CALLCHAIN_CHILDREN_HASH) {
+		children->index = ccalloc(CHILDREN_INDEX_SLOTS(children->alloc),
+					  sizeof(*children->index),
+					  MEM_CALLCHAIN_CHILDREN);
+		if (!children->index)
+			return -ENOMEM;
+		callchain_children__index(children);
+		cs_stat_inc(CS_STAT_CHILDREN_HASH);
+	}
+	return 0;
+}
+
+/*
+ * The child whose first frame matches node, if any. Frames whose order
+ * depends on strings can match children with other keys, so if either
+ * side has one every child is compared in full.
+ */
+static struct callchain_node *
+callchain_children__find(struct callchain_children *children,
+			 struct callchain_cursor_node *node)
+{
+	struct callchain_node **nodes = callchain_children__nodes(children);
+	enum child_layout layout = callchain_children__layout(children);
+	struct callchain_node *found = NULL;
+	unsigned long depth = 0;
+
+	if (unlikely(node->slow_key || children->has_slow)) {
+		for (; depth < children->nr; depth++) {
+			if (match_frame(node, &nodes[depth]->val[0]) == MATCH_EQ) {
+				found = nodes[depth];
+				break;
+			}
+		}
+	} else if (layout == CHILD_LAYOUT_INLINE) {
+		for (; depth < children->nr; depth++) {
+			if (callchain_key__eq(child_key(nodes[depth]), &node->key)) {
+				found = nodes[depth];
+				break;
+			}
+		}
+	} else if (layout == CHILD_LAYOUT_ARRAY) {
+		for (; depth < children->nr; depth++) {
+			if (callchain_key__eq(&children->keys[depth], &node->key)) {
+				found = nodes[depth];
+				break;
+			}
+		}
+	} else {
+		u32 mask = CHILDREN_INDEX_SLOTS(children->alloc) - 1;
+		u32 h = callchain_key__hash(&node->key) & mask;
+
+		for (; children->index[h]; h = (h + 1) & mask, depth++) {
+			u32 i = children->index[h] - 1;
+
+			if (callchain_key__eq(&children->keys[i], &node->key)) {
+				found = nodes[i];
+				break;
+			}
+		}
+	}
+
+	cs_stat_add(CS_STAT_CHILD_PROBES, depth + !!found);
+	cs_stat_add(CS_STAT_KEY_CMPS, depth + !!found);
+	cs_stat_add(CS_STAT_BYTES_CMPD,
+		    (depth + !!found) * sizeof(struct callchain_key));
+
+	if (depth > __max_depth[layout])
+		__max_depth[layout] = depth;
+	return found;
+}
+
+/* Descending, the order an in-order walk of the old rbtree gave */
+static int callchain_children__cmp(const void *a, const void *b)
+{
+	const struct callchain_node *left = *(struct callchain_node * const *)a;
+	const struct callchain_node *right = *(struct callchain_node * const *)b;
+
+	switch (match_chain_key(child_key(left), child_key(right))) {
+	case MATCH_LT:
+		return 1;
+	case MATCH_GT:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+void callchain_children__sort(struct callchain_children *children)
+{
+	struct callchain_node **nodes = callchain_children__nodes(children);
+
+	if (children->sorted)
+		return;
+
+	qsort(nodes, children->nr, sizeof(*nodes), callchain_children__cmp);
+	if (children->alloc) {
+		for (unsigned int i = 0; i < children->nr; i++)
+			children->keys[i] = *child_key(nodes[i]);
+		if (children->index)
+			callchain_children__index(children);
+	}
+	children->sorted = true;
+}
+
+static void callchain_children__exit(struct callchain_children *children)
+{
+	if (children->alloc) {
+		cfree(children->keys, MEM_CALLCHAIN_CHILDREN);
+		cfree(children->nodes, MEM_CALLCHAIN_CHILDREN);
+		cfree(children->index, MEM_CALLCHAIN_CHILDREN);
+	}
+	memset(children, 0, sizeof(*children));
+}
+
+/*
+ * Split node in two parts: a new child is created and given the values
+ * from idx on, with the hits, counts and children of node. node keeps
+ * the head and none of the hits.
+ */
+static struct callchain_node *
+split_node(struct mem_pool *pool, struct callchain_node *node, u64 idx)
+{
+	struct callchain_node *new;
 
-		if (node->branch_from) {
-			/*
-			 * It's "to" of a branch
-			 */
-			if (!cnode->brtype_stat) {
-				cnode->brtype_stat = ccalloc(1, sizeof(*cnode->brtype_stat));
-				if (!cnode->brtype_stat) {
-					perror("not enough memory for the code path branch statistics");
-					return MATCH_ERROR;
-				}
-			}
-			cnode->brtype_stat->branch_to = true;
+	cs_stat_inc(CS_STAT_SPLITS);
 
-			if (node->branch_flags.predicted)
-				cnode->predicted_count++;
+	new = create_child(pool, node, true);
+	if (new == NULL)
+		return NULL;
 
-			if (node->branch_flags.abort)
-				cnode->abort_count++;
+	/*
+	 * Both live in the same pool, so the child just takes over the tail
+	 * of the node's arrays rather than copying them.
+	 */
+	new->val = &node->val[idx];
+	if (node->branch)
+		new->branch = &node->branch[idx];
+	new->val_nr = node->val_nr - idx;
 
-			// branch_type_count(cnode->brtype_stat,
-			// 		  &node->branch_flags,
-			// 		  node->branch_from,
-			// 		  node->ip);
-		} else {
-			/*
-			 * It's "from" of a branch
-			 */
-			if (cnode->brtype_stat && cnode->brtype_stat->branch_to)
-				cnode->brtype_stat->branch_to = false;
-			cnode->cycles_count += node->branch_flags.cycles;
-			cnode->iter_count += node->nr_loop_iter;
-			cnode->iter_cycles += node->iter_cycles;
-			cnode->from_count++;
-		}
+	/* split the hits */
+	new->hit = node->hit;
+	new->children_hit = node->children_hit;
+	node->children_hit = callchain_cumul_hits(new);
+	if (new->val_nr == 0) {
+		fprintf(stderr, "Empty node value\n");
+	}
+	node->val_nr = idx;
+	if (node->val_nr == 0) {
+		fprintf(stderr, "Parenty empty value\n");
 	}
+	new->count = node->count;
+	new->children_count = node->children_count;
+	node->children_count = callchain_cumul_counts(new);
+	node->hit = 0;
+	node->count = 0;
+
+	/* make it the first child */
+	if (callchain_children__add(&node->children, new) < 0)
+		return NULL;
 
-	return match;
+	return new;
 }
 
 /*
@@ -793,77 +1426,31 @@ static enum match_result match_chain(struct callchain_cursor_node *node,
  * Then create another child to host the given callchain of new branch
  */
 static int
-split_add_child(struct callchain_node *parent,
+split_add_child(struct mem_pool *pool, struct callchain_node *parent,
 		struct callchain_cursor *cursor,
-		struct callchain_list *to_split,
 		u64 idx_parents, u64 idx_local, u64 period)
 {
 	struct callchain_node *new;
-	struct list_head *old_tail;
 	unsigned int idx_total = idx_parents + idx_local;
 
 	/* split */
-	new = create_child(parent, true);
-	if (new == NULL)
+	if (split_node(pool, parent, idx_local) == NULL)
 		return -1;
 
-	/* split the callchain and move a part to the new child */
-	old_tail = parent->val.prev;
-	list_del_range(&to_split->list, old_tail);
-	new->val.next = &to_split->list;
-	new->val.prev = old_tail;
-	to_split->list.prev = &new->val;
-	old_tail->next = &new->val;
-
-	/* split the hits */
-	new->hit = parent->hit;
-	new->children_hit = parent->children_hit;
-	parent->children_hit = callchain_cumul_hits(new);
-	new->val_nr = parent->val_nr - idx_local;
-	if (new->val_nr == 0) {
-		fprintf(stderr, "Empty node value\n");
-	}
-	parent->val_nr = idx_local;
-	if (parent->val_nr == 0) {
-		fprintf(stderr, "Parenty empty value\n");
-	}
-	new->count = parent->count;
-	new->children_count = parent->children_count;
-	parent->children_count = callchain_cumul_counts(new);
-
 	/* create a new child for the new branch if any */
 	if (idx_total < cursor->nr) {
-		struct callchain_node *first;
-		struct callchain_list *cnode;
-		struct callchain_cursor_node *node;
-		struct rb_node *p, **pp;
-
-		parent->hit = 0;
 		parent->children_hit += period;
-		parent->count = 0;
 		parent->children_count += 1;
 
-		node = callchain_cursor_current(cursor);
-		new = add_child(parent, cursor, period);
-		if (new == NULL)
-			return -1;
-
 		/*
 		 * This is second child since we moved parent's children
 		 * to new (first) child above.
 		 */
-		p = parent->rb_root_in.rb_node;
-		first = rb_entry(p, struct callchain_node, rb_node_in);
-		cnode = list_first_entry(&first->val, struct callchain_list,
-					 list);
-
-		if (match_chain(node, cnode) == MATCH_LT)
-			pp = &p->rb_left;
-		else
-			pp = &p->rb_right;
-
-		rb_link_node(&new->rb_node_in, p, pp);
-		rb_insert_color(&new->rb_node_in, &parent->rb_root_in);
+		new = add_child(pool, parent, cursor, period);
+		if (new == NULL)
+			return -1;
+		if (callchain_children__add(&parent->children, new) < 0)
+			return -1;
 	} else {
 		parent->hit = period;
 		parent->count = 1;
@@ -871,125 +1458,114 @@ split_add_child(struct callchain_node *parent,
 	return 0;
 }
 
-static enum match_result
-append_chain(struct callchain_node *root,
-	     struct callchain_cursor *cursor,
-	     u64 period);
-
-extern unsigned long __max_depth;
+/*
+ * Match the cursor against the values of node, advancing it past those
+ * that match. Returns how many did, or -1 on error.
+ */
 static int
-append_chain_children(struct callchain_node *root,
-		      struct callchain_cursor *cursor,
-		      u64 period)
+match_node_vals(struct mem_pool *pool, struct callchain_node *node,
+		struct callchain_cursor *cursor)
 {
-	struct callchain_node *rnode;
-	struct callchain_cursor_node *node;
-	struct rb_node **p = &root->rb_root_in.rb_node;
-	struct rb_node *parent = NULL;
-	unsigned long depth = 0;
-
-	node = callchain_cursor_current(cursor);
-	if (!node)
-		return -1;
-
-	/* lookup in children */
-	while (*p) {
-		enum match_result ret;
-
-		parent = *p;
-		rnode = rb_entry(parent, struct callchain_node, rb_node_in);
-
-		/* If at least first entry matches, rely to children */
-		ret = append_chain(rnode, cursor, period);
-		if (ret == MATCH_EQ)
-			goto inc_children_hit;
-		if (ret == MATCH_ERROR)
-			return -1;
-
-		if (ret == MATCH_LT)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-		depth++;
-	}
-	/* nothing in children, add to the current node */
-	rnode = add_child(root, cursor, period);
-	if (rnode == NULL)
-		return -1;
-
-	rb_link_node(&rnode->rb_node_in, parent, p);
-	rb_insert_color(&rnode->rb_node_in, &root->rb_root_in);
+	enum match_result cmp = MATCH_ERROR;
+	struct callchain_cursor_node *frames;
+	unsigned int i, nr;
+	u64 remaining;
 
-inc_children_hit:
-	root->children_hit += period;
-	root->children_count++;
-	if (depth > __max_depth)
-		__max_depth = depth;
-	return 0;
-}
+	cs_stat_inc(CS_STAT_NODES_VISITED);
 
-static enum match_result
-append_chain(struct callchain_node *root,
-	     struct callchain_cursor *cursor,
-	     u64 period)
-{
-	struct callchain_list *cnode;
-	u64 start = cursor->pos;
-	bool found = false;
-	u64 matches;
-	enum match_result cmp = MATCH_ERROR;
+	frames = callchain_cursor_remaining(cursor, &remaining);
+	nr = min_t(u64, node->val_nr, remaining);
 
 	/*
-	 * Lookup in the current node
 	 * If we have a symbol, then compare the start to match
 	 * anywhere inside a function, unless function
 	 * mode is disabled.
 	 */
-	list_for_each_entry(cnode, &root->val, list) {
-		struct callchain_cursor_node *node;
-
-		node = callchain_cursor_current(cursor);
-		if (!node)
-			break;
-
-		cmp = match_chain(node, cnode);
+	for (i = 0; i < nr; i++) {
+		cmp = match_chain(pool, &frames[i], node, i);
 		if (cmp != MATCH_EQ)
 			break;
-
-		found = true;
-
-		callchain_cursor_advance(cursor);
 	}
+	callchain_cursor_advance_n(cursor, i);
 
-	/* matches not, relay no the parent */
-	if (!found) {
+	if (cmp == MATCH_ERROR || !i) {
 		WARN_ONCE(cmp == MATCH_ERROR, "Chain comparison error\n");
-		return cmp;
+		return -1;
 	}
+	return i;
+}
 
-	matches = cursor->pos - start;
+/*
+ * Add what's left of the cursor below root.
+ *
+ * This walks down the tree in one loop rather than recursing for every
+ * level: each round finds the child of parent that starts with the next
+ * frame and matches the cursor against its values, then either ends the
+ * path there (a full match, a split or a new child) or carries on below
+ * it. The nodes on the way are the parents of each other, so once the
+ * path is in they're credited with the sample by walking back up.
+ */
+static int
+append_chain_children(struct mem_pool *pool, struct callchain_node *root,
+		      struct callchain_cursor *cursor,
+		      u64 period)
+{
+	struct callchain_node *parent = root;
+	struct callchain_cursor_node *node;
+	struct callchain_node *rnode;
+	u64 start;
+	int matches;
 
-	/* we match only a part of the node. Split it and add the new chain */
-	if (matches < root->val_nr) {
-		if (split_add_child(root, cursor, cnode, start, matches,
-				    period) < 0)
-			return MATCH_ERROR;
+	for (;;) {
+		node = callchain_cursor_current(cursor);
+		if (!node)
+			return -1;
 
-		return MATCH_EQ;
-	}
+		/* lookup in children */
+		rnode = callchain_children__find(&parent->children, node);
+		if (!rnode) {
+			/* nothing in children, add to the current node */
+			rnode = add_child(pool, parent, cursor, period);
+			if (rnode == NULL)
+				return -1;
+			if (callchain_children__add(&parent->children, rnode) < 0)
+				return -1;
+			break;
+		}
 
-	/* we match 100% of the path, increment the hit */
-	if (matches == root->val_nr && cursor->pos == cursor->nr) {
-		root->hit += period;
-		root->count++;
-		return MATCH_EQ;
-	}
+		/* At least the first entry matches, go on into the child */
+		start = cursor->pos;
+		matches = match_node_vals(pool, rnode, cursor);
+		if (matches < 0)
+			return -1;
 
-	/* We match the node and still have a part remaining */
-	if (append_chain_children(root, cursor, period) < 0)
-		return MATCH_ERROR;
+		/* we match only a part of the node. Split it and add the new chain */
+		if ((unsigned int)matches < rnode->val_nr) {
+			if (split_add_child(pool, rnode, cursor, start, matches,
+					    period) < 0)
+				return -1;
+			break;
+		}
 
-	return MATCH_EQ;
+		/* we match 100% of the path, increment the hit */
+		if (cursor->pos == cursor->nr) {
+			rnode->hit += period;
+			rnode->count++;
+			break;
+		}
+
+		/* We match the node and still have a part remaining */
+		parent = rnode;
+	}
+
+	for (;;) {
+		parent->children_hit += period;
+		parent->children_count++;
+		if (parent == root)
+			break;
+		parent = parent->parent;
+	}
+	return 0;
 }
 
 int callchain_append(struct callchain_root *root,
@@ -1004,7 +1580,7 @@ int callchain_append(struct callchain_root *root,
 
 	callchain_cursor_commit(cursor);
 
-	if (append_chain_children(&root->node, cursor, period) < 0)
+	if (append_chain_children(&root->pool, &root->node, cursor, period) < 0)
 		return -1;
 
 	if (cursor->nr > root->max_depth)
@@ -1013,59 +1589,389 @@ int callchain_append(struct callchain_root *root,
 	return 0;
 }
 
-static int
-merge_chain_branch(struct callchain_cursor *cursor,
-		   struct callchain_node *dst, struct callchain_node *src)
+static void free_callchain_node(struct mem_pool *pool,
+				struct callchain_node *node);
+
+/* A cursor frame for a value, to look it up like one being inserted */
+static void callchain_list__cursor_node(struct callchain_list *list,
+					struct callchain_cursor_node *node)
 {
-	struct callchain_cursor_node **old_last = cursor->last;
-	struct callchain_node *child;
-	struct callchain_list *list, *next_list;
-	struct rb_node *n;
-	int old_pos = cursor->nr;
-	int err = 0;
+	memset(node, 0, sizeof(*node));
+	node->key = list->key;
+	node->ip = list->ip;
+	node->ms = list->ms;
+	node->srcline = list->srcline;
+	node->slow_key = list->slow_key;
+}
+
+/* How many values src and dst start with in common */
+static unsigned int common_vals(struct callchain_node *dst,
+				struct callchain_node *src)
+{
+	unsigned int nr = min_t(unsigned int, dst->val_nr, src->val_nr);
+	unsigned int i;
+
+	cs_stat_inc(CS_STAT_NODES_VISITED);
+
+	for (i = 0; i < nr; i++) {
+		struct callchain_cursor_node node;
 
-	list_for_each_entry_safe(list, next_list, &src->val, list) {
-		struct map_symbol ms = {
-			.maps = maps__get(list->ms.maps),
-			.map = map__get(list->ms.map),
-		};
-		callchain_cursor_append(cursor, list->ip, &ms, false, NULL, 0, 0, 0, list->srcline);
-		list_del_init(&list->list);
-		map_symbol__exit(&ms);
-		map_symbol__exit(&list->ms);
-		zfree(&list->brtype_stat);
-		free(list);
+		cs_stat_inc(CS_STAT_KEY_CMPS);
+		cs_stat_add(CS_STAT_BYTES_CMPD, sizeof(node.key));
+
+		callchain_list__cursor_node(&src->val[i], &node);
+		if (match_frame(&node, &dst->val[i]) != MATCH_EQ)
+			break;
 	}
+	return i;
+}
 
-	if (src->hit) {
-		callchain_cursor_commit(cursor);
-		if (append_chain_children(dst, cursor, src->hit) < 0)
-			return -1;
+/* Add the branch state of the first nr values of src to those of dst */
+static int merge_vals_branch(struct mem_pool *dst_pool,
+			     struct callchain_node *dst,
+			     struct callchain_node *src, unsigned int nr)
+{
+	struct callchain_list_branch *to;
+
+	if (!src->branch)
+		return 0;
+
+	to = node_branch(dst_pool, dst);
+	if (!to)
+		return -1;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		struct callchain_list_branch *from = &src->branch[i];
+
+		to[i].branch_count += from->branch_count;
+		to[i].from_count += from->from_count;
+		to[i].cycles_count += from->cycles_count;
+		to[i].iter_count += from->iter_count;
+		to[i].iter_cycles += from->iter_cycles;
+		to[i].predicted_count += from->predicted_count;
+		to[i].abort_count += from->abort_count;
+
+		if (!from->brtype_stat)
+			continue;
+		if (!to[i].brtype_stat) {
+			to[i].brtype_stat = from->brtype_stat;
+			from->brtype_stat = NULL;
+			continue;
+		}
+
+		for (unsigned int t = 0; t < PERF_BR_MAX; t++)
+			to[i].brtype_stat->counts[t] += from->brtype_stat->counts[t];
+		for (unsigned int t = 0; t < PERF_BR_NEW_MAX; t++)
+			to[i].brtype_stat->new_counts[t] += from->brtype_stat->new_counts[t];
+		to[i].brtype_stat->cond_fwd += from->brtype_stat->cond_fwd;
+		to[i].brtype_stat->cond_bwd += from->brtype_stat->cond_bwd;
+		to[i].brtype_stat->cross_4k += from->brtype_stat->cross_4k;
+		to[i].brtype_stat->cross_2m += from->brtype_stat->cross_2m;
 	}
+	return 0;
+}
+
+static int merge_node(struct mem_pool *dst_pool, struct callchain_node *dst,
+		      struct mem_pool *src_pool, struct callchain_node *src);
+
+/*
+ * Merge src, a child that was under some node of the other tree, below
+ * dst.
+ *
+ * Like append_chain_children() this goes down dst's side one level at a
+ * time, but with src's values in place of the cursor: a child of dst
+ * that starts the same way is split where they part, and whatever is
+ * left of src moves on below it. Once src runs out its counts and
+ * children are merged into the node it ended on. If nothing under dst
+ * starts like src, src and its whole subtree are moved over as they are.
+ *
+ * src is consumed; its memory stays in src_pool.
+ */
+static int merge_child(struct mem_pool *dst_pool, struct callchain_node *dst,
+		       struct mem_pool *src_pool, struct callchain_node *src)
+{
+	struct callchain_cursor_node first;
+	struct callchain_node *match;
+	unsigned int k;
+
+	for (;;) {
+		callchain_list__cursor_node(&src->val[0], &first);
+		match = callchain_children__find(&dst->children, &first);
+		if (!match) {
+			src->parent = dst;
+			if (callchain_children__add(&dst->children, src) < 0)
+				goto out_free;
+			return 0;
+		}
+
+		k = common_vals(match, src);
+		if (!k)
+			goto out_free;
+
+		if (k < match->val_nr && split_node(dst_pool, match, k) == NULL)
+			goto out_free;
 
-	n = rb_first(&src->rb_root_in);
-	while (n) {
-		child = container_of(n, struct callchain_node, rb_node_in);
-		n = rb_next(n);
-		rb_erase(&child->rb_node_in, &src->rb_root_in);
+		if (merge_vals_branch(dst_pool, match, src, k) < 0)
+			goto out_free;
 
-		err = merge_chain_branch(cursor, dst, child);
-		if (err)
+		if (k == src->val_nr)
 			break;
 
-		free(child);
+		/* Drop the values in common and go on below match */
+		release_vals(src_pool, src->val, src->branch, k);
+		src->val += k;
+		if (src->branch)
+			src->branch += k;
+		src->val_nr -= k;
+
+		match->children_hit += callchain_cumul_hits(src);
+		match->children_count += callchain_cumul_counts(src);
+		dst = match;
 	}
 
-	cursor->nr = old_pos;
-	cursor->last = old_last;
+	if (merge_node(dst_pool, match, src_pool, src) < 0)
+		goto out;
+	mem_pool__free(src_pool, src, sizeof(*src), MEM_CALLCHAIN_NODE);
+	return 0;
+
+out_free:
+	free_callchain_node(src_pool, src);
+out:
+	mem_pool__free(src_pool, src, sizeof(*src), MEM_CALLCHAIN_NODE);
+	return -1;
+}
+
+/*
+ * Merge src into dst, two nodes that stand for the same path: their own
+ * counts add up and the children of src are merged below dst. src is
+ * left empty.
+ */
+static int merge_node(struct mem_pool *dst_pool, struct callchain_node *dst,
+		      struct mem_pool *src_pool, struct callchain_node *src)
+{
+	struct callchain_node *child;
+	unsigned int i;
+	int err = 0;
+
+	dst->hit += src->hit;
+	dst->count += src->count;
+	dst->children_hit += src->children_hit;
+	dst->children_count += src->children_count;
+
+	callchain_node__for_each_child_unordered(src, child, i) {
+		/* Children we can no longer merge are dropped */
+		if (!err) {
+			err = merge_child(dst_pool, dst, src_pool, child);
+		} else {
+			free_callchain_node(src_pool, child);
+			mem_pool__free(src_pool, child, sizeof(*child),
+				       MEM_CALLCHAIN_NODE);
+		}
+	}
+	callchain_children__exit(&src->children);
+	free_node_vals(src_pool, src);
 
 	return err;
 }
 
-int callchain_merge(struct callchain_cursor *cursor,
+/*
+ * Merge the tree of src into dst. Both trees are walked together: where
+ * their paths coincide the counts are added up, and whatever src has
+ * that dst doesn't is moved over a whole subtree at a time rather than
+ * being replayed path by path. src's pool goes to dst with the nodes.
+ */
+int callchain_merge(struct callchain_cursor *cursor __maybe_unused,
 		    struct callchain_root *dst, struct callchain_root *src)
 {
-	return merge_chain_branch(cursor, &dst->node, &src->node);
+	int err;
+
+	err = merge_node(&dst->pool, &dst->node, &src->pool, &src->node);
+	mem_pool__merge(&dst->pool, &src->pool);
+	mem_pool__reset(&src->sort_pool, MEM_CALLCHAIN_SORTED);
+	mem_pool__release(&src->sort_pool);
+
+	if (src->max_depth > dst->max_depth)
+		dst->max_depth = src->max_depth;
+	return err;
+}
+
+/*
+ * callchain_merge_parallel() workers. Each takes first level children
+ * of src off a shared index and merges them with their counterparts in
+ * dst, allocating from a pool and counting into accounts of its own.
+ */
+struct merge_work {
+	struct callchain_root *dst;
+	struct callchain_root *src;
+	/* The first level children of src that dst has too */
+	struct callchain_node **pairs;
+	unsigned int nr_pairs;
+	unsigned int next;
+	int err;
+};
+
+struct merge_worker {
+	pthread_t thread;
+	struct merge_work *work;
+	struct mem_pool pool;
+	struct mem_account mem;
+	struct cs_stats events;
+	unsigned long max_depth[NR_CHILD_LAYOUTS];
+};
+
+/*
+ * What's freed of src is accounted to the worker's pool rather than to
+ * the src pool they all share: both end up in dst, so it adds up
+ */
+static void merge_work__run(struct merge_work *work, struct mem_pool *pool)
+{
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	       work->nr_pairs) {
+		if (merge_child(pool, &work->dst->node, pool,
+				work->pairs[i]) < 0)
+			__atomic_store_n(&work->err, -1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *merge_worker__run(void *arg)
+{
+	struct merge_worker *w = arg;
+
+	mem_account = &w->mem;
+	cs_stats = &w->events;
+
+	merge_work__run(w->work, &w->pool);
+
+	memcpy(w->max_depth, __max_depth, sizeof(w->max_depth));
+	return NULL;
+}
+
+/*
+ * callchain_merge() on up to nr_threads threads.
+ *
+ * The first level children of src are merged independently: those that
+ * dst doesn't have are moved over right away, and the others each go
+ * below a different child of dst, so the workers never touch the same
+ * node and take no locks. dst->node's own list of children is only read
+ * while they run.
+ */
+int callchain_merge_parallel(struct callchain_root *dst,
+			     struct callchain_root *src,
+			     unsigned int nr_threads)
+{
+	struct merge_work work = { .dst = dst, .src = src };
+	struct callchain_node *child;
+	struct merge_worker *workers;
+	struct mem_pool pool = {};
+	struct mem_account base;
+	unsigned int i;
+
+	if (nr_threads < 2 || src->node.children.nr < 2)
+		return callchain_merge(NULL, dst, src);
+
+	work.pairs = ccalloc(src->node.children.nr, sizeof(*work.pairs),
+			     MEM_OTHER);
+	if (!work.pairs)
+		return callchain_merge(NULL, dst, src);
+
+	dst->node.hit += src->node.hit;
+	dst->node.count += src->node.count;
+	dst->node.children_hit += src->node.children_hit;
+	dst->node.children_count += src->node.children_count;
+
+	callchain_node__for_each_child_unordered(&src->node, child, i) {
+		struct callchain_cursor_node first;
+
+		callchain_list__cursor_node(&child->val[0], &first);
+		if (callchain_children__find(&dst->node.children, &first)) {
+			work.pairs[work.nr_pairs++] = child;
+		} else if (!work.err) {
+			child->parent = &dst->node;
+			if (callchain_children__add(&dst->node.children, child) < 0)
+				work.err = -1;
+		} else {
+			free_callchain_node(&src->pool, child);
+			mem_pool__free(&src->pool, child, sizeof(*child),
+				       MEM_CALLCHAIN_NODE);
+		}
+	}
+	callchain_children__exit(&src->node.children);
+	free_node_vals(&src->pool, &src->node);
+
+	/* This thread is one of them */
+	if (--nr_threads > work.nr_pairs)
+		nr_threads = work.nr_pairs;
+
+	workers = ccalloc(nr_threads, sizeof(*workers), MEM_OTHER);
+	if (!workers)
+		nr_threads = 0;
+
+	/*
+	 * The workers free what they merge of src, so they start from a copy
+	 * of this thread's account rather than an empty one and only what
+	 * changed is added back
+	 */
+	base = *mem_account;
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].work = &work;
+		mem_account_fork(&workers[i].mem, &base);
+		if (pthread_create(&workers[i].thread, NULL, merge_worker__run,
+				   &workers[i]))
+			break;
+	}
+	nr_threads = i;
+
+	/* This thread helps out too, with a pool of its own */
+	merge_work__run(&work, &pool);
+
+	for (i = 0; i < nr_threads; i++) {
+		struct merge_worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		mem_account_join(mem_account, &w->mem, &base);
+		cs_stats_add(cs_stats, &w->events);
+		for (int l = 0; l < NR_CHILD_LAYOUTS; l++) {
+			if (w->max_depth[l] > __max_depth[l])
+				__max_depth[l] = w->max_depth[l];
+		}
+		mem_pool__merge(&dst->pool, &w->pool);
+	}
+	mem_pool__merge(&dst->pool, &pool);
+	mem_pool__merge(&dst->pool, &src->pool);
+	mem_pool__reset(&src->sort_pool, MEM_CALLCHAIN_SORTED);
+	mem_pool__release(&src->sort_pool);
+
+	if (src->max_depth > dst->max_depth)
+		dst->max_depth = src->max_depth;
+
+	cfree(workers, MEM_OTHER);
+	cfree(work.pairs, MEM_OTHER);
+	return work.err;
+}
+
+/*
+ * Make room for more frames. The frames past nr are moved along too, as
+ * they still hold references that callchain_cursor_append() drops when it
+ * reuses them.
+ */
+static int callchain_cursor__grow(struct callchain_cursor *cursor)
+{
+	u64 alloc = cursor->alloc ? cursor->alloc * 2 : 64;
+	struct callchain_cursor_node *nodes;
+
+	nodes = ccalloc(alloc, sizeof(*nodes), MEM_CURSOR_NODE);
+	if (!nodes)
+		return -ENOMEM;
+
+	if (cursor->alloc)
+		memcpy(nodes, cursor->nodes, cursor->alloc * sizeof(*nodes));
+	cfree(cursor->nodes, MEM_CURSOR_NODE);
+
+	cursor->nodes = nodes;
+	cursor->alloc = alloc;
+	return 0;
 }
 
 int callchain_cursor_append(struct callchain_cursor *cursor,
@@ -1074,16 +1980,14 @@ int callchain_cursor_append(struct callchain_cursor *cursor,
 			    int nr_loop_iter, u64 iter_cycles, u64 branch_from,
 			    const char *srcline)
 {
-	struct callchain_cursor_node *node = *cursor->last;
+	struct callchain_cursor_node *node;
 
-	if (!node) {
-		node = ccalloc(1, sizeof(*node));
-		if (!node)
-			return -ENOMEM;
+	if (cursor->nr == cursor->alloc && callchain_cursor__grow(cursor) < 0)
+		return -ENOMEM;
 
-		*cursor->last = node;
-	}
+	node = &cursor->nodes[cursor->nr];
 
+	callchain_key__init(&node->key, &node->slow_key, ip, ms, srcline);
 	node->ip = ip;
 	map_symbol__exit(&node->ms);
 	node->ms = *ms;
@@ -1101,8 +2005,6 @@ int callchain_cursor_append(struct callchain_cursor *cursor,
 	node->branch_from = branch_from;
 	cursor->nr++;
 
-	cursor->last = &node->next;
-
 	return 0;
 }
 
@@ -1327,49 +2229,28 @@ int callchain_cursor_append(struct callchain_cursor *cursor,
 // 				       from_count, brtype_stat);
 // }
 
-// static void mjf(struct callchain_node *node) { fprintf(stderr, "Got zero %u", node->count);}
-
-// static void free_callchain_node(struct callchain_node *node)
-// {
-// 	struct callchain_list *list, *tmp;
-// 	struct callchain_node *child;
-// 	struct rb_node *n;
-
-// 	if (!node->val_nr)
-// 		mjf(node);
-
-// 	list_for_each_entry_safe(list, tmp, &node->parent_val, list) {
-// 		list_del_init(&list->list);
-// 		map_symbol__exit(&list->ms);
-// 		zfree(&list->brtype_stat);
-// 		free(list);
-// 	}
-
-// 	list_for_each_entry_safe(list, tmp, &node->val, list) {
-// 		list_del_init(&list->list);
-// 		map_symbol__exit(&list->ms);
-// 		zfree(&list->brtype_stat);
-// 		free(list);
-// 	}
-
-// 	n = rb_first(&node->rb_root_in);
-// 	while (n) {
-// 		child = container_of(n, struct callchain_node, rb_node_in);
-// 		n = rb_next(n);
-// 		rb_erase(&child->rb_node_in, &node->rb_root_in);
+static void free_callchain_node(struct mem_pool *pool,
+				struct callchain_node *node)
+{
+	struct callchain_node *child;
+	unsigned int i;
 
-// 		free_callchain_node(child);
-// 		free(child);
-// 	}
-// }
+	free_node_vals(pool, node);
 
-// void free_callchain(struct callchain_root *root)
-// {
-// 	if (!symbol_conf.use_callchain)
-// 		return;
+	callchain_node__for_each_child_unordered(node, child, i) {
+		free_callchain_node(pool, child);
+		mem_pool__free(pool, child, sizeof(*child), MEM_CALLCHAIN_NODE);
+	}
+	callchain_children__exit(&node->children);
+}
 
-// 	free_callchain_node(&root->node);
-// }
+void free_callchain(struct callchain_root *root)
+{
+	free_callchain_node(&root->pool, &root->node);
+	mem_pool__release(&root->pool);
+	mem_pool__reset(&root->sort_pool, MEM_CALLCHAIN_SORTED);
+	mem_pool__release(&root->sort_pool);
+}
 
 // static u64 decay_callchain_node(struct callchain_node *node)
 // {
@@ -1443,14 +2324,11 @@ int callchain_cursor_append(struct callchain_cursor *cursor,
 static void callchain_cursor__delete(void *vcursor)
 {
 	struct callchain_cursor *cursor = vcursor;
-	struct callchain_cursor_node *node, *next;
 
-	callchain_cursor_reset(cursor);
-	for (node = cursor->first; node != NULL; node = next) {
-		next = node->next;
-		free(node);
-	}
-	free(cursor);
+	for (u64 i = 0; i < cursor->alloc; i++)
+		map_symbol__exit(&cursor->nodes[i].ms);
+	cfree(cursor->nodes, MEM_CURSOR_NODE);
+	cfree(cursor, MEM_CURSOR_NODE);
 }
 
 static void init_callchain_cursor_key(void)
@@ -1469,7 +2347,7 @@ struct callchain_cursor *get_tls_callchain_cursor(void)
 	pthread_once(&once_control, init_callchain_cursor_key);
 	cursor = pthread_getspecific(callchain_cursor);
 	if (!cursor) {
-		cursor = ccalloc(1, sizeof(*cursor));
+		cursor = ccalloc(1, sizeof(*cursor), MEM_CURSOR_NODE);
 		if (!cursor)
 			pr_debug3("%s: not enough memory\n", __func__);
 		pthread_setspecific(callchain_cursor, cursor);
@@ -1480,17 +2358,16 @@ struct callchain_cursor *get_tls_callchain_cursor(void)
 int callchain_cursor__copy(struct callchain_cursor *dst,
 			   struct callchain_cursor *src)
 {
+	struct callchain_cursor_node *nodes;
 	int rc = 0;
+	u64 nr;
 
 	callchain_cursor_reset(dst);
 	callchain_cursor_commit(src);
 
-	while (true) {
-		struct callchain_cursor_node *node;
-
-		node = callchain_cursor_current(src);
-		if (node == NULL)
-			break;
+	nodes = callchain_cursor_nodes(src, &nr);
+	for (u64 i = 0; i < nr; i++) {
+		struct callchain_cursor_node *node = &nodes[i];
 
 		rc = callchain_cursor_append(dst, node->ip, &node->ms,
 					     node->branch, &node->branch_flags,
@@ -1499,8 +2376,6 @@ int callchain_cursor__copy(struct callchain_cursor *dst,
 					     node->branch_from, node->srcline);
 		if (rc)
 			break;
-
-		callchain_cursor_advance(src);
 	}
 
 	return rc;
@@ -1512,13 +2387,11 @@ int callchain_cursor__copy(struct callchain_cursor *dst,
  */
 void callchain_cursor_reset(struct callchain_cursor *cursor)
 {
-	struct callchain_cursor_node *node;
+	for (u64 i = 0; i < cursor->nr; i++)
+		map_symbol__exit(&cursor->nodes[i].ms);
 
 	cursor->nr = 0;
-	cursor->last = &cursor->first;
-
-	for (node = cursor->first; node != NULL; node = node->next)
-		map_symbol__exit(&node->ms);
+	cursor->pos = 0;
 }
 
 // void callchain_param_setup(u64 sample_type, const char *arch)
@@ -1569,33 +2442,29 @@ bool callchain_cnode_matched(struct callchain_node *base_cnode,
 			     struct callchain_node *pair_cnode)
 {
 	struct callchain_list *base_chain, *pair_chain;
+	unsigned int i, j = 0;
 	bool match = false;
 
-	pair_chain = list_first_entry(&pair_cnode->val,
-				      struct callchain_list,
-				      list);
-
-	list_for_each_entry(base_chain, &base_cnode->val, list) {
-		if (&pair_chain->list == &pair_cnode->val)
+	for (i = 0; i < base_cnode->val_nr; i++) {
+		if (j == pair_cnode->val_nr)
 			return false;
 
-		if (!base_chain->srcline || !pair_chain->srcline) {
-			pair_chain = list_next_entry(pair_chain, list);
+		base_chain = &base_cnode->val[i];
+		pair_chain = &pair_cnode->val[j++];
+
+		if (!base_chain->srcline || !pair_chain->srcline)
 			continue;
-		}
 
 		match = chain_match(base_chain, pair_chain);
 		if (!match)
 			return false;
-
-		pair_chain = list_next_entry(pair_chain, list);
 	}
 
 	/*
 	 * Say chain1 is ABC, chain2 is ABCD, we consider they are
 	 * not fully matched.
 	 */
-	if (pair_chain && (&pair_chain->list != &pair_cnode->val))
+	if (j != pair_cnode->val_nr)
 		return false;
 
 	return match;
@@ -1603,12 +2472,16 @@ bool callchain_cnode_matched(struct callchain_node *base_cnode,
 
 s64 callchain_avg_cycles(struct callchain_node *cnode)
 {
-	struct callchain_list *chain;
 	s64 cycles = 0;
 
-	list_for_each_entry(chain, &cnode->val, list) {
-		if (chain->srcline && chain->branch_count)
-			cycles += chain->cycles_count / chain->branch_count;
+	if (!cnode->branch)
+		return 0;
+
+	for (unsigned int i = 0; i < cnode->val_nr; i++) {
+		struct callchain_list_branch *branch = &cnode->branch[i];
+
+		if (cnode->val[i].srcline && branch->branch_count)
+			cycles += branch->cycles_count / branch->branch_count;
 	}
 
 	return cycles;
@@ -9,40 +9,47 @@ struct linux_priv {
     struct callchain_root root;
 };
 
-static void insert(struct callstack_tree *tree, struct callstack_entry *stack)
+void append_callchain(struct callchain_root *root,
+                      const struct callstack_entry *entries, unsigned int nr,
+                      unsigned long period)
 {
     struct callchain_cursor *cursor = get_tls_callchain_cursor();
-    struct linux_priv *priv = tree->priv;
-
-	cursor->nr = 0;
-	cursor->last = &cursor->first;
+    struct map_symbol **maps;
 
-    // Build a callchain cursor
-    for (int i = 0; i < MAX_STACK_ENTRIES; i++) {
-        struct callstack_entry *entry = &stack[i];
-        if (!entry->ip) {
-            break;
-        }
+    callchain_cursor_reset(cursor);
 
-        struct map_symbol *ms = get_map(entry->map);
-        callchain_cursor_append(cursor, entry->ip, ms, false, NULL, 0, 0, 0, NULL);
-    }
+    // Build a callchain cursor, resolving the maps of all frames at once
+    maps = get_maps(entries, nr);
+    for (unsigned int i = 0; i < nr; i++)
+        callchain_cursor_append(cursor, entries[i].ip, maps[i], false, NULL,
+                                0, 0, 0, NULL);
 
     if (!cursor->nr)
         return;
 
-    callchain_append(&priv->root, cursor, 0);
+    callchain_append(root, cursor, period);
+}
+
+/* Records carry no period, so every sample is one hit */
+static void insert(struct callstack_tree *tree, const struct stack *stack)
+{
+    struct linux_priv *priv = tree->priv;
+    const struct callstack_entry *entries;
+    unsigned int nr;
+
+    entries = stack_entries(stack, &nr);
+    append_callchain(&priv->root, entries, nr, 1);
 }
 
 static struct callstack_tree *linux_tree_new()
 {
    // printf("alloc\n");
-    struct callstack_tree *t = ccalloc(1, sizeof(struct callstack_tree));
+    struct callstack_tree *t = ccalloc(1, sizeof(struct callstack_tree), MEM_TREE);
     if (!t) {
         die();
     }
 
-    t->priv = ccalloc(1, sizeof(struct linux_priv));
+    t->priv = ccalloc(1, sizeof(struct linux_priv), MEM_TREE);
     if (!t->priv) {
         die();
     }
@@ -57,23 +64,42 @@ static struct callstack_tree *linux_tree_new()
 
 static void callstack_put(struct callstack_tree *tree)
 {
-    // TODO remove from tree_list.
-    cfree(tree, false);
+    struct linux_priv *priv = tree->priv;
+
+    free_callchain(&priv->root);
+    cfree(priv, MEM_TREE);
+    cfree(tree, MEM_TREE);
+}
+
+/* A stack ends at every node with a count */
+static unsigned long count_unique(struct callchain_node *node)
+{
+    unsigned long unique = node->count ? 1 : 0;
+    struct callchain_node *child;
+    unsigned int i;
+
+    callchain_node__for_each_child_unordered(node, child, i)
+        unique += count_unique(child);
+
+    return unique;
 }
 
 static void callstack_stats(struct callstack_tree *cs_tree, struct stats *stats)
 {
     struct linux_priv *priv = cs_tree->priv;
-    struct rb_node *n = rb_first(&priv->root.node.rb_root_in);
+    struct callchain_node *cnode;
+    unsigned int i;
+
+    stats->num_unique += count_unique(&priv->root.node);
+    if (priv->root.max_depth > stats->max_depth)
+        stats->max_depth = priv->root.max_depth;
 
     unsigned long this_full_matches = 0;
     unsigned long this_cumul_counts = 0;
-    while (n) {
-        struct callchain_node *cnode = rb_entry(n, struct callchain_node, rb_node_in);     
+    callchain_node__for_each_child_unordered(&priv->root.node, cnode, i) {
         // cumul_counts += callchain_cumul_counts(cnode);
         this_cumul_counts += callchain_cumul_counts(cnode);
         this_full_matches += cnode->count;
-        n = rb_next(n);
     }
     if (!this_cumul_counts) {
         // Some tree had zero matches?
@@ -87,8 +113,16 @@ static void callstack_stats(struct callstack_tree *cs_tree, struct stats *stats)
     // stats->avg_full_matches = (double)avg_full_matches / stats->num_trees * 100;
 }
 
+static struct callchain_root *callstack_callchain(struct callstack_tree *tree)
+{
+    struct linux_priv *priv = tree->priv;
+
+    return &priv->root;
+}
+
 struct callstack_ops linux_ops = {
     .put = callstack_put,
     .stats = callstack_stats,
     .new = linux_tree_new,
+    .callchain = callstack_callchain,
 };
@@ -0,0 +1,607 @@
+#include <assert.h>
+#include <stdio.h>
+#include "callchain.c"
+#include "data/data.h"
+
+typedef void (*funcptr)(void);
+
+__thread unsigned long __max_depth[NR_CHILD_LAYOUTS];
+
+static struct record records[] = {
+#include "../../gen.d"
+};
+
+#define NR_RECORDS (sizeof(records) / sizeof(records[0]))
+
+/*
+ * The recursive insertion callchain_append() used to do, kept as the
+ * reference the loop in append_chain_children() is checked against.
+ */
+static enum match_result
+ref_append_chain(struct mem_pool *pool, struct callchain_node *root,
+		 struct callchain_cursor *cursor, u64 period);
+
+static int
+ref_append_chain_children(struct mem_pool *pool, struct callchain_node *root,
+			  struct callchain_cursor *cursor, u64 period)
+{
+	struct callchain_node *rnode;
+	struct callchain_cursor_node *node;
+
+	node = callchain_cursor_current(cursor);
+	if (!node)
+		return -1;
+
+	rnode = callchain_children__find(&root->children, node);
+	if (rnode) {
+		if (ref_append_chain(pool, rnode, cursor, period) != MATCH_EQ)
+			return -1;
+		goto inc_children_hit;
+	}
+
+	rnode = add_child(pool, root, cursor, period);
+	if (rnode == NULL)
+		return -1;
+
+	if (callchain_children__add(&root->children, rnode) < 0)
+		return -1;
+
+inc_children_hit:
+	root->children_hit += period;
+	root->children_count++;
+	return 0;
+}
+
+static enum match_result
+ref_append_chain(struct mem_pool *pool, struct callchain_node *root,
+		 struct callchain_cursor *cursor, u64 period)
+{
+	u64 start = cursor->pos;
+	bool found = false;
+	u64 matches;
+	enum match_result cmp = MATCH_ERROR;
+
+	for (unsigned int i = 0; i < root->val_nr; i++) {
+		struct callchain_cursor_node *node;
+
+		node = callchain_cursor_current(cursor);
+		if (!node)
+			break;
+
+		cmp = match_chain(pool, node, root, i);
+		if (cmp != MATCH_EQ)
+			break;
+
+		found = true;
+
+		callchain_cursor_advance(cursor);
+	}
+
+	if (!found)
+		return cmp;
+
+	matches = cursor->pos - start;
+
+	if (matches < root->val_nr) {
+		if (split_add_child(pool, root, cursor, start, matches,
+				    period) < 0)
+			return MATCH_ERROR;
+
+		return MATCH_EQ;
+	}
+
+	if (matches == root->val_nr && cursor->pos == cursor->nr) {
+		root->hit += period;
+		root->count++;
+		return MATCH_EQ;
+	}
+
+	if (ref_append_chain_children(pool, root, cursor, period) < 0)
+		return MATCH_ERROR;
+
+	return MATCH_EQ;
+}
+
+static int ref_callchain_append(struct callchain_root *root,
+				struct callchain_cursor *cursor, u64 period)
+{
+	callchain_cursor_commit(cursor);
+	return ref_append_chain_children(&root->pool, &root->node, cursor,
+					 period);
+}
+
+/* Load the stack of a gen.d record into cursor, the way insert() does */
+static void load_cursor(struct callchain_cursor *cursor,
+			const struct record *rec)
+{
+	callchain_cursor_reset(cursor);
+
+	for (unsigned int i = 0; i < MAX_STACK_ENTRIES && rec->stack[i].ip; i++) {
+		struct map_symbol ms = {
+			.map = (struct map *)rec->stack[i].map,
+		};
+
+		callchain_cursor_append(cursor, rec->stack[i].ip, &ms, false,
+					NULL, 0, 0, 0, NULL);
+	}
+}
+
+/* Check that two trees have the same shape, frames and counts */
+static void compare_nodes(struct callchain_node *a, struct callchain_node *b)
+{
+	struct callchain_node *child;
+	unsigned int i;
+
+	assert(a->val_nr == b->val_nr);
+	for (i = 0; i < a->val_nr; i++) {
+		assert(a->val[i].ip == b->val[i].ip);
+		assert(callchain_key__eq(&a->val[i].key, &b->val[i].key));
+	}
+
+	assert(a->hit == b->hit);
+	assert(a->children_hit == b->children_hit);
+	assert(a->count == b->count);
+	assert(a->children_count == b->children_count);
+
+	assert(a->children.nr == b->children.nr);
+	callchain_node__for_each_child_unordered(a, child, i) {
+		struct callchain_node *other;
+
+		other = callchain_children__nodes(&b->children)[i];
+		assert(child->parent == a);
+		assert(other->parent == b);
+		compare_nodes(child, other);
+	}
+}
+
+/* Insert every record with callchain_append() and the reference */
+static void insert_both(struct callchain_root *root, struct callchain_root *ref,
+			unsigned int from, unsigned int to, int step)
+{
+	struct callchain_cursor *cursor = get_tls_callchain_cursor();
+
+	for (unsigned int i = from; i != to; i += step) {
+		/* Vary the period so that hits don't just count samples */
+		u64 period = i % 7 + 1;
+
+		load_cursor(cursor, &records[i]);
+		if (!cursor->nr)
+			continue;
+		assert(callchain_append(root, cursor, period) == 0);
+
+		load_cursor(cursor, &records[i]);
+		assert(ref_callchain_append(ref, cursor, period) == 0);
+	}
+}
+
+/* All of gen.d into one tree */
+static void test1(void)
+{
+	struct callchain_root root, ref;
+
+	callchain_init(&root);
+	callchain_init(&ref);
+
+	insert_both(&root, &ref, 0, NR_RECORDS, 1);
+	compare_nodes(&root.node, &ref.node);
+	assert(root.node.children_count > 0);
+
+	free_callchain(&root);
+	free_callchain(&ref);
+}
+
+/* gen.d forwards then backwards, so that every stack is seen again */
+static void test2(void)
+{
+	struct callchain_root root, ref;
+
+	callchain_init(&root);
+	callchain_init(&ref);
+
+	insert_both(&root, &ref, 0, NR_RECORDS, 1);
+	insert_both(&root, &ref, NR_RECORDS - 1, -1, -1);
+	compare_nodes(&root.node, &ref.node);
+
+	free_callchain(&root);
+	free_callchain(&ref);
+}
+
+/* One tree per id, as the harness builds them */
+static void test3(void)
+{
+	static struct callchain_root roots[NR_RECORDS], refs[NR_RECORDS];
+	struct callchain_cursor *cursor = get_tls_callchain_cursor();
+	unsigned long ids[NR_RECORDS];
+	unsigned int nr_ids = 0;
+
+	for (unsigned int i = 0; i < NR_RECORDS; i++) {
+		unsigned int t;
+
+		for (t = 0; t < nr_ids && ids[t] != records[i].id; t++)
+			;
+		if (t == nr_ids) {
+			ids[nr_ids++] = records[i].id;
+			callchain_init(&roots[t]);
+			callchain_init(&refs[t]);
+		}
+
+		load_cursor(cursor, &records[i]);
+		if (!cursor->nr)
+			continue;
+		assert(callchain_append(&roots[t], cursor, i) == 0);
+
+		load_cursor(cursor, &records[i]);
+		assert(ref_callchain_append(&refs[t], cursor, i) == 0);
+	}
+
+	for (unsigned int t = 0; t < nr_ids; t++) {
+		compare_nodes(&roots[t].node, &refs[t].node);
+		free_callchain(&roots[t]);
+		free_callchain(&refs[t]);
+	}
+}
+
+/*
+ * Check that two trees hold the same paths and counts, wherever their
+ * children ended up in each node's list
+ */
+static void compare_nodes_unordered(struct callchain_node *a,
+				    struct callchain_node *b)
+{
+	struct callchain_node *child;
+	unsigned int i;
+
+	assert(a->val_nr == b->val_nr);
+	for (i = 0; i < a->val_nr; i++) {
+		assert(a->val[i].ip == b->val[i].ip);
+		assert(callchain_key__eq(&a->val[i].key, &b->val[i].key));
+	}
+
+	assert(a->hit == b->hit);
+	assert(a->children_hit == b->children_hit);
+	assert(a->count == b->count);
+	assert(a->children_count == b->children_count);
+
+	assert(a->children.nr == b->children.nr);
+	callchain_node__for_each_child_unordered(a, child, i) {
+		struct callchain_cursor_node first;
+		struct callchain_node *other;
+
+		callchain_list__cursor_node(&child->val[0], &first);
+		other = callchain_children__find(&b->children, &first);
+		assert(other);
+		assert(child->parent == a);
+		assert(other->parent == b);
+		compare_nodes_unordered(child, other);
+	}
+}
+
+/* Insert every step'th record from from on into root */
+static void insert_some(struct callchain_root *root, unsigned int from,
+			unsigned int step)
+{
+	struct callchain_cursor *cursor = get_tls_callchain_cursor();
+
+	for (unsigned int i = from; i < NR_RECORDS; i += step) {
+		load_cursor(cursor, &records[i]);
+		if (!cursor->nr)
+			continue;
+		assert(callchain_append(root, cursor, i % 7 + 1) == 0);
+	}
+}
+
+/*
+ * Build trees out of interleaved parts of gen.d, merge them and check
+ * the result against a tree that had all of it inserted
+ */
+static void check_merge(unsigned int nr_parts, unsigned int nr_threads)
+{
+	struct callchain_root all, parts[nr_parts];
+
+	callchain_init(&all);
+	insert_some(&all, 0, 1);
+
+	for (unsigned int p = 0; p < nr_parts; p++) {
+		callchain_init(&parts[p]);
+		insert_some(&parts[p], p, nr_parts);
+	}
+
+	for (unsigned int p = 1; p < nr_parts; p++) {
+		if (nr_threads)
+			assert(callchain_merge_parallel(&parts[0], &parts[p],
+							nr_threads) == 0);
+		else
+			assert(callchain_merge(NULL, &parts[0], &parts[p]) == 0);
+
+		/* What's merged is gone from the source */
+		assert(parts[p].node.children.nr == 0);
+		assert(parts[p].pool.chunks == NULL);
+	}
+	compare_nodes_unordered(&parts[0].node, &all.node);
+
+	/* And the merged tree still takes inserts like any other */
+	insert_some(&parts[0], 0, 3);
+	insert_some(&all, 0, 3);
+	compare_nodes_unordered(&parts[0].node, &all.node);
+
+	for (unsigned int p = 0; p < nr_parts; p++)
+		free_callchain(&parts[p]);
+	free_callchain(&all);
+}
+
+/* callchain_merge() of halves, thirds, ... of gen.d, and into an empty tree */
+static void test4(void)
+{
+	struct callchain_root root, empty;
+
+	for (unsigned int nr_parts = 2; nr_parts <= 5; nr_parts++)
+		check_merge(nr_parts, 0);
+
+	callchain_init(&root);
+	callchain_init(&empty);
+	insert_some(&root, 0, 1);
+	assert(callchain_merge(NULL, &empty, &root) == 0);
+	callchain_init(&root);
+	insert_some(&root, 0, 1);
+	compare_nodes_unordered(&empty.node, &root.node);
+	free_callchain(&root);
+	free_callchain(&empty);
+}
+
+/* callchain_merge_parallel() on one to more threads than there's work for */
+static void test5(void)
+{
+	unsigned long allocs = mem_account->allocs;
+	size_t live = mem_account->live;
+
+	for (unsigned int nr_threads = 1; nr_threads <= 16; nr_threads *= 2) {
+		check_merge(2, nr_threads);
+		check_merge(4, nr_threads);
+	}
+
+	/* The workers' accounts were joined back into ours */
+	assert(mem_account->allocs > allocs);
+	assert(mem_account->live == live);
+}
+
+/* The rbtree sorted output used to be built in, as the reference */
+struct ref_sorted {
+	struct rb_node		rb_node;
+	struct callchain_node	*node;
+};
+
+static u64 ref_hits(struct callchain_node *node, bool cumul)
+{
+	return cumul ? callchain_cumul_hits(node) : node->hit;
+}
+
+static void ref_insert(struct rb_root *root, struct ref_sorted *new,
+		       bool cumul)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct ref_sorted *r;
+
+		parent = *p;
+		r = rb_entry(parent, struct ref_sorted, rb_node);
+		if (ref_hits(r->node, cumul) < ref_hits(new->node, cumul))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&new->rb_node, parent, p);
+	rb_insert_color(&new->rb_node, root);
+}
+
+/* Check that sorted has the nodes of the reference, in its order */
+static void ref_compare(struct rb_root *root, struct callchain_sorted *sorted)
+{
+	unsigned int i = 0;
+
+	for (struct rb_node *rb = rb_first(root); rb; rb = rb_next(rb), i++) {
+		assert(i < sorted->nr);
+		assert(sorted->nodes[i] ==
+		       rb_entry(rb, struct ref_sorted, rb_node)->node);
+	}
+	assert(i == sorted->nr);
+}
+
+/* Everything reachable from node's sorted children, the old way */
+static void ref_check_graph(struct callchain_node *node, u64 min_hit,
+			    double min_percent, bool rel)
+{
+	struct ref_sorted *refs;
+	struct rb_root root = RB_ROOT;
+	struct callchain_node *child;
+	unsigned int i, nr = 0;
+
+	if (rel)
+		min_hit = ceil(node->children_hit * min_percent);
+
+	refs = calloc(node->children.nr + 1, sizeof(*refs));
+	assert(refs);
+	callchain_node__for_each_child(node, child, i) {
+		if (callchain_cumul_hits(child) >= min_hit) {
+			refs[nr].node = child;
+			ref_insert(&root, &refs[nr++], true);
+		}
+	}
+	ref_compare(&root, &node->sorted);
+	free(refs);
+
+	for (i = 0; i < node->sorted.nr; i++)
+		ref_check_graph(node->sorted.nodes[i], min_hit, min_percent,
+				rel);
+}
+
+static void ref_collect_flat(struct rb_root *root, struct ref_sorted **refs,
+			     struct callchain_node *node, u64 min_hit)
+{
+	struct callchain_node *child;
+	unsigned int i;
+
+	callchain_node__for_each_child(node, child, i)
+		ref_collect_flat(root, refs, child, min_hit);
+
+	if (node->hit && node->hit >= min_hit) {
+		(*refs)->node = node;
+		ref_insert(root, (*refs)++, false);
+	}
+}
+
+static unsigned int count_nodes(struct callchain_node *node)
+{
+	struct callchain_node *child;
+	unsigned int i, nr = 1;
+
+	callchain_node__for_each_child_unordered(node, child, i)
+		nr += count_nodes(child);
+	return nr;
+}
+
+static void ref_check(struct callchain_root *root,
+		      struct callchain_sorted *out, u64 min_hit,
+		      struct callchain_param *param)
+{
+	struct ref_sorted *refs, *next;
+	struct rb_root rb = RB_ROOT;
+
+	switch (param->mode) {
+	case CHAIN_GRAPH_ABS:
+		assert(out->nodes == root->node.sorted.nodes);
+		ref_check_graph(&root->node, min_hit, 0, false);
+		break;
+	case CHAIN_GRAPH_REL:
+		assert(out->nodes == root->node.sorted.nodes);
+		ref_check_graph(&root->node, 0, param->min_percent / 100.0,
+				true);
+		break;
+	default:
+		refs = next = calloc(count_nodes(&root->node), sizeof(*refs));
+		assert(refs);
+		ref_collect_flat(&rb, &next, &root->node, min_hit);
+		ref_compare(&rb, out);
+		free(refs);
+		break;
+	}
+}
+
+/* One tree per id of gen.d, and one with all of them */
+static unsigned int build_trees(struct callchain_root *roots)
+{
+	struct callchain_cursor *cursor = get_tls_callchain_cursor();
+	unsigned long ids[NR_RECORDS];
+	unsigned int nr_ids = 0;
+
+	callchain_init(&roots[0]);
+	insert_some(&roots[0], 0, 1);
+
+	for (unsigned int i = 0; i < NR_RECORDS; i++) {
+		unsigned int t;
+
+		for (t = 0; t < nr_ids && ids[t] != records[i].id; t++)
+			;
+		if (t == nr_ids) {
+			ids[nr_ids++] = records[i].id;
+			callchain_init(&roots[1 + t]);
+		}
+
+		load_cursor(cursor, &records[i]);
+		if (!cursor->nr)
+			continue;
+		assert(callchain_append(&roots[1 + t], cursor, i % 7 + 1) == 0);
+	}
+	return 1 + nr_ids;
+}
+
+/* Every output mode against the old rbtree sort, at various thresholds */
+static void test6(void)
+{
+	static struct callchain_root roots[NR_RECORDS + 1];
+	enum chain_mode modes[] = {
+		CHAIN_GRAPH_ABS, CHAIN_GRAPH_REL, CHAIN_FLAT, CHAIN_FOLDED,
+	};
+	u64 min_hits[] = { 0, 1, 5, 50, 500, 5000 };
+	double min_percents[] = { 0, 0.5, 5, 50 };
+	struct callchain_sorted out;
+	unsigned int nr = build_trees(roots);
+
+	for (unsigned int m = 0; m < ARRAY_SIZE(modes); m++) {
+		struct callchain_param param = { .mode = modes[m] };
+
+		assert(callchain_register_param(&param) == 0);
+		for (unsigned int h = 0; h < ARRAY_SIZE(min_hits); h++) {
+			param.min_percent = min_percents[h % ARRAY_SIZE(min_percents)];
+			for (unsigned int t = 0; t < nr; t++) {
+				param.sort(&out, &roots[t], min_hits[h], &param);
+				ref_check(&roots[t], &out, min_hits[h], &param);
+			}
+		}
+	}
+
+	for (unsigned int t = 0; t < nr; t++)
+		free_callchain(&roots[t]);
+}
+
+/* callchain_sort_trees() on several threads, to the same result */
+static void test7(void)
+{
+	static struct callchain_root roots[NR_RECORDS + 1];
+	static struct callchain_root *ptrs[NR_RECORDS + 1];
+	static struct callchain_sorted out[NR_RECORDS + 1];
+	enum chain_mode modes[] = { CHAIN_GRAPH_ABS, CHAIN_GRAPH_REL, CHAIN_FLAT };
+	size_t live = mem_account->live;
+	size_t sorted_live = mem_account->types[MEM_CALLCHAIN_SORTED].live;
+	unsigned int nr = build_trees(roots);
+
+	for (unsigned int t = 0; t < nr; t++)
+		ptrs[t] = &roots[t];
+
+	for (unsigned int threads = 1; threads <= 16; threads *= 2) {
+		for (unsigned int m = 0; m < ARRAY_SIZE(modes); m++) {
+			struct callchain_param param = {
+				.mode = modes[m],
+				.min_percent = 0.5,
+			};
+
+			assert(callchain_register_param(&param) == 0);
+			callchain_sort_trees(ptrs, out, nr, 5, &param, threads);
+			for (unsigned int t = 0; t < nr; t++)
+				ref_check(&roots[t], &out[t], 5, &param);
+		}
+	}
+
+	for (unsigned int t = 0; t < nr; t++)
+		free_callchain(&roots[t]);
+
+	/* Including what the workers allocated for the sorts */
+	assert(mem_account->live == live);
+	assert(mem_account->types[MEM_CALLCHAIN_SORTED].live == sorted_live);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int num_tests = 0;
+	funcptr tests[] = {
+		test1,
+		test2,
+		test3,
+		test4,
+		test5,
+		test6,
+		test7,
+		NULL,
+	};
+
+	for (funcptr *f = tests; *f != NULL; f++, num_tests++) {
+		(*f)();
+	}
+
+	printf("Ran %u tests\n", num_tests);
+	return 0;
+}
+
+// vim: ts=8 sw=8 noexpandtab
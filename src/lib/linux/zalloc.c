@@ -2,18 +2,18 @@
 
 #include <stdlib.h>
 #include <linux/zalloc.h>
+#include "callstack.h"
 
-extern unsigned long num_allocs;
 void *zalloc(size_t size)
 {
-	num_allocs++;
+	mem_account->allocs++;
 	return calloc(1, size);
 }
 
-extern unsigned long num_frees;
 void __zfree(void **ptr)
 {
-	num_frees++;
+	if (*ptr)
+		mem_account->frees++;
 	free(*ptr);
 	*ptr = NULL;
 }
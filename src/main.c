@@ -1,14 +1,26 @@
+#define _GNU_SOURCE
 #include <linux/rbtree.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "map_symbol.h"
+#include <time.h>
+#include <unistd.h>
+#include "map_registry.h"
 
+#include "bench.h"
 #include "callstack.h"
+#include "counters.h"
+#include "cs_stats.h"
+#include "report.h"
+#include "treedir.h"
 #include "data/data.h"
+#include "data/perf_data.h"
+#include "data/synth.h"
 
 struct record records[] = {
-#include "gen2.d"
+#include "gen.d"
 };
 
 struct record simple_records[] = {
@@ -25,16 +37,14 @@ struct record simple_records[] = {
         }}
 };
 
-void _insert(struct callstack_tree *tree, struct callstack_entry *stack)
+void _insert(struct callstack_tree *tree, const struct stack *stack)
 {
-    struct callstack_entry *entry;
-    for (int i = 0; i < MAX_STACK_ENTRIES; i++) {
-        entry = &stack[i];
-        if (!entry->ip) {
-            break;
-        }
-        printf("ip: 0x%016lx, map: 0x%016lx\n", entry->ip, entry->map);
-    }
+    struct callstack_entry entry;
+    struct stack_iter it;
+
+    stack_iter_init(&it, stack);
+    while (stack_iter_next(&it, &entry))
+        printf("ip: 0x%016lx, map: 0x%016lx\n", entry.ip, entry.map);
 }
 
 struct callstack_tree *callstack_get(unsigned long id)
@@ -63,186 +73,768 @@ struct callstack_ops cs = {
 // struct callstack_ops *cs_ops = &linux_ops;
 struct callstack_ops *cs_ops = &art_ops;
 
-struct map_tree {
-    struct rb_node node;
-    unsigned long id;
-    struct map_symbol *ms;
+/* Maps ids to trees, see -t */
+static struct treedir_ops *td_ops = &hash_treedir_ops;
+static struct treedir *trees;
+
+__thread unsigned long __max_depth[NR_CHILD_LAYOUTS];
+
+static const char *child_layout_names[NR_CHILD_LAYOUTS] = {
+    [CHILD_LAYOUT_INLINE]   = "inline",
+    [CHILD_LAYOUT_ARRAY]    = "array",
+    [CHILD_LAYOUT_HASH]     = "hash",
 };
 
-struct map_trees {
-    struct rb_root_cached node;
+/* Initialise various caches */
+static inline void init_caches() {
+    trees = td_ops->new();
+    map_registry__init(&map_registry_global);
+}
+
+static inline struct callstack_tree *get_tree(struct treedir *trees,
+                                              unsigned long id) {
+    struct callstack_tree **slot = td_ops->get(trees, id);
+
+    if (!*slot)
+        *slot = cs_ops->new();
+    return *slot;
+}
+
+/*
+ * A source of stacks. Every kind of input goes through the same iterator
+ * so that benchmark runs can replay it as many times as they need.
+ */
+struct workload {
+    enum {
+        WORKLOAD_RECORDS,
+        WORKLOAD_PERF_DATA,
+        WORKLOAD_SYNTH,
+    } type;
+
+    /* WORKLOAD_RECORDS: every record in buf, loops times */
+    struct record_buf *buf;
+    const struct packed_record *rec;
+    int loops;
+    int loop;
+
+    /* WORKLOAD_PERF_DATA */
+    const char *path;
+    struct perf_data_reader reader;
+    unsigned long nr_skipped;
+
+    /* WORKLOAD_SYNTH: built once, read by every pass */
+    const struct synth *synth;
+    struct synth_stream stream;
 };
-static struct map_trees map_trees;
-
-static struct map_symbol *last_ms = NULL;
-
-struct map_symbol *get_map(unsigned long id) {
-    struct rb_node **p = &map_trees.node.rb_root.rb_node;
-    struct rb_node *parent = NULL;
-    struct map_tree *mt;
-    bool leftmost = true;
-    struct map_symbol *ms = NULL;
-
-    if (last_ms && last_ms->map == (void *)id) {
-        return last_ms;
-    }
-
-    while (*p != NULL) {
-        parent = *p;
-        mt = rb_entry(parent, struct map_tree, node);
-        int cmp = mt->id - id;
-        if (cmp < 0)
-            p = &(*p)->rb_left;
-        else if (cmp > 0) {
-            p = &(*p)->rb_right;
-            leftmost = false;
-        } else {
-            ms = mt->ms;
-            goto out;
-        }
+
+/* Runs on whichever thread reads the file, so goes to its registry */
+static void add_mmap(const struct perf_data_mmap *mmap)
+{
+    map_registry__add(map_registry, mmap->as, mmap->start,
+                      mmap->start + mmap->len);
+}
+
+static void workload__start(struct workload *w)
+{
+    switch (w->type) {
+    case WORKLOAD_RECORDS:
+        w->rec = record_buf__first(w->buf);
+        w->loop = 0;
+        break;
+    case WORKLOAD_PERF_DATA:
+        if (perf_data__open(&w->reader, w->path) < 0)
+            exit(EXIT_FAILURE);
+        w->reader.mmap_cb = add_mmap;
+        break;
+    case WORKLOAD_SYNTH:
+        synth_stream_init(&w->stream, w->synth);
+        break;
     }
+}
 
-    ms = calloc(1, sizeof(struct map_symbol));
-    if (!ms) {
-        die();
+/* Point stack at the next stack, returning false when there are no more */
+static inline bool workload__next(struct workload *w, struct stack *stack)
+{
+    struct perf_data_sample sample;
+    int ret;
+
+    switch (w->type) {
+    case WORKLOAD_RECORDS:
+        while (!w->rec) {
+            if (++w->loop >= w->loops)
+                return false;
+            w->rec = record_buf__first(w->buf);
+        }
+        record_buf__stack(w->buf, w->rec, stack);
+        w->rec = record_buf__next(w->buf, w->rec);
+        return true;
+    case WORKLOAD_PERF_DATA:
+        ret = perf_data__next(&w->reader, &sample);
+        if (ret < 0)
+            exit(EXIT_FAILURE);
+        if (!ret)
+            return false;
+        perf_data__sample_stack(&sample, stack);
+        return true;
+    case WORKLOAD_SYNTH:
+        return synth_next(&w->stream, stack);
     }
-    // Append the IP to the callchain
-    ms->map = (void *)id;
 
-    mt = calloc(1, sizeof(struct map_tree));
-    if (!mt) {
-        die();
+    return false;
+}
+
+static void workload__stop(struct workload *w)
+{
+    switch (w->type) {
+    case WORKLOAD_RECORDS:
+        break;
+    case WORKLOAD_PERF_DATA:
+        w->nr_skipped = w->reader.nr_skipped;
+        /* Backends copy whatever they keep, so the mapping can go */
+        perf_data__close(&w->reader);
+        break;
+    case WORKLOAD_SYNTH:
+        break;
     }
+}
+
+/* Insert every stack of w, optionally saving them to out as we go */
+static void ingest(struct workload *w, struct stats *stats,
+                   struct record_buf *out)
+{
+    struct stack stack;
 
-    mt->id = id;
-    mt->ms = ms;
-    rb_link_node(&mt->node, parent, p);
-    rb_insert_color_cached(&mt->node, &map_trees.node, leftmost);
+    workload__start(w);
+    while (workload__next(w, &stack)) {
+        struct callstack_tree *tree = get_tree(trees, stack.id);
 
-out:
-    last_ms = ms;
-    return ms;
+        tree->insert(tree, &stack);
+        stats->num_records += 1;
+        if (out)
+            record_buf__append(out, &stack);
+    }
+    workload__stop(w);
 }
 
-struct tree {
-    unsigned long id;
-    struct callstack_tree *cs_tree;
-    struct rb_node node;
-};
+/*
+ * Same as ingest() but time the tree lookup and the insert of every
+ * stack separately.
+ */
+static void bench_ingest(struct workload *w, struct stats *stats,
+                         struct bench_run *run, struct bench_hist *hist)
+{
+    struct stack stack;
+
+    workload__start(w);
+    while (workload__next(w, &stack)) {
+        struct callstack_tree **slot, *tree;
+        uint64_t t0, t1, t2;
+
+        t0 = bench_now();
+        slot = td_ops->get(trees, stack.id);
+        t1 = bench_now();
+        /* Creating a tree for a new id counts as part of the insert */
+        if (!*slot)
+            *slot = cs_ops->new();
+        tree = *slot;
+        tree->insert(tree, &stack);
+        t2 = bench_now();
+
+        run->ns[BENCH_LOOKUP] += t1 - t0;
+        run->ns[BENCH_INSERT] += t2 - t1;
+        bench_hist_add(hist, t2 - t1);
+        stats->num_records += 1;
+    }
+    workload__stop(w);
+}
 
-struct trees {
-    struct rb_root_cached entries;
+/*
+ * Parallel ingestion.
+ *
+ * Stacks are sharded by tree id, so each tree is only ever touched by
+ * one worker and the workers share nothing but the read-only input. Each
+ * shard has its own tree directory and map registry and does its own
+ * allocation and event accounting; everything is added into the global
+ * ones once the workers have been joined.
+ *
+ * Every worker reads the whole input and skips the stacks of other
+ * shards. That costs a decode per stack per worker but needs no queues
+ * or locks. A synthetic input's pool is built once, before the workers
+ * start, and each of them only draws its own stream from it.
+ */
+struct shard {
+    pthread_t thread;
+    unsigned int idx;
+    unsigned int nr;
+    /* -1 if not pinned */
+    int cpu;
+
+    struct workload w;
+    struct treedir *trees;
+    struct map_registry maps;
+    struct mem_account mem;
+    struct cs_stats events;
+    unsigned long max_depth[NR_CHILD_LAYOUTS];
+    unsigned long nr_records;
 };
 
-struct trees trees;
+/* Ids are often pids, so mix them first (the hash_64() multiplier) */
+static inline unsigned int shard_of(unsigned long id, unsigned int nr)
+{
+    return ((id * 0x61C8864680B583EBull) >> 32) % nr;
+}
+
+static void *shard__run(void *arg)
+{
+    struct shard *s = arg;
+    struct stack stack;
 
-/* Initialise various caches */
-static inline void init_caches() {
-    trees.entries = RB_ROOT_CACHED;
-    map_trees.node = RB_ROOT_CACHED;
+    mem_account = &s->mem;
+    cs_stats = &s->events;
+    map_registry = &s->maps;
+    s->trees = td_ops->new();
+
+    workload__start(&s->w);
+    while (workload__next(&s->w, &stack)) {
+        struct callstack_tree *tree;
+
+        if (shard_of(stack.id, s->nr) != s->idx)
+            continue;
+
+        tree = get_tree(s->trees, stack.id);
+        tree->insert(tree, &stack);
+        s->nr_records++;
+    }
+    workload__stop(&s->w);
+
+    memcpy(s->max_depth, __max_depth, sizeof(s->max_depth));
+    return NULL;
 }
 
-static struct callstack_tree *get_tree(unsigned long id) {
-    struct tree *cursor;
-    struct callstack_tree *t = NULL;
-    struct rb_node **p = &trees.entries.rb_root.rb_node;
-    struct rb_node *parent = NULL;
-    struct tree *tree;
-    bool leftmost = true;
+static void shard__merge_tree(unsigned long id, struct callstack_tree *tree,
+                              void *arg)
+{
+    *td_ops->get(trees, id) = tree;
+}
 
-    while (*p != NULL) {
-        parent = *p;
-        tree = rb_entry(parent, struct tree, node);
+/* Hand the trees and maps of s over to the main thread's */
+static void shard__merge(struct shard *s)
+{
+    /* First, since the shard's memory is about to be freed from here */
+    mem_account_add(mem_account, &s->mem);
+
+    /* Shards have disjoint ids, so every tree gets a slot of its own */
+    td_ops->for_each(s->trees, shard__merge_tree, NULL);
+    td_ops->free(s->trees);
+
+    map_registry__merge(&map_registry_global, &s->maps);
+    map_registry__exit(&s->maps);
 
-        if (tree->id < id)
-            p = &(*p)->rb_left;
-        else if (tree->id > id) {
-            p = &(*p)->rb_right;
-            leftmost = false;
-        } else
-            return tree->cs_tree;
+    cs_stats_add(cs_stats, &s->events);
+    for (int i = 0; i < NR_CHILD_LAYOUTS; i++) {
+        if (s->max_depth[i] > __max_depth[i])
+            __max_depth[i] = s->max_depth[i];
     }
+}
 
-    t = cs_ops->new();
+/*
+ * ingest() on nr threads, each pinned to one of the CPUs we're allowed to
+ * run on, round-robin.
+ */
+static void parallel_ingest(struct workload *w, struct stats *stats,
+                            unsigned int nr)
+{
+    struct shard *shards = calloc(nr, sizeof(*shards));
+    unsigned int nr_cpus = 0;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t allowed;
 
-    cursor = calloc(1, sizeof(*cursor));
-    if (!cursor)
+    if (!shards)
         die();
 
-    cursor->cs_tree = t;
-    cursor->id = id;
-    rb_link_node(&cursor->node, parent, p);
-    rb_insert_color_cached(&cursor->node, &trees.entries, leftmost);
-    return cursor->cs_tree;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[nr_cpus++] = cpu;
+        }
+    }
+
+    for (unsigned int i = 0; i < nr; i++) {
+        struct shard *s = &shards[i];
+        pthread_attr_t attr;
+        int err;
+
+        s->idx = i;
+        s->nr = nr;
+        s->cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+        s->w = *w;
+        map_registry__init(&s->maps);
+
+        pthread_attr_init(&attr);
+        if (s->cpu >= 0) {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET(s->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        err = pthread_create(&s->thread, &attr, shard__run, s);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (unsigned int i = 0; i < nr; i++) {
+        struct shard *s = &shards[i];
+
+        pthread_join(s->thread, NULL);
+        shard__merge(s);
+        stats->num_records += s->nr_records;
+    }
+
+    /* Every worker saw every record */
+    w->nr_skipped = shards[0].w.nr_skipped;
+    free(shards);
 }
 
-unsigned long __max_depth = 0;
-int main(int argc, char *argv[])
+static void tree_stats(unsigned long id, struct callstack_tree *tree,
+                       void *arg)
 {
-    struct stats stats = {0};
-    struct record *r = records;
+    struct stats *stats = arg;
+
+    cs_ops->stats(tree, stats);
+    stats->num_trees++;
+}
+
+static void walk_stats(struct stats *stats)
+{
+    td_ops->for_each(trees, tree_stats, stats);
+}
+
+static void tree_put(unsigned long id, struct callstack_tree *tree, void *arg)
+{
+    cs_ops->put(tree);
+}
+
+static void tree_callchain(unsigned long id, struct callstack_tree *tree,
+                           void *arg)
+{
+    report__add(arg, cs_ops->callchain(tree));
+}
+
+/*
+ * perf report's side: get the callchains of every tree, then sort and
+ * print them in each chain mode in turn, sorting on up to nr_threads
+ * threads. ns gets the time of each phase, indexed by enum bench_phase,
+ * and out what each mode printed.
+ */
+static void run_report(unsigned int nr_threads, uint64_t *ns,
+                       struct report_output *out)
+{
+    struct report report;
+    uint64_t t0;
+
+    report__init(&report);
+
+    t0 = bench_now();
+    td_ops->for_each(trees, tree_callchain, &report);
+    ns[BENCH_CALLCHAIN] = bench_now() - t0;
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <linux|art>\n", argv[0]);
+    for (int m = 0; m < NR_REPORT_MODES; m++) {
+        t0 = bench_now();
+        report__sort(&report, m, nr_threads);
+        ns[BENCH_SORT + m] = bench_now() - t0;
+
+        t0 = bench_now();
+        report__output(&report, &out[m]);
+        ns[BENCH_OUTPUT + m] = bench_now() - t0;
+    }
+
+    report__exit(&report);
+}
+
+/* Free every tree and map so that the next run starts from scratch */
+static void teardown(void)
+{
+    td_ops->for_each(trees, tree_put, NULL);
+    td_ops->free(trees);
+    map_registry__exit(&map_registry_global);
+
+    memset(__max_depth, 0, sizeof(__max_depth));
+    init_caches();
+}
+
+static void run_bench(struct bench *bench, struct workload *w)
+{
+    unsigned int nr_runs = bench->warmup + bench->repeats;
+
+    bench_init(bench);
+
+    for (unsigned int i = 0; i < nr_runs; i++) {
+        struct bench_run scratch = {0};
+        struct bench_run *run = &scratch;
+        unsigned long allocs = mem_global.allocs, frees = mem_global.frees;
+        struct stats stats = {0};
+        size_t peak;
+        uint64_t t0;
+
+        if (i >= bench->warmup)
+            run = &bench->runs[i - bench->warmup];
+
+        /* Warmup latencies are thrown away with the runs */
+        if (i == bench->warmup)
+            memset(&bench->insert_hist, 0, sizeof(bench->insert_hist));
+
+        /* Every run does the same work, so the last run's events are kept */
+        cs_stats_reset();
+        mem_stats_reset_peak();
+
+        counters__start(&bench->counters);
+        bench_ingest(w, &stats, run, &bench->insert_hist);
+        counters__stop(&bench->counters, &run->counters[BENCH_COUNT_INGEST]);
+
+        counters__start(&bench->counters);
+        t0 = bench_now();
+        walk_stats(&stats);
+        run->ns[BENCH_STATS] = bench_now() - t0;
+        counters__stop(&bench->counters, &run->counters[BENCH_COUNT_STATS]);
+        peak = mem_global.peak;
+
+        if (bench->report) {
+            /* Keep the events of the insert path, not of what's built here */
+            struct cs_stats events = *cs_stats;
+
+            counters__start(&bench->counters);
+            run_report(1, run->ns, run->output);
+            counters__stop(&bench->counters,
+                           &run->counters[BENCH_COUNT_REPORT]);
+            *cs_stats = events;
+        }
+
+        counters__start(&bench->counters);
+        t0 = bench_now();
+        teardown();
+        run->ns[BENCH_TEARDOWN] = bench_now() - t0;
+        counters__stop(&bench->counters, &run->counters[BENCH_COUNT_TEARDOWN]);
+
+        run->records = stats.num_records;
+        run->trees = stats.num_trees;
+        run->allocs = mem_global.allocs - allocs;
+        run->frees = mem_global.frees - frees;
+        run->unique = stats.num_unique;
+        run->peak_bytes = peak;
+        run->report_peak_bytes = mem_global.peak;
+    }
+
+    bench_report(bench, stdout);
+    bench_exit(bench);
+}
+
+static struct treedir_ops *parse_treedir(const char *arg)
+{
+    if (!strcmp(arg, "hash"))
+        return &hash_treedir_ops;
+    if (!strcmp(arg, "rbtree"))
+        return &rbtree_treedir_ops;
+
+    fprintf(stderr, "Invalid tree directory: %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+static enum stack_format parse_format(const char *arg)
+{
+    if (!strcmp(arg, "entries"))
+        return STACK_FMT_ENTRIES;
+    if (!strcmp(arg, "packed"))
+        return STACK_FMT_PACKED;
+
+    fprintf(stderr, "Invalid record format: %s\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned int parse_count(const char *arg)
+{
+    char *end;
+    long v = strtol(arg, &end, 0);
+
+    if (*end || v < 0) {
+        fprintf(stderr, "Invalid count: %s\n", arg);
         exit(EXIT_FAILURE);
     }
+    return v;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-f entries|packed] [-o records] [-S key=val,...]\n"
+            "          [-b [-w warmup] [-r repeats]] [-c cpu] [-j threads]\n"
+            "          [-t hash|rbtree] [-k ip|map,le|be,strip=N]\n"
+            "          [-K scalar|sse2|avx2|avx512] [-R]\n"
+            "          <linux|art|hash|frameart> [perf.data|records]\n"
+            "\n"
+            "  -f  encoding of the in-memory record buffer (default: packed)\n"
+            "  -o  save the ingested stacks as a record file\n"
+            "  -S  stream a seeded synthetic workload. Keys: seed, samples,\n"
+            "      unique, depth=MEAN[:STDDEV], max_depth, fanout, zipf, ids,\n"
+            "      maps, kernel\n"
+            "  -b  benchmark mode: time each phase and print the results as JSON\n"
+            "  -w  number of warmup runs to discard (default: 1)\n"
+            "  -r  number of measured runs (default: 5)\n"
+            "  -c  pin to cpu\n"
+            "  -j  ingest on this many threads, sharding the trees by id\n"
+            "  -t  index of trees by id (default: hash)\n"
+            "  -k  art backend: feed each frame's ip or map first, little or\n"
+            "      big endian, leaving out N sign extended high bytes of each\n"
+            "      (default: ip,le,strip=0)\n"
+            "  -K  art backend: kernels for node search and key comparison\n"
+            "      (default: the best the CPU supports)\n"
+            "  -R  also sort and print the callchains in every chain mode, like\n"
+            "      perf report, and time that\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    enum stack_format format = STACK_FMT_PACKED;
+    const char *input = NULL, *output = NULL;
+    struct stats stats = {0};
+    struct synth_params synth_params = SYNTH_PARAMS_DEFAULT;
+    struct synth synth;
+    const char *synth_arg = NULL;
+    const char *keys_arg = NULL;
+    const char *simd_arg = NULL, *simd = NULL;
+    struct bench bench = {
+        .warmup = 1,
+        .repeats = 5,
+        .cpu = -1,
+    };
+    bool benchmark = false;
+    bool report = false;
+    unsigned int nr_threads = 1;
+    struct workload w = {0};
+    struct counters counters;
+    struct counter_values ingest_counters, stats_counters;
+    struct timespec start, end;
+    /* The input, if it's records, and what -o saves */
+    struct record_buf buf, saved;
+    const struct record_buf *shown;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:o:S:bw:r:c:j:t:k:K:R")) != -1) {
+        switch (opt) {
+        case 'S':
+            if (synth_parse(&synth_params, optarg) < 0)
+                exit(EXIT_FAILURE);
+            synth_arg = optarg;
+            break;
+        case 'f':
+            format = parse_format(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            benchmark = true;
+            break;
+        case 'w':
+            bench.warmup = parse_count(optarg);
+            break;
+        case 'r':
+            bench.repeats = parse_count(optarg);
+            break;
+        case 'c':
+            bench.cpu = parse_count(optarg);
+            break;
+        case 'j':
+            nr_threads = parse_count(optarg);
+            break;
+        case 't':
+            td_ops = parse_treedir(optarg);
+            break;
+        case 'k':
+            if (art_keys_parse(optarg) < 0)
+                exit(EXIT_FAILURE);
+            keys_arg = optarg;
+            break;
+        case 'K':
+            simd_arg = optarg;
+            break;
+        case 'R':
+            report = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        usage(argv[0]);
+
+    const char *backend = argv[optind++];
+    if (optind < argc)
+        input = argv[optind];
 
-    if (!strcmp(argv[1], "linux")) {
+    if (!strcmp(backend, "linux")) {
         cs_ops = &linux_ops;
-    } else if (!strcmp(argv[1], "art")) {
+    } else if (!strcmp(backend, "art")) {
         cs_ops = &art_ops;
-    } else if (!strcmp(argv[1], "hash")) {
+    } else if (!strcmp(backend, "hash")) {
         cs_ops = &hash_ops;
+    } else if (!strcmp(backend, "frameart")) {
+        cs_ops = &frameart_ops;
     } else {
-        fprintf(stderr, "Invalid argument: %s\n", argv[1]);
+        fprintf(stderr, "Invalid argument: %s\n", backend);
         exit(EXIT_FAILURE);
     }
 
-    init_caches();
+    if ((keys_arg || simd_arg) && cs_ops != &art_ops) {
+        fprintf(stderr, "-k and -K only apply to the art backend\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Main loop
-    for (int j = 0; j < 20; j++) {
-        for (int i = 0; i < ARRAY_SIZE(records); i++) {
-            r = &records[i];
+    if (cs_ops == &art_ops && !(simd = art_simd_parse(simd_arg)))
+        exit(EXIT_FAILURE);
 
-            struct callstack_tree *tree = get_tree(r->id);
-            tree->insert(tree, r->stack);
-            stats.num_records += 1;
-        }
+    if (benchmark && (output || !bench.repeats)) {
+        fprintf(stderr, "-b needs at least one repeat and can't be used with -o\n");
+        exit(EXIT_FAILURE);
     }
 
-    // Walk the rbtree and count the number of entries
-    struct rb_root *root = &trees.entries.rb_root;
-    struct rb_node *tree_node = rb_first(root);
-    struct tree *tree;
-
-    while (tree_node) {
-        tree = rb_entry(tree_node, struct tree, node);
-        cs_ops->stats(tree->cs_tree, &stats);
-        stats.num_trees++;
-        tree_node = rb_next(tree_node);
+    if (!nr_threads || (nr_threads > 1 && (benchmark || output))) {
+        fprintf(stderr, "-j needs at least one thread and can't be used with -b or -o\n");
+        exit(EXIT_FAILURE);
     }
 
-    struct rb_root *map_root = &map_trees.node.rb_root;
-    struct rb_node *map_node = rb_first(map_root);
-    // struct map_tree *map_tree;
+    if (bench.cpu >= 0 && bench_pin_cpu(bench.cpu) < 0)
+        exit(EXIT_FAILURE);
+
+    init_caches();
+
+    record_buf__init(&buf, format);
+    record_buf__init(&saved, format);
+    if (synth_arg) {
+        synth_init(&synth, &synth_params, format);
+        w.type = WORKLOAD_SYNTH;
+        w.synth = &synth;
+    } else if (input && is_record_file(input)) {
+        if (record_buf__read(&buf, input) < 0)
+            exit(EXIT_FAILURE);
+        w.type = WORKLOAD_RECORDS;
+        w.buf = &buf;
+        w.loops = 1;
+    } else if (input) {
+        w.type = WORKLOAD_PERF_DATA;
+        w.path = input;
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(records); i++)
+            record_buf__append_entries(&buf, records[i].id, records[i].stack);
+        w.type = WORKLOAD_RECORDS;
+        w.buf = &buf;
+        w.loops = 20;
+    }
 
-    unsigned long num_maps = 0;
-    while (map_node) {
-        // map_tree = rb_entry(map_node, struct map_tree, node);
-        // printf("map: 0x%016lx\n", map_tree->id);
-        num_maps++;
-        map_node = rb_next(map_node);
+    if (benchmark) {
+        bench.backend = backend;
+        bench.treedir = td_ops->name;
+        bench.keys = keys_arg;
+        bench.simd = simd;
+        bench.input = synth_arg ? synth_arg : input ? input : "gen.d";
+        bench.format = format == STACK_FMT_ENTRIES ? "entries" : "packed";
+        bench.report = report;
+        run_bench(&bench, &w);
+        if (synth_arg)
+            synth_exit(&synth);
+        record_buf__exit(&buf);
+        return 0;
     }
 
+    counters__open(&counters);
+
+    // Main loop
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    counters__start(&counters);
+    if (nr_threads > 1)
+        parallel_ingest(&w, &stats, nr_threads);
+    else
+        ingest(&w, &stats, output ? &saved : NULL);
+    counters__stop(&counters, &ingest_counters);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (w.type == WORKLOAD_PERF_DATA)
+        printf("Skipped %lu non-callchain records\n", w.nr_skipped);
+
+    if (output && record_buf__write(&saved, output) < 0)
+        exit(EXIT_FAILURE);
+
+    // Walk the rbtree and count the number of entries
+    counters__start(&counters);
+    walk_stats(&stats);
+    counters__stop(&counters, &stats_counters);
+
+    unsigned long num_maps = map_registry__nr_maps(&map_registry_global);
+
     printf("Processed %lu records\n", stats.num_records);
+    printf("Ingestion took %.3f s (%.0f records/s)\n", elapsed,
+           elapsed > 0 ? stats.num_records / elapsed : 0.0);
     printf("Created %lu trees\n", stats.num_trees);
+    if (stats.num_unique) {
+        printf("Unique stacks: %lu\n", stats.num_unique);
+        if (stats.num_hits)
+            printf("Hits: %lu\n", stats.num_hits);
+    }
     printf("Average 100%% matches: %0.2f%%\n", stats.avg_full_matches);
     printf("Number of maps: %lu\n", num_maps);
-    printf("Number of allocations: %lu\n", num_allocs);
-    printf("Number of free:        %lu\n", num_frees);
-    printf("Number of LEAF frees:  %lu\n", leaf_frees);
-    printf("Max tree depth: %lu\n", __max_depth);
+    printf("Number of allocations: %lu\n", mem_global.allocs);
+    printf("Number of free:        %lu\n", mem_global.frees);
+    printf("Max stack depth: %lu frames\n", stats.max_depth);
+    if (cs_ops == &linux_ops) {
+        printf("Max tree depth:");
+        for (int i = 0; i < NR_CHILD_LAYOUTS; i++)
+            printf("%s %s %lu", i ? "," : "", child_layout_names[i], __max_depth[i]);
+        printf("\n");
+    }
+    shown = output ? &saved : &buf;
+    if (shown->nr_records) {
+        printf("Record buffer: %lu records, %lu frames, %zu bytes (%.1f bytes/frame)\n",
+               shown->nr_records, shown->nr_frames, shown->len,
+               shown->nr_frames ? (double)shown->len / shown->nr_frames : 0.0);
+    }
+    mem_stats_print(stdout, stats.num_unique);
+    cs_stats_print(stdout, stats.num_records);
+    if (counters.available) {
+        printf("Ingest counters:\n");
+        counters__print(&ingest_counters, stats.num_records, stdout);
+        printf("Stats walk counters:\n");
+        counters__print(&stats_counters, stats.num_records, stdout);
+    }
+
+    if (report) {
+        struct report_output out[NR_REPORT_MODES];
+        uint64_t ns[BENCH_NR_PHASES];
+
+        run_report(nr_threads, ns, out);
+        printf("Report callchains took %.3f s\n", ns[BENCH_CALLCHAIN] / 1e9);
+        for (int m = 0; m < NR_REPORT_MODES; m++) {
+            printf("Report %s: sort %.3f s, output %.3f s, %lu lines\n",
+                   report_mode_names[m], ns[BENCH_SORT + m] / 1e9,
+                   ns[BENCH_OUTPUT + m] / 1e9, out[m].lines);
+        }
+        printf("Report peak bytes: %zu\n", mem_global.peak);
+    }
+
+    counters__close(&counters);
+
+    if (synth_arg)
+        synth_exit(&synth);
+    record_buf__exit(&buf);
+    record_buf__exit(&saved);
 
     return 0;
 }
@@ -0,0 +1,239 @@
+#include <string.h>
+#include "map_registry.h"
+
+struct map_registry map_registry_global;
+__thread struct map_registry *map_registry = &map_registry_global;
+
+void map_registry__init(struct map_registry *reg)
+{
+    memset(reg, 0, sizeof(*reg));
+}
+
+void map_registry__exit(struct map_registry *reg)
+{
+    for (unsigned int i = 0; i < reg->nr; i++) {
+        cfree(reg->spaces[i].as->ranges, MEM_MAP);
+        cfree(reg->spaces[i].as, MEM_MAP);
+    }
+    cfree(reg->spaces, MEM_MAP);
+    cfree(reg->batch, MEM_MAP);
+    map_registry__init(reg);
+}
+
+/* Grow *array of *alloc elements of size to hold at least nr */
+static void *grow_array(void *array, unsigned int *alloc, unsigned int nr,
+                        size_t size)
+{
+    unsigned int n = *alloc ? *alloc : 4;
+    void *new;
+
+    if (nr <= *alloc)
+        return array;
+
+    while (n < nr)
+        n *= 2;
+
+    new = ccalloc(n, size, MEM_MAP);
+    if (!new)
+        die();
+    if (array)
+        memcpy(new, array, *alloc * size);
+    cfree(array, MEM_MAP);
+    *alloc = n;
+    return new;
+}
+
+/* Index of the first element of the sorted spaces with an id >= id */
+static unsigned int space_index(const struct map_registry *reg,
+                                unsigned long id)
+{
+    unsigned int lo = 0, hi = reg->nr;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (reg->spaces[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct addr_space *get_space(struct map_registry *reg,
+                                    unsigned long id)
+{
+    unsigned int i = space_index(reg, id);
+    struct addr_space *as;
+
+    if (i < reg->nr && reg->spaces[i].id == id)
+        return reg->spaces[i].as;
+
+    as = ccalloc(1, sizeof(*as), MEM_MAP);
+    if (!as)
+        die();
+    as->id = id;
+    as->whole.map = (void *)id;
+
+    reg->spaces = grow_array(reg->spaces, &reg->alloc, reg->nr + 1,
+                             sizeof(*reg->spaces));
+    memmove(&reg->spaces[i + 1], &reg->spaces[i],
+            (reg->nr - i) * sizeof(*reg->spaces));
+    reg->spaces[i].id = id;
+    reg->spaces[i].as = as;
+    reg->nr++;
+    return as;
+}
+
+/* Index of the first range of as that ends after addr */
+static unsigned int range_index(const struct addr_space *as,
+                                unsigned long addr)
+{
+    unsigned int lo = 0, hi = as->nr;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (as->ranges[mid].end <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void map_registry__add(struct map_registry *reg, unsigned long as_id,
+                       unsigned long start, unsigned long end)
+{
+    struct addr_space *as = get_space(reg, as_id);
+    unsigned int i, j;
+
+    if (start >= end)
+        return;
+
+    /* Ranges [i, j) overlap the new one and are replaced by it */
+    i = range_index(as, start);
+    for (j = i; j < as->nr && as->ranges[j].start < end; j++)
+        ;
+
+    if (i == j) {
+        as->ranges = grow_array(as->ranges, &as->alloc, as->nr + 1,
+                                sizeof(*as->ranges));
+        memmove(&as->ranges[i + 1], &as->ranges[i],
+                (as->nr - i) * sizeof(*as->ranges));
+        as->nr++;
+    } else if (j > i + 1) {
+        memmove(&as->ranges[i + 1], &as->ranges[j],
+                (as->nr - j) * sizeof(*as->ranges));
+        as->nr -= j - i - 1;
+    }
+
+    memset(&as->ranges[i], 0, sizeof(as->ranges[i]));
+    as->ranges[i].start = start;
+    as->ranges[i].end = end;
+    as->ranges[i].ms.map = (void *)start;
+
+    /* The cache may hold the ranges we just moved or replaced */
+    memset(reg->cache, 0, sizeof(reg->cache));
+}
+
+static struct map_cache_entry *find_slow(struct map_registry *reg,
+                                         unsigned long as_id,
+                                         unsigned long ip)
+{
+    struct addr_space *as = get_space(reg, as_id);
+    struct map_cache_entry *e = &reg->cache[reg->cache_next];
+    unsigned int i = range_index(as, ip);
+
+    reg->cache_next = (reg->cache_next + 1) % MAP_CACHE_SIZE;
+    e->as = as_id;
+
+    if (i < as->nr && as->ranges[i].start <= ip) {
+        e->start = as->ranges[i].start;
+        e->end = as->ranges[i].end;
+        e->ms = &as->ranges[i].ms;
+    } else {
+        /* The gap between the ranges around ip */
+        e->start = i ? as->ranges[i - 1].end : 0;
+        e->end = i < as->nr ? as->ranges[i].start : ~0UL;
+        e->ms = &as->whole;
+    }
+
+    return e;
+}
+
+static inline bool cache_hit(const struct map_cache_entry *e,
+                             unsigned long as, unsigned long ip)
+{
+    return e->ms && e->as == as && ip - e->start < e->end - e->start;
+}
+
+/* The cache entry for ip in as, filled in if it wasn't there */
+static inline struct map_cache_entry *lookup(struct map_registry *reg,
+                                            unsigned long as,
+                                            unsigned long ip)
+{
+    for (int i = 0; i < MAP_CACHE_SIZE; i++) {
+        if (cache_hit(&reg->cache[i], as, ip))
+            return &reg->cache[i];
+    }
+    return find_slow(reg, as, ip);
+}
+
+struct map_symbol *map_registry__find(struct map_registry *reg,
+                                      unsigned long as, unsigned long ip)
+{
+    return lookup(reg, as, ip)->ms;
+}
+
+struct map_symbol **map_registry__find_batch(struct map_registry *reg,
+                                             const struct callstack_entry *entries,
+                                             unsigned int nr)
+{
+    /* Neighbouring frames are mostly in the same map; check that first */
+    const struct map_cache_entry *last = NULL;
+
+    if (nr > reg->batch_sz)
+        reg->batch = grow_array(reg->batch, &reg->batch_sz, nr,
+                                sizeof(*reg->batch));
+
+    for (unsigned int i = 0; i < nr; i++) {
+        if (!last || !cache_hit(last, entries[i].map, entries[i].ip))
+            last = lookup(reg, entries[i].map, entries[i].ip);
+        reg->batch[i] = last->ms;
+    }
+
+    return reg->batch;
+}
+
+void map_registry__merge(struct map_registry *to, struct map_registry *from)
+{
+    for (unsigned int i = 0; i < from->nr; i++) {
+        struct addr_space *as = from->spaces[i].as;
+
+        get_space(to, as->id);
+        for (unsigned int j = 0; j < as->nr; j++)
+            map_registry__add(to, as->id, as->ranges[j].start,
+                              as->ranges[j].end);
+    }
+}
+
+unsigned long map_registry__nr_maps(const struct map_registry *reg)
+{
+    unsigned long nr = reg->nr;
+
+    for (unsigned int i = 0; i < reg->nr; i++)
+        nr += reg->spaces[i].as->nr;
+    return nr;
+}
+
+struct map_symbol *get_map(unsigned long as, unsigned long ip)
+{
+    return map_registry__find(map_registry, as, ip);
+}
+
+struct map_symbol **get_maps(const struct callstack_entry *entries,
+                             unsigned int nr)
+{
+    return map_registry__find_batch(map_registry, entries, nr);
+}
@@ -0,0 +1,136 @@
+#include <malloc.h>
+#include "mem_pool.h"
+
+void mem_pool__init(struct mem_pool *pool)
+{
+    pool->chunks = NULL;
+    pool->cur = pool->end = NULL;
+    pool->spare = NULL;
+    pool->chunk_size = MEM_POOL_CHUNK_MIN;
+    pool->total = 0;
+    pool->nr_objects = 0;
+    pool->object_bytes = 0;
+}
+
+/* A spare chunk with room for size bytes, if there's one */
+static struct mem_pool_chunk *mem_pool__get_spare(struct mem_pool *pool,
+                                                  size_t size)
+{
+    struct mem_pool_chunk *chunk;
+
+    /* Those too small for it were for big objects, they can go */
+    while ((chunk = pool->spare) != NULL) {
+        pool->spare = chunk->next;
+        if (chunk->size - sizeof(*chunk) >= size)
+            return chunk;
+        pool->total -= chunk->size;
+        cfree(chunk, MEM_POOL_CHUNK);
+    }
+    return NULL;
+}
+
+void *mem_pool__alloc_slow(struct mem_pool *pool, size_t size)
+{
+    size_t chunk_size;
+    struct mem_pool_chunk *chunk;
+
+    /* A zeroed pool is as good as an initialized one */
+    if (!pool->chunk_size)
+        pool->chunk_size = MEM_POOL_CHUNK_MIN;
+    chunk_size = pool->chunk_size;
+
+    chunk = mem_pool__get_spare(pool, size);
+    if (!chunk) {
+        /* An object bigger than a chunk gets a chunk of its own */
+        if (size > (chunk_size - sizeof(*chunk)) / 4)
+            chunk_size = size + sizeof(*chunk);
+
+        chunk = ccalloc(1, chunk_size, MEM_POOL_CHUNK);
+        if (!chunk)
+            return NULL;
+
+        /* Use whatever rounding up the allocator did too */
+        chunk->size = malloc_usable_size(chunk);
+
+        /*
+         * Grow the chunks with the pool, by a quarter of its size at a
+         * time: the newest chunk is the one that's only partly used, so
+         * that bounds what's wasted while keeping the number of chunks
+         * logarithmic
+         */
+        pool->total += chunk->size;
+        pool->chunk_size = pool->total / 4;
+        if (pool->chunk_size < MEM_POOL_CHUNK_MIN)
+            pool->chunk_size = MEM_POOL_CHUNK_MIN;
+        else if (pool->chunk_size > MEM_POOL_CHUNK_MAX)
+            pool->chunk_size = MEM_POOL_CHUNK_MAX;
+    }
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    /*
+     * Carry on from whichever chunk has more room left, so that a big
+     * object doesn't cost the rest of a chunk that has just been started
+     */
+    if ((size_t)((char *)chunk + chunk->size - (chunk->data + size)) >
+        (size_t)(pool->end - pool->cur)) {
+        pool->cur = chunk->data + size;
+        pool->end = (char *)chunk + chunk->size;
+    }
+    return chunk->data;
+}
+
+static void mem_pool__free_chunks(struct mem_pool_chunk *chunk)
+{
+    struct mem_pool_chunk *next;
+
+    for (; chunk; chunk = next) {
+        next = chunk->next;
+        cfree(chunk, MEM_POOL_CHUNK);
+    }
+}
+
+void mem_pool__release(struct mem_pool *pool)
+{
+    mem_pool__free_chunks(pool->chunks);
+    mem_pool__free_chunks(pool->spare);
+    mem_pool__init(pool);
+}
+
+void mem_pool__reset(struct mem_pool *pool, enum mem_type type)
+{
+    struct mem_account *acct = mem_account;
+    struct mem_stats *ms = &acct->types[type];
+    struct mem_pool_chunk *chunk, *next;
+
+    ms->frees += pool->nr_objects;
+    ms->live -= pool->object_bytes;
+    acct->pooled -= pool->object_bytes;
+    pool->nr_objects = 0;
+    pool->object_bytes = 0;
+
+    for (chunk = pool->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        chunk->next = pool->spare;
+        pool->spare = chunk;
+    }
+    pool->chunks = NULL;
+    pool->cur = pool->end = NULL;
+}
+
+void mem_pool__merge(struct mem_pool *to, struct mem_pool *from)
+{
+    struct mem_pool_chunk **tail = &to->chunks;
+
+    /* Append, so that to carries on allocating from its newest chunk */
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = from->chunks;
+    for (tail = &to->spare; *tail; tail = &(*tail)->next)
+        ;
+    *tail = from->spare;
+    to->total += from->total;
+    to->nr_objects += from->nr_objects;
+    to->object_bytes += from->object_bytes;
+    mem_pool__init(from);
+}
@@ -0,0 +1,396 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <perf/event.h>
+#include "callstack.h"
+#include "data/perf_data.h"
+
+/* "PERFILE2" */
+#define PERF_MAGIC2 0x32454c4946524550ULL
+
+/*
+ * On-disk layout of the start of a perf.data file. See
+ * lib/linux/header.h, which we can't include directly because it drags
+ * in most of perf.
+ */
+struct perf_file_section {
+    u64 offset;
+    u64 size;
+};
+
+struct perf_file_header {
+    u64 magic;
+    u64 size;
+    u64 attr_size;
+    struct perf_file_section attrs;
+    struct perf_file_section data;
+    struct perf_file_section event_types;
+};
+
+static bool in_file(struct perf_data_reader *reader, u64 offset, u64 size)
+{
+    return offset <= reader->size && size <= reader->size - offset;
+}
+
+/* The ids section trails the attr in the file */
+static const struct perf_file_section *
+attr_ids(struct perf_data_reader *reader, struct perf_file_header *header,
+         u64 i)
+{
+    const char *p = (char *)reader->base + header->attrs.offset +
+                    (i + 1) * header->attr_size;
+
+    return (const void *)(p - sizeof(struct perf_file_section));
+}
+
+static int cmp_ids(const void *a, const void *b)
+{
+    const struct perf_data_id *x = a, *y = b;
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/* Index the ids of every attr, to find the attr of a sample by its id */
+static int read_ids(struct perf_data_reader *reader,
+                    struct perf_file_header *header)
+{
+    unsigned long nr = 0;
+
+    for (u64 i = 0; i < reader->nr_attrs; i++) {
+        const struct perf_file_section *ids = attr_ids(reader, header, i);
+
+        if (!in_file(reader, ids->offset, ids->size)) {
+            fprintf(stderr, "perf.data: bad ids section of attr %lu\n", i);
+            return -1;
+        }
+        nr += ids->size / sizeof(u64);
+    }
+
+    reader->ids = ccalloc(nr ? nr : 1, sizeof(*reader->ids), MEM_OTHER);
+    if (!reader->ids)
+        die();
+
+    for (u64 i = 0; i < reader->nr_attrs; i++) {
+        const struct perf_file_section *ids = attr_ids(reader, header, i);
+        const u64 *id = (const u64 *)((char *)reader->base + ids->offset);
+
+        for (u64 j = 0; j < ids->size / sizeof(u64); j++) {
+            reader->ids[reader->nr_ids].id = id[j];
+            reader->ids[reader->nr_ids].attr = &reader->attrs[i];
+            reader->nr_ids++;
+        }
+    }
+
+    qsort(reader->ids, reader->nr_ids, sizeof(*reader->ids), cmp_ids);
+    return 0;
+}
+
+static int read_attrs(struct perf_data_reader *reader,
+                      struct perf_file_header *header)
+{
+    u64 nr;
+
+    if (!header->attr_size || !in_file(reader, header->attrs.offset,
+                                       header->attrs.size)) {
+        fprintf(stderr, "perf.data: bad attr section\n");
+        return -1;
+    }
+
+    nr = header->attrs.size / header->attr_size;
+    if (!nr || nr > PERF_DATA_MAX_ATTRS) {
+        fprintf(stderr, "perf.data: unsupported number of attrs: %lu\n", nr);
+        return -1;
+    }
+
+    reader->same_sample_type = true;
+    for (u64 i = 0; i < nr; i++) {
+        const char *p = (char *)reader->base + header->attrs.offset +
+                        i * header->attr_size;
+        const struct perf_event_attr *attr = (const void *)p;
+        struct perf_data_attr *a = &reader->attrs[i];
+
+        a->sample_type = attr->sample_type;
+        a->read_format = attr->read_format;
+
+        if (a->sample_type != reader->attrs[0].sample_type)
+            reader->same_sample_type = false;
+    }
+    reader->nr_attrs = nr;
+
+    if (!reader->same_sample_type) {
+        for (u64 i = 0; i < nr; i++) {
+            if (!(reader->attrs[i].sample_type & PERF_SAMPLE_IDENTIFIER)) {
+                fprintf(stderr, "perf.data: mixed sample types without "
+                        "PERF_SAMPLE_IDENTIFIER are not supported\n");
+                return -1;
+            }
+        }
+        return read_ids(reader, header);
+    }
+
+    return 0;
+}
+
+int perf_data__open(struct perf_data_reader *reader, const char *path)
+{
+    struct perf_file_header *header;
+    struct stat st;
+
+    memset(reader, 0, sizeof(*reader));
+
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (fstat(reader->fd, &st) < 0) {
+        perror(path);
+        goto err_close;
+    }
+
+    reader->size = st.st_size;
+    if (reader->size < sizeof(*header)) {
+        fprintf(stderr, "%s: too small to be a perf.data file\n", path);
+        goto err_close;
+    }
+
+    reader->base = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE,
+                        reader->fd, 0);
+    if (reader->base == MAP_FAILED) {
+        perror(path);
+        goto err_close;
+    }
+
+    /* We stream through the data section exactly once */
+    madvise(reader->base, reader->size, MADV_SEQUENTIAL);
+
+    header = reader->base;
+    if (header->magic != PERF_MAGIC2) {
+        fprintf(stderr, "%s: not a perf.data file (or pipe/cross-endian "
+                "format, which is unsupported)\n", path);
+        goto err_unmap;
+    }
+
+    if (read_attrs(reader, header) < 0)
+        goto err_unmap;
+
+    if (!in_file(reader, header->data.offset, header->data.size)) {
+        fprintf(stderr, "%s: truncated data section\n", path);
+        goto err_unmap;
+    }
+
+    reader->pos = (char *)reader->base + header->data.offset;
+    reader->end = reader->pos + header->data.size;
+    return 0;
+
+err_unmap:
+    cfree(reader->ids, MEM_OTHER);
+    munmap(reader->base, reader->size);
+err_close:
+    close(reader->fd);
+    return -1;
+}
+
+void perf_data__close(struct perf_data_reader *reader)
+{
+    cfree(reader->ids, MEM_OTHER);
+    munmap(reader->base, reader->size);
+    close(reader->fd);
+}
+
+static struct perf_data_attr *find_attr(struct perf_data_reader *reader,
+                                        u64 id)
+{
+    struct perf_data_id key = { .id = id }, *found;
+
+    found = bsearch(&key, reader->ids, reader->nr_ids, sizeof(key), cmp_ids);
+    return found ? found->attr : NULL;
+}
+
+/* Size in u64s of the PERF_SAMPLE_READ payload */
+static u64 read_format_size(u64 read_format, const u64 *p)
+{
+    u64 entry = 1;
+    u64 size = 0;
+
+    if (read_format & PERF_FORMAT_ID)
+        entry++;
+    if (read_format & PERF_FORMAT_LOST)
+        entry++;
+
+    if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+        size++;
+    if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+        size++;
+
+    if (read_format & PERF_FORMAT_GROUP)
+        return 1 + size + p[0] * entry;
+
+    return size + entry;
+}
+
+/*
+ * Walk the fixed fields of a PERF_RECORD_SAMPLE up to and including
+ * PERF_SAMPLE_CALLCHAIN. See the layout comment for PERF_RECORD_SAMPLE in
+ * uapi/linux/perf_event.h.
+ */
+static int parse_sample(struct perf_data_reader *reader,
+                        const struct perf_event_header *hdr,
+                        struct perf_data_sample *sample)
+{
+    const u64 *p = (const u64 *)(hdr + 1);
+    const u64 *end = (const u64 *)((const char *)hdr + hdr->size);
+    struct perf_data_attr *attr;
+    u64 type;
+
+    memset(sample, 0, sizeof(*sample));
+
+#define FIELD(dst) do { if (p >= end) return -1; (dst) = *p++; } while (0)
+#define SKIP(n) do { if ((u64)(end - p) < (n)) return -1; p += (n); } while (0)
+
+    if (reader->same_sample_type) {
+        attr = &reader->attrs[0];
+    } else {
+        /* PERF_SAMPLE_IDENTIFIER, which every attr has, comes first */
+        if (p >= end)
+            return -1;
+        attr = find_attr(reader, *p);
+        if (!attr) {
+            if (!reader->nr_unknown_id++)
+                fprintf(stderr, "perf.data: sample id %llu at offset %lu "
+                        "is in no attr's ids, skipping samples like it\n",
+                        (unsigned long long)*p,
+                        (unsigned long)((const char *)hdr - (char *)reader->base));
+            return 0;
+        }
+    }
+
+    type = attr->sample_type;
+    if (!(type & PERF_SAMPLE_CALLCHAIN))
+        return 0;
+
+    if (type & PERF_SAMPLE_IDENTIFIER)
+        FIELD(sample->id);
+    if (type & PERF_SAMPLE_IP)
+        FIELD(sample->ip);
+    if (type & PERF_SAMPLE_TID)
+        FIELD(sample->pid);
+    if (type & PERF_SAMPLE_TIME)
+        SKIP(1);
+    if (type & PERF_SAMPLE_ADDR)
+        SKIP(1);
+    if (type & PERF_SAMPLE_ID)
+        FIELD(sample->id);
+    if (type & PERF_SAMPLE_STREAM_ID)
+        SKIP(1);
+    if (type & PERF_SAMPLE_CPU)
+        SKIP(1);
+    if (type & PERF_SAMPLE_PERIOD)
+        SKIP(1);
+    if (type & PERF_SAMPLE_READ) {
+        if (p >= end)
+            return -1;
+        SKIP(read_format_size(attr->read_format, p));
+    }
+
+    /* PERF_SAMPLE_CALLCHAIN */
+    FIELD(sample->nr);
+    sample->ips = p;
+    if (sample->nr > (u64)(end - p))
+        return -1;
+
+#undef FIELD
+#undef SKIP
+
+    return 1;
+}
+
+/* Whether the callchain has an ip, not only context markers */
+static bool has_frames(const struct perf_data_sample *sample)
+{
+    for (u64 i = 0; i < sample->nr; i++) {
+        if (sample->ips[i] < PERF_CONTEXT_MAX)
+            return true;
+    }
+    return false;
+}
+
+/* PERF_RECORD_MMAP and MMAP2 agree on everything up to pgoff */
+static int parse_mmap(struct perf_data_reader *reader,
+                      const struct perf_event_header *hdr)
+{
+    const struct perf_record_mmap *ev = (const void *)hdr;
+    struct perf_data_mmap mmap;
+
+    if (hdr->size < offsetof(struct perf_record_mmap, filename))
+        return -1;
+
+    switch (hdr->misc & PERF_RECORD_MISC_CPUMODE_MASK) {
+    case PERF_RECORD_MISC_KERNEL:
+        mmap.as = PERF_CONTEXT_KERNEL;
+        break;
+    case PERF_RECORD_MISC_GUEST_KERNEL:
+        mmap.as = PERF_CONTEXT_GUEST_KERNEL;
+        break;
+    case PERF_RECORD_MISC_GUEST_USER:
+        mmap.as = PERF_CONTEXT_GUEST_USER;
+        break;
+    default:
+        mmap.as = ev->pid;
+        break;
+    }
+
+    mmap.start = ev->start;
+    mmap.len = ev->len;
+    mmap.pgoff = ev->pgoff;
+    reader->mmap_cb(&mmap);
+    return 0;
+}
+
+int perf_data__next(struct perf_data_reader *reader,
+                    struct perf_data_sample *sample)
+{
+    while (reader->pos + sizeof(struct perf_event_header) <= reader->end) {
+        const struct perf_event_header *hdr = (const void *)reader->pos;
+        int ret;
+
+        if (hdr->size < sizeof(*hdr) ||
+            hdr->size > (size_t)(reader->end - reader->pos)) {
+            fprintf(stderr, "perf.data: bad record size %u at offset %lu\n",
+                    hdr->size,
+                    (unsigned long)(reader->pos - (char *)reader->base));
+            return -1;
+        }
+        reader->pos += hdr->size;
+
+        if (hdr->type != PERF_RECORD_SAMPLE) {
+            if ((hdr->type == PERF_RECORD_MMAP ||
+                 hdr->type == PERF_RECORD_MMAP2) && reader->mmap_cb &&
+                parse_mmap(reader, hdr) < 0) {
+                fprintf(stderr, "perf.data: truncated mmap at offset %lu\n",
+                        (unsigned long)((char *)hdr - (char *)reader->base));
+                return -1;
+            }
+            reader->nr_skipped++;
+            continue;
+        }
+
+        ret = parse_sample(reader, hdr, sample);
+        if (ret < 0) {
+            fprintf(stderr, "perf.data: truncated sample at offset %lu\n",
+                    (unsigned long)((char *)hdr - (char *)reader->base));
+            return -1;
+        }
+        if (ret && has_frames(sample))
+            return 1;
+
+        reader->nr_skipped++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "callchain.h"
+#include "callstack.h"
+#include "report.h"
+
+const char *report_mode_names[NR_REPORT_MODES] = {
+    [REPORT_GRAPH_ABS] = "graph_abs",
+    [REPORT_GRAPH_REL] = "graph_rel",
+    [REPORT_FLAT]      = "flat",
+    [REPORT_FOLDED]    = "folded",
+};
+
+static const enum chain_mode chain_modes[NR_REPORT_MODES] = {
+    [REPORT_GRAPH_ABS] = CHAIN_GRAPH_ABS,
+    [REPORT_GRAPH_REL] = CHAIN_GRAPH_REL,
+    [REPORT_FLAT]      = CHAIN_FLAT,
+    [REPORT_FOLDED]    = CHAIN_FOLDED,
+};
+
+/* Lines longer than this are cut short */
+#define REPORT_LINE_MAX 1024
+
+void report__init(struct report *report)
+{
+    memset(report, 0, sizeof(*report));
+    report->min_percent = callchain_param_default.min_percent;
+}
+
+void report__exit(struct report *report)
+{
+    cfree(report->roots, MEM_OTHER);
+    cfree(report->sorted, MEM_OTHER);
+    report__init(report);
+}
+
+void report__add(struct report *report, struct callchain_root *root)
+{
+    if (report->nr == report->alloc) {
+        unsigned long alloc = report->alloc ? report->alloc * 2 : 64;
+        struct callchain_root **roots;
+        struct callchain_sorted *sorted;
+
+        roots = ccalloc(alloc, sizeof(*roots), MEM_OTHER);
+        sorted = ccalloc(alloc, sizeof(*sorted), MEM_OTHER);
+        if (!roots || !sorted)
+            die();
+        if (report->nr)
+            memcpy(roots, report->roots, report->nr * sizeof(*roots));
+        cfree(report->roots, MEM_OTHER);
+        cfree(report->sorted, MEM_OTHER);
+        report->roots = roots;
+        report->sorted = sorted;
+        report->alloc = alloc;
+    }
+
+    report->roots[report->nr++] = root;
+    report->total_hits += callchain_cumul_hits(&root->node);
+}
+
+void report__sort(struct report *report, enum report_mode mode,
+                  unsigned int nr_threads)
+{
+    struct callchain_param param = callchain_param_default;
+    u64 min_hit = report->total_hits * (report->min_percent / 100);
+
+    param.mode = chain_modes[mode];
+    param.min_percent = report->min_percent;
+    if (callchain_register_param(&param) < 0)
+        die();
+
+    callchain_sort_trees(report->roots, report->sorted, report->nr, min_hit,
+                         &param, nr_threads);
+    report->mode = mode;
+}
+
+/* A line being formatted, and the count of those done */
+struct output {
+    struct report_output *out;
+    char line[REPORT_LINE_MAX];
+};
+
+static inline void emit(struct output *o, int len)
+{
+    o->out->lines++;
+    o->out->bytes += len < REPORT_LINE_MAX ? len : REPORT_LINE_MAX - 1;
+}
+
+static inline double percent(u64 hits, u64 total)
+{
+    return total ? 100.0 * hits / total : 0.0;
+}
+
+/*
+ * Append what a frame prints as without symbols, its address and map, to
+ * the len bytes of the line so far
+ */
+static inline int append_frame(struct output *o, int len,
+                               const struct callchain_list *val)
+{
+    if (len >= REPORT_LINE_MAX - 1)
+        return len;
+    return len + snprintf(o->line + len, REPORT_LINE_MAX - len,
+                          "%#" PRIx64 " [%p]", val->ip, (void *)val->ms.map);
+}
+
+/*
+ * The children of node as a graph below it, depth levels in. The first
+ * frame of every child carries its share of total, the others are
+ * indented under it. In the relative mode the share is of the parent's.
+ */
+static void output_graph(struct output *o, struct callchain_node *node,
+                         u64 total, unsigned int depth, bool rel)
+{
+    if (rel)
+        total = node->children_hit;
+
+    for (unsigned int i = 0; i < node->sorted.nr; i++) {
+        struct callchain_node *child = node->sorted.nodes[i];
+        unsigned int indent = depth * 11 + 1;
+
+        for (unsigned int v = 0; v < child->val_nr; v++) {
+            int len;
+
+            if (!v)
+                len = snprintf(o->line, REPORT_LINE_MAX, "%*s|--%5.2f%%--",
+                               indent, "",
+                               percent(callchain_cumul_hits(child), total));
+            else
+                len = snprintf(o->line, REPORT_LINE_MAX, "%*s|          ",
+                               indent, "");
+            emit(o, append_frame(o, len, &child->val[v]));
+        }
+
+        output_graph(o, child, total, depth + 1, rel);
+    }
+}
+
+/* The frames from the root down to node, one line each */
+static void output_flat_frames(struct output *o, struct callchain_node *node)
+{
+    if (node->parent)
+        output_flat_frames(o, node->parent);
+
+    for (unsigned int v = 0; v < node->val_nr; v++) {
+        int len = snprintf(o->line, REPORT_LINE_MAX, "%16s", "");
+
+        emit(o, append_frame(o, len, &node->val[v]));
+    }
+}
+
+/* The frames from the root down to node, appended to the line after len */
+static int output_folded_frames(struct output *o, struct callchain_node *node,
+                                int len)
+{
+    if (node->parent)
+        len = output_folded_frames(o, node->parent, len);
+
+    for (unsigned int v = 0; v < node->val_nr; v++) {
+        if (len >= REPORT_LINE_MAX - 1)
+            break;
+        if (o->line[len - 1] != ' ')
+            o->line[len++] = ';';
+        len = append_frame(o, len, &node->val[v]);
+    }
+
+    return len;
+}
+
+/*
+ * One tree: a line for the entry itself, then its callchains. For flat
+ * and folded output the sort picked the nodes to show, each being the
+ * whole chain from the root down to it.
+ */
+static void output_tree(struct output *o, struct report *report,
+                        struct callchain_root *root,
+                        struct callchain_sorted *sorted)
+{
+    u64 total = callchain_cumul_hits(&root->node);
+
+    emit(o, snprintf(o->line, REPORT_LINE_MAX, "%6.2f%%  [tree %p]",
+                     percent(total, report->total_hits), (void *)root));
+
+    switch (report->mode) {
+    case REPORT_GRAPH_ABS:
+    case REPORT_GRAPH_REL:
+        output_graph(o, &root->node, total, 0,
+                     report->mode == REPORT_GRAPH_REL);
+        break;
+    case REPORT_FLAT:
+        for (unsigned int i = 0; i < sorted->nr; i++) {
+            struct callchain_node *node = sorted->nodes[i];
+
+            emit(o, snprintf(o->line, REPORT_LINE_MAX, "%16.2f%%",
+                             percent(node->hit, total)));
+            output_flat_frames(o, node);
+        }
+        break;
+    case REPORT_FOLDED:
+        for (unsigned int i = 0; i < sorted->nr; i++) {
+            struct callchain_node *node = sorted->nodes[i];
+            int len = snprintf(o->line, REPORT_LINE_MAX, "%.2f%% ",
+                               percent(node->hit, total));
+
+            emit(o, output_folded_frames(o, node, len));
+        }
+        break;
+    case NR_REPORT_MODES:
+        break;
+    }
+}
+
+void report__output(struct report *report, struct report_output *out)
+{
+    struct output o = { .out = out };
+
+    memset(out, 0, sizeof(*out));
+    for (unsigned long i = 0; i < report->nr; i++)
+        output_tree(&o, report, report->roots[i], &report->sorted[i]);
+}
@@ -0,0 +1,351 @@
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "data/synth.h"
+
+static inline uint64_t mix64(uint64_t x)
+{
+	/* splitmix64 finaliser */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t rng_next(uint64_t *state)
+{
+	/* xorshift64* */
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static inline double rng_double(uint64_t *state)
+{
+	return (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+static double rng_normal(uint64_t *state, double mean, double stddev)
+{
+	double u1 = rng_double(state), u2 = rng_double(state);
+
+	return mean + stddev * sqrt(-2.0 * log(1.0 - u1)) * cos(2 * M_PI * u2);
+}
+
+/* A finite number that is the whole of val */
+static int parse_double(const char *val, double *out)
+{
+	char *end;
+	double v = strtod(val, &end);
+
+	if (end == val || *end || !isfinite(v))
+		return -1;
+	*out = v;
+	return 0;
+}
+
+/* Counts can be written like 1e6, but have to be whole */
+static int parse_ulong(const char *val, unsigned long *out)
+{
+	double v;
+
+	if (parse_double(val, &v) || v < 0 || v >= 0x1p64 || v != floor(v))
+		return -1;
+	*out = (unsigned long)v;
+	return 0;
+}
+
+static int parse_uint(const char *val, unsigned int *out)
+{
+	unsigned long v;
+
+	if (parse_ulong(val, &v) || v > UINT_MAX)
+		return -1;
+	*out = v;
+	return 0;
+}
+
+int synth_parse(struct synth_params *params, const char *arg)
+{
+	char *str = strdup(arg), *saveptr = NULL, *tok;
+	int ret = 0;
+
+	if (!str)
+		die();
+
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		char *val = strchr(tok, '=');
+		char *end;
+
+		if (!val) {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "seed")) {
+			params->seed = strtoull(val, &end, 0);
+			if (end == val || *end)
+				ret = -1;
+		} else if (!strcmp(tok, "samples")) {
+			ret = parse_ulong(val, &params->samples);
+		} else if (!strcmp(tok, "unique")) {
+			ret = parse_ulong(val, &params->unique);
+		} else if (!strcmp(tok, "depth")) {
+			/* mean[:stddev] */
+			char *stddev = strchr(val, ':');
+
+			if (stddev)
+				*stddev++ = '\0';
+			ret = parse_double(val, &params->depth_mean);
+			if (!ret && stddev)
+				ret = parse_double(stddev, &params->depth_stddev);
+		} else if (!strcmp(tok, "max_depth")) {
+			ret = parse_uint(val, &params->max_depth);
+		} else if (!strcmp(tok, "fanout")) {
+			ret = parse_uint(val, &params->fanout);
+		} else if (!strcmp(tok, "zipf")) {
+			ret = parse_double(val, &params->zipf);
+		} else if (!strcmp(tok, "ids")) {
+			ret = parse_ulong(val, &params->ids);
+		} else if (!strcmp(tok, "maps")) {
+			ret = parse_uint(val, &params->maps);
+		} else if (!strcmp(tok, "kernel")) {
+			ret = parse_double(val, &params->kernel);
+		} else {
+			ret = -1;
+		}
+
+		if (ret)
+			break;
+	}
+	free(str);
+
+	if (!params->unique || !params->fanout || !params->ids ||
+	    !params->maps || !params->max_depth || params->depth_stddev < 0 ||
+	    params->kernel < 0 || params->kernel > 1)
+		ret = -1;
+
+	if (ret)
+		fprintf(stderr, "Invalid synthetic workload: %s\n", arg);
+	return ret;
+}
+
+/*
+ * The ip of a frame only depends on the path from the outermost caller,
+ * so stacks that share a path share frames.
+ */
+static struct callstack_entry make_frame(const struct synth_params *params,
+					 uint64_t path, bool kernel)
+{
+	struct callstack_entry entry;
+	uint64_t h = mix64(path);
+
+	if (kernel) {
+		entry.ip = 0xffffffff81000000UL + (h & 0xffffff);
+		entry.map = SYNTH_KERNEL_MAP;
+	} else {
+		unsigned int m = h % params->maps;
+
+		/* Each user map covers its own 256 MB of address space */
+		entry.ip = 0x7f0000000000UL + ((uint64_t)m << 28) +
+			   ((h >> 16) & 0xfffffff);
+		entry.map = SYNTH_KERNEL_MAP + 1 + m;
+	}
+
+	/* Keep ips 16-byte aligned and non-zero */
+	entry.ip = (entry.ip & ~0xfUL) | 0x10;
+	return entry;
+}
+
+/* Give up on finding another distinct stack after this many repeats */
+#define MAX_REPEATS	1000
+
+static uint64_t hash_stack(const struct callstack_entry *frames,
+			   unsigned int depth)
+{
+	uint64_t h = depth;
+
+	for (unsigned int i = 0; i < depth; i++)
+		h = mix64(h ^ frames[i].ip) + frames[i].map;
+
+	/* 0 marks an empty slot of the seen set */
+	return h ? h : 1;
+}
+
+/*
+ * Add h to the open addressed set of stack hashes, of size mask + 1.
+ * Returns false if it was there already.
+ */
+static bool seen_add(uint64_t *seen, unsigned long mask, uint64_t h)
+{
+	unsigned long i;
+
+	for (i = h & mask; seen[i]; i = (i + 1) & mask) {
+		if (seen[i] == h)
+			return false;
+	}
+	seen[i] = h;
+	return true;
+}
+
+/*
+ * Random paths through the call graph repeat, often so with a small
+ * fanout or depth, so stacks are drawn until ->unique of them are
+ * distinct. If the graph runs out of stacks first, ->unique is lowered
+ * to the number there is.
+ */
+static void build_pool(struct synth *synth, enum stack_format format)
+{
+	struct synth_params *params = &synth->params;
+	struct callstack_entry *frames;
+	const struct packed_record *rec;
+	uint64_t state = mix64(params->seed ^ 0x706f6f6cULL) | 1;
+	unsigned long i = 0, n = 0, repeats = 0, mask = 1;
+	uint64_t *seen;
+
+	while (mask < 2 * params->unique)
+		mask <<= 1;
+
+	frames = calloc(params->max_depth, sizeof(*frames));
+	seen = calloc(mask, sizeof(*seen));
+	if (!frames || !seen)
+		die();
+	mask--;
+
+	record_buf__init(&synth->pool, format);
+
+	while (n < params->unique && repeats < MAX_REPEATS) {
+		double d = rng_normal(&state, params->depth_mean, params->depth_stddev);
+		unsigned int depth, nr_kernel;
+		uint64_t path = params->seed;
+		struct stack stack = {
+			.format = STACK_FMT_ENTRIES,
+			.data = frames,
+		};
+
+		depth = d < 1 ? 1 : d > params->max_depth ? params->max_depth : d;
+		nr_kernel = lround(depth * params->kernel);
+
+		/*
+		 * Walk from the outermost caller, which is the last frame of
+		 * a perf callchain, towards the leaf.
+		 */
+		for (unsigned int level = 0; level < depth; level++) {
+			uint64_t callee = rng_next(&state) % params->fanout;
+
+			path = mix64(path + callee + 1) ^ level;
+			frames[depth - level - 1] =
+				make_frame(params, path, level >= depth - nr_kernel);
+		}
+
+		if (!seen_add(seen, mask, hash_stack(frames, depth))) {
+			repeats++;
+			continue;
+		}
+		repeats = 0;
+		n++;
+
+		/* perf keeps one tree per sampled symbol, i.e. per leaf */
+		stack.id = 0x1000 + mix64(frames[0].ip) % params->ids;
+		stack.nr = depth;
+		stack.len = depth * sizeof(*frames);
+		record_buf__append(&synth->pool, &stack);
+	}
+	free(frames);
+	free(seen);
+
+	if (n < params->unique) {
+		fprintf(stderr, "Synthetic workload: only %lu distinct stacks "
+			"of unique=%lu, raise fanout or depth for more\n",
+			n, params->unique);
+		params->unique = n;
+	}
+
+	/* Random access into the pool for synth_next() */
+	synth->index = calloc(params->unique, sizeof(*synth->index));
+	if (!synth->index)
+		die();
+
+	for (rec = record_buf__first(&synth->pool); rec;
+	     rec = record_buf__next(&synth->pool, rec))
+		synth->index[i++] = rec;
+}
+
+static void build_cdf(struct synth *synth)
+{
+	unsigned long n = synth->params.unique;
+	double sum = 0;
+
+	synth->cdf = calloc(n, sizeof(*synth->cdf));
+	if (!synth->cdf)
+		die();
+
+	/* Pool order is already random so rank i is simply pool entry i */
+	for (unsigned long i = 0; i < n; i++) {
+		sum += pow(i + 1, -synth->params.zipf);
+		synth->cdf[i] = sum;
+	}
+
+	for (unsigned long i = 0; i < n; i++)
+		synth->cdf[i] /= sum;
+}
+
+void synth_init(struct synth *synth, const struct synth_params *params,
+		enum stack_format format)
+{
+	memset(synth, 0, sizeof(*synth));
+	synth->params = *params;
+
+	build_pool(synth, format);
+	build_cdf(synth);
+}
+
+void synth_exit(struct synth *synth)
+{
+	record_buf__exit(&synth->pool);
+	free(synth->index);
+	free(synth->cdf);
+}
+
+void synth_stream_init(struct synth_stream *stream, const struct synth *synth)
+{
+	stream->synth = synth;
+	stream->rng = mix64(synth->params.seed) | 1;
+	stream->emitted = 0;
+}
+
+bool synth_next(struct synth_stream *stream, struct stack *stack)
+{
+	const struct synth *synth = stream->synth;
+	unsigned long lo = 0, hi = synth->params.unique - 1;
+	double u;
+
+	if (stream->emitted == synth->params.samples)
+		return false;
+
+	/* Lower bound of u in the CDF */
+	u = rng_double(&stream->rng);
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (synth->cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	record_buf__stack(&synth->pool, synth->index[lo], stack);
+	stream->emitted++;
+	return true;
+}
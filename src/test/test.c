@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "../perf_data.c"
+
+typedef void (*funcptr)(void);
+
+#define SAMPLE_TYPE	(PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN)
+
+/* A perf.data file with one attr of SAMPLE_TYPE */
+struct file {
+	char buf[4096];
+	size_t len;
+};
+
+static void file_init(struct file *f)
+{
+	struct perf_file_header *header = (void *)f->buf;
+	struct perf_event_attr *attr;
+
+	memset(f, 0, sizeof(*f));
+	header->magic = PERF_MAGIC2;
+	header->size = sizeof(*header);
+	header->attr_size = sizeof(*attr) + sizeof(struct perf_file_section);
+	header->attrs.offset = sizeof(*header);
+	header->attrs.size = header->attr_size;
+
+	attr = (void *)(f->buf + header->attrs.offset);
+	attr->size = sizeof(*attr);
+	attr->sample_type = SAMPLE_TYPE;
+
+	f->len = header->attrs.offset + header->attrs.size;
+	header->data.offset = f->len;
+}
+
+static void file_add_sample(struct file *f, u64 ip, const u64 *chain, u64 nr)
+{
+	struct perf_file_header *header = (void *)f->buf;
+	struct perf_event_header *hdr = (void *)(f->buf + f->len);
+	u64 *p = (u64 *)(hdr + 1);
+
+	hdr->type = PERF_RECORD_SAMPLE;
+	*p++ = ip;
+	*p++ = 42;
+	*p++ = nr;
+	memcpy(p, chain, nr * sizeof(*chain));
+	hdr->size = (char *)(p + nr) - (char *)hdr;
+
+	f->len += hdr->size;
+	assert(f->len <= sizeof(f->buf));
+	header->data.size = f->len - header->data.offset;
+}
+
+static void file_open(struct file *f, struct perf_data_reader *reader)
+{
+	char path[] = "/tmp/perf_data_test.XXXXXX";
+	int fd = mkstemp(path);
+
+	assert(fd >= 0);
+	assert(write(fd, f->buf, f->len) == (ssize_t)f->len);
+	close(fd);
+
+	assert(perf_data__open(reader, path) == 0);
+	unlink(path);
+}
+
+// A sample and its callchain, in place
+static void test0(void)
+{
+	u64 chain[] = { PERF_CONTEXT_USER, 0x1000, 0x2000 };
+	struct perf_data_reader reader;
+	struct perf_data_sample sample;
+	struct file f;
+
+	file_init(&f);
+	file_add_sample(&f, 0x1000, chain, 3);
+	file_open(&f, &reader);
+
+	assert(perf_data__next(&reader, &sample) == 1);
+	assert(sample.ip == 0x1000);
+	assert(sample.pid == 42);
+	assert(sample.nr == 3);
+	assert(sample.ips[2] == 0x2000);
+	assert(perf_data__next(&reader, &sample) == 0);
+	assert(reader.nr_skipped == 0);
+
+	perf_data__close(&reader);
+}
+
+// Callchains without an ip in them are skipped
+static void test1(void)
+{
+	u64 markers[] = { PERF_CONTEXT_KERNEL, PERF_CONTEXT_USER };
+	u64 chain[] = { PERF_CONTEXT_KERNEL, 0xffffffff81000010ULL };
+	struct perf_data_reader reader;
+	struct perf_data_sample sample;
+	struct file f;
+
+	file_init(&f);
+	file_add_sample(&f, 0x1000, markers, 2);
+	file_add_sample(&f, 0x1000, NULL, 0);
+	file_add_sample(&f, 0x2000, chain, 2);
+	file_add_sample(&f, 0x3000, markers, 1);
+	file_open(&f, &reader);
+
+	assert(perf_data__next(&reader, &sample) == 1);
+	assert(sample.ip == 0x2000);
+	assert(perf_data__next(&reader, &sample) == 0);
+	assert(reader.nr_skipped == 3);
+
+	perf_data__close(&reader);
+}
+
+// A callchain running past its record
+static void test2(void)
+{
+	u64 chain[] = { 0x1000, 0x2000 };
+	struct perf_data_reader reader;
+	struct perf_data_sample sample;
+	struct perf_event_header *hdr;
+	struct file f;
+
+	file_init(&f);
+	hdr = (void *)(f.buf + f.len);
+	file_add_sample(&f, 0x1000, chain, 2);
+	((u64 *)(hdr + 1))[2] = 3;
+	file_open(&f, &reader);
+
+	assert(perf_data__next(&reader, &sample) == -1);
+
+	perf_data__close(&reader);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int num_tests = 0;
+	funcptr tests[] = {
+		test0,
+		test1,
+		test2,
+		NULL,
+	};
+
+	for (funcptr *f = tests; *f != NULL; f++, num_tests++) {
+		(*f)();
+	}
+
+	printf("Ran %u tests\n", num_tests);
+	return 0;
+}
+
+// vim: ts=8 sw=8 noexpandtab
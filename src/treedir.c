@@ -0,0 +1,285 @@
+#include <linux/rbtree.h>
+#include "cs_stats.h"
+#include "treedir.h"
+
+/* Red-black tree */
+
+struct rb_treedir {
+    struct treedir dir;
+    struct rb_root_cached entries;
+};
+
+struct tree {
+    unsigned long id;
+    struct callstack_tree *cs_tree;
+    struct rb_node node;
+};
+
+static struct treedir *rb_treedir_new(void)
+{
+    struct rb_treedir *d = ccalloc(1, sizeof(*d), MEM_TREE_DIR);
+
+    if (!d)
+        die();
+
+    d->entries = RB_ROOT_CACHED;
+    return &d->dir;
+}
+
+static struct callstack_tree **rb_treedir_get(struct treedir *dir,
+                                              unsigned long id)
+{
+    struct rb_treedir *d = container_of(dir, struct rb_treedir, dir);
+    struct rb_node **p = &d->entries.rb_root.rb_node;
+    struct rb_node *parent = NULL;
+    struct tree *tree;
+    bool leftmost = true;
+
+    while (*p != NULL) {
+        parent = *p;
+        tree = rb_entry(parent, struct tree, node);
+        cs_stat_inc(CS_STAT_DIR_PROBES);
+
+        if (tree->id < id)
+            p = &(*p)->rb_left;
+        else if (tree->id > id) {
+            p = &(*p)->rb_right;
+            leftmost = false;
+        } else
+            return &tree->cs_tree;
+    }
+
+    tree = ccalloc(1, sizeof(*tree), MEM_TREE_DIR);
+    if (!tree)
+        die();
+
+    tree->id = id;
+    rb_link_node(&tree->node, parent, p);
+    rb_insert_color_cached(&tree->node, &d->entries, leftmost);
+    dir->nr++;
+    return &tree->cs_tree;
+}
+
+static void rb_treedir_for_each(struct treedir *dir,
+                                void (*fn)(unsigned long id,
+                                           struct callstack_tree *tree,
+                                           void *arg),
+                                void *arg)
+{
+    struct rb_treedir *d = container_of(dir, struct rb_treedir, dir);
+    struct rb_node *node;
+
+    for (node = rb_first_cached(&d->entries); node; node = rb_next(node)) {
+        struct tree *tree = rb_entry(node, struct tree, node);
+
+        fn(tree->id, tree->cs_tree, arg);
+    }
+}
+
+static void rb_treedir_free(struct treedir *dir)
+{
+    struct rb_treedir *d = container_of(dir, struct rb_treedir, dir);
+    struct tree *tree, *tmp;
+
+    rbtree_postorder_for_each_entry_safe(tree, tmp, &d->entries.rb_root, node)
+        cfree(tree, MEM_TREE_DIR);
+    cfree(d, MEM_TREE_DIR);
+}
+
+struct treedir_ops rbtree_treedir_ops = {
+    .name = "rbtree",
+    .new = rb_treedir_new,
+    .get = rb_treedir_get,
+    .for_each = rb_treedir_for_each,
+    .free = rb_treedir_free,
+};
+
+/* Open addressing */
+
+#define HASH_TREEDIR_MIN        64
+/* Old slots moved to the new table by every lookup while growing */
+#define HASH_TREEDIR_MIGRATE    8
+
+/* Empty if tree is NULL */
+struct treedir_slot {
+    unsigned long id;
+    struct callstack_tree *tree;
+};
+
+struct hash_treedir {
+    struct treedir dir;
+
+    struct treedir_slot *slots;
+    unsigned long mask;
+    /* Slots in use in slots[] */
+    unsigned long used;
+
+    /*
+     * The table being grown out of, NULL if we aren't growing. Slots
+     * below migrated have been copied to slots[], but are left in place
+     * so that probe sequences in old[] stay intact.
+     */
+    struct treedir_slot *old;
+    unsigned long old_mask;
+    unsigned long migrated;
+};
+
+static inline unsigned long hash_treedir_hash(unsigned long id)
+{
+    /* The hash_64() multiplier; ids are often small and sequential */
+    return (id * 0x61C8864680B583EBull) >> 32;
+}
+
+/* The slot holding id, or the empty slot where it would go */
+static inline struct treedir_slot *hash_treedir_probe(struct treedir_slot *slots,
+                                                      unsigned long mask,
+                                                      unsigned long id)
+{
+    unsigned long i = hash_treedir_hash(id) & mask;
+
+    for (;;) {
+        struct treedir_slot *slot = &slots[i];
+
+        cs_stat_inc(CS_STAT_DIR_PROBES);
+        if (!slot->tree || slot->id == id)
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static struct treedir_slot *hash_treedir_alloc(unsigned long nr)
+{
+    struct treedir_slot *slots = ccalloc(nr, sizeof(*slots), MEM_TREE_DIR);
+
+    if (!slots)
+        die();
+    return slots;
+}
+
+static void hash_treedir_migrate(struct hash_treedir *d, unsigned long nr)
+{
+    unsigned long end = d->migrated + nr;
+
+    if (end > d->old_mask + 1)
+        end = d->old_mask + 1;
+
+    for (; d->migrated < end; d->migrated++) {
+        struct treedir_slot *from = &d->old[d->migrated];
+        struct treedir_slot *to;
+
+        if (!from->tree)
+            continue;
+
+        to = hash_treedir_probe(d->slots, d->mask, from->id);
+        *to = *from;
+        d->used++;
+    }
+
+    if (d->migrated > d->old_mask) {
+        cfree(d->old, MEM_TREE_DIR);
+        d->old = NULL;
+    }
+}
+
+/*
+ * Start moving everything to a table twice the size. The new table is
+ * at most a quarter full when we start and takes a few more slots per
+ * lookup, so it's done long before the new table fills up.
+ */
+static void hash_treedir_grow(struct hash_treedir *d)
+{
+    /* Only if lookups were so few that the last grow hasn't finished */
+    if (d->old)
+        hash_treedir_migrate(d, d->old_mask + 1);
+
+    d->old = d->slots;
+    d->old_mask = d->mask;
+    d->migrated = 0;
+
+    d->mask = (d->mask + 1) * 2 - 1;
+    d->slots = hash_treedir_alloc(d->mask + 1);
+    d->used = 0;
+}
+
+static struct treedir *hash_treedir_new(void)
+{
+    struct hash_treedir *d = ccalloc(1, sizeof(*d), MEM_TREE_DIR);
+
+    if (!d)
+        die();
+
+    d->mask = HASH_TREEDIR_MIN - 1;
+    d->slots = hash_treedir_alloc(HASH_TREEDIR_MIN);
+    return &d->dir;
+}
+
+static struct callstack_tree **hash_treedir_get(struct treedir *dir,
+                                                unsigned long id)
+{
+    struct hash_treedir *d = container_of(dir, struct hash_treedir, dir);
+    struct treedir_slot *slot;
+
+    if (unlikely(d->old))
+        hash_treedir_migrate(d, HASH_TREEDIR_MIGRATE);
+
+    slot = hash_treedir_probe(d->slots, d->mask, id);
+    if (likely(slot->tree))
+        return &slot->tree;
+
+    if (d->old) {
+        struct treedir_slot *old = hash_treedir_probe(d->old, d->old_mask, id);
+
+        if (old->tree)
+            return &old->tree;
+    }
+
+    /* A new id. Keep the load factor at or below 1/2 */
+    if ((d->used + 1) * 2 > d->mask + 1) {
+        hash_treedir_grow(d);
+        slot = hash_treedir_probe(d->slots, d->mask, id);
+    }
+
+    slot->id = id;
+    d->used++;
+    dir->nr++;
+    return &slot->tree;
+}
+
+static void hash_treedir_for_each(struct treedir *dir,
+                                  void (*fn)(unsigned long id,
+                                           struct callstack_tree *tree,
+                                           void *arg),
+                                  void *arg)
+{
+    struct hash_treedir *d = container_of(dir, struct hash_treedir, dir);
+
+    for (unsigned long i = 0; i <= d->mask; i++) {
+        if (d->slots[i].tree)
+            fn(d->slots[i].id, d->slots[i].tree, arg);
+    }
+
+    if (!d->old)
+        return;
+
+    for (unsigned long i = d->migrated; i <= d->old_mask; i++) {
+        if (d->old[i].tree)
+            fn(d->old[i].id, d->old[i].tree, arg);
+    }
+}
+
+static void hash_treedir_free(struct treedir *dir)
+{
+    struct hash_treedir *d = container_of(dir, struct hash_treedir, dir);
+
+    cfree(d->old, MEM_TREE_DIR);
+    cfree(d->slots, MEM_TREE_DIR);
+    cfree(d, MEM_TREE_DIR);
+}
+
+struct treedir_ops hash_treedir_ops = {
+    .name = "hash",
+    .new = hash_treedir_new,
+    .get = hash_treedir_get,
+    .for_each = hash_treedir_for_each,
+    .free = hash_treedir_free,
+};
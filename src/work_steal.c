@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "callstack.h"
+#include "cs_stats.h"
+#include "work_steal.h"
+
+/*
+ * The tasks a thread has left, [begin, end), packed into one word so that
+ * the owner taking one from the front and a thief taking half from the
+ * back are both a single compare-and-swap. A range is never handed the
+ * same tasks twice, so a stale value can't compare equal (no ABA).
+ */
+struct work_range {
+    uint64_t val;
+} __attribute__((aligned(64)));
+
+#define RANGE(begin, end)       (((uint64_t)(end) << 32) | (uint32_t)(begin))
+#define RANGE_BEGIN(r)          ((uint32_t)(r))
+#define RANGE_END(r)            ((uint32_t)((r) >> 32))
+
+struct work_steal {
+    work_fn_t fn;
+    void *arg;
+    unsigned int nr_threads;
+    struct work_range *ranges;
+};
+
+struct work_thread {
+    pthread_t thread;
+    struct work_steal *ws;
+    unsigned int idx;
+    struct mem_account mem;
+    struct cs_stats events;
+    unsigned long max_depth[NR_CHILD_LAYOUTS];
+};
+
+/* Take the first task of range, if it has any left */
+static bool range_take(struct work_range *range, unsigned long *idx)
+{
+    uint64_t old = __atomic_load_n(&range->val, __ATOMIC_ACQUIRE);
+
+    do {
+        if (RANGE_BEGIN(old) >= RANGE_END(old))
+            return false;
+    } while (!__atomic_compare_exchange_n(&range->val, &old,
+                                          RANGE(RANGE_BEGIN(old) + 1,
+                                                RANGE_END(old)),
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    *idx = RANGE_BEGIN(old);
+    return true;
+}
+
+/*
+ * Move the back half of the tasks of the thread with the most left over
+ * to self, whose range is empty. False once there's nothing left anywhere.
+ */
+static bool range_steal(struct work_steal *ws, unsigned int self)
+{
+    for (;;) {
+        struct work_range *victim = NULL;
+        uint32_t most = 0, begin, end, take;
+        uint64_t old = 0;
+
+        for (unsigned int i = 0; i < ws->nr_threads; i++) {
+            uint64_t r = __atomic_load_n(&ws->ranges[i].val,
+                                         __ATOMIC_ACQUIRE);
+
+            if (i == self || RANGE_BEGIN(r) >= RANGE_END(r))
+                continue;
+            if (RANGE_END(r) - RANGE_BEGIN(r) > most) {
+                most = RANGE_END(r) - RANGE_BEGIN(r);
+                victim = &ws->ranges[i];
+                old = r;
+            }
+        }
+        if (!victim)
+            return false;
+
+        begin = RANGE_BEGIN(old);
+        end = RANGE_END(old);
+        take = (end - begin + 1) / 2;
+        if (__atomic_compare_exchange_n(&victim->val, &old,
+                                        RANGE(begin, end - take), false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&ws->ranges[self].val, RANGE(end - take, end),
+                             __ATOMIC_RELEASE);
+            return true;
+        }
+        /* Lost the race for it, look again */
+    }
+}
+
+static void work_steal__loop(struct work_steal *ws, unsigned int self)
+{
+    unsigned long idx;
+
+    do {
+        while (range_take(&ws->ranges[self], &idx))
+            ws->fn(ws->arg, idx);
+    } while (range_steal(ws, self));
+}
+
+static void *work_thread__run(void *arg)
+{
+    struct work_thread *t = arg;
+
+    mem_account = &t->mem;
+    cs_stats = &t->events;
+
+    work_steal__loop(t->ws, t->idx);
+
+    memcpy(t->max_depth, __max_depth, sizeof(t->max_depth));
+    return NULL;
+}
+
+void work_steal_run(unsigned long nr, unsigned int nr_threads, work_fn_t fn,
+                    void *arg)
+{
+    struct work_steal ws = { .fn = fn, .arg = arg };
+    struct work_thread *threads = NULL;
+    struct mem_account base;
+    unsigned int i, started;
+
+    if (nr_threads > nr)
+        nr_threads = nr;
+    if (nr > UINT32_MAX)
+        nr_threads = 1;
+    if (nr_threads > 1) {
+        ws.ranges = ccalloc(nr_threads, sizeof(*ws.ranges), MEM_OTHER);
+        threads = ccalloc(nr_threads, sizeof(*threads), MEM_OTHER);
+    }
+    if (!ws.ranges || !threads) {
+        for (unsigned long idx = 0; idx < nr; idx++)
+            fn(arg, idx);
+        cfree(ws.ranges, MEM_OTHER);
+        cfree(threads, MEM_OTHER);
+        return;
+    }
+
+    ws.nr_threads = nr_threads;
+    for (i = 0; i < nr_threads; i++)
+        ws.ranges[i].val = RANGE(nr * i / nr_threads,
+                                 nr * (i + 1) / nr_threads);
+
+    /*
+     * Thread 0 is this one. A thread that fails to start just leaves its
+     * share to be stolen.
+     */
+    base = *mem_account;
+    for (started = 1; started < nr_threads; started++) {
+        struct work_thread *t = &threads[started];
+
+        t->ws = &ws;
+        t->idx = started;
+        mem_account_fork(&t->mem, &base);
+        if (pthread_create(&t->thread, NULL, work_thread__run, t))
+            break;
+    }
+
+    work_steal__loop(&ws, 0);
+
+    for (i = 1; i < started; i++) {
+        struct work_thread *t = &threads[i];
+
+        pthread_join(t->thread, NULL);
+        mem_account_join(mem_account, &t->mem, &base);
+        cs_stats_add(cs_stats, &t->events);
+        for (int l = 0; l < NR_CHILD_LAYOUTS; l++) {
+            if (t->max_depth[l] > __max_depth[l])
+                __max_depth[l] = t->max_depth[l];
+        }
+    }
+
+    cfree(ws.ranges, MEM_OTHER);
+    cfree(threads, MEM_OTHER);
+}